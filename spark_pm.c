@@ -17,54 +17,478 @@
  */
 
 #include <gtk/gtk.h>
+#include <glib-unix.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "spbm_uapi.h"
+
+#define SAMPLE_MS 100                 // plot resolution, 10 Hz
+#define HIST_LEN  6000                // 10 minutes of samples per channel
 
-static GtkWidget *labels[6];          // 6 labels for power metrics
 static GtkWidget *status_label;       // status bar label
-static int sec_counter = 0;
-
-/* Read power value from file (micro watts -> watts) */
-static double read_val_w(const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (!f) return 0.0;
-    long val;
-    if (fscanf(f, "%ld", &val) != 1) {
+static int shown_sec = -1;            // elapsed seconds on the status bar
+static gint64 start_us;
+static const char *error_msg;         // shown instead of the elapsed time
+static char hwmon_dir[256];
+static int snap_fd = -1;              // hwmon "snapshot" attribute
+
+/*
+ * Every channel the driver labels gets a row, in driver order. Values
+ * are indexed like spbm_record.val: power channels (mW) first, then
+ * energy channels (mJ, extended to 64 bits here).
+ */
+enum group { GROUP_TELEMETRY, GROUP_LIMITS, GROUP_BUDGETS, GROUP_ENERGY, N_GROUPS };
+
+static const char *group_names[N_GROUPS] = {"Telemetry", "Power Limits",
+                                            "Power Budgets", "Energy"};
+
+struct metric {
+    char label[32];                   // driver label (powerN_label/energyN_label)
+    int idx;                          // index into the value array
+    enum group group;
+    GtkWidget *value;
+    gint64 shown;                     // value currently on screen
+};
+
+static struct metric metrics[SPBM_NR_CHANNELS];
+static int n_metrics;
+
+/* Friendlier names for the main rails; anything else shows its label */
+static const struct { const char *label, *name; } pretty_names[] = {
+    {"sys_total", "System Total"}, {"soc_pkg", "SoC Package"},
+    {"cpu_gpu", "CPU + GPU"}, {"cpu_p", "CPU P-Core"}, {"cpu_e", "CPU E-Core"},
+    {"vcore", "Vcore"}, {"vddq", "VDDQ"}, {"dc_input", "DC Input"},
+    {"gpu_out", "GPU Out"}, {"gpc_out", "GPC Out"}, {"gpu_in", "GPU In"},
+    {"gpc_in", "GPC In"}, {"sys_in", "System In"}, {"prereg_in", "Pre-Reg In"},
+    {"dla_in", "DLA In"}, {"dla_out", "DLA Out"}, {"pl1", "PL1"},
+    {"pl2", "PL2"}, {"syspl1", "System PL1"}, {"budget_cpu", "CPU"},
+    {"budget_gpu", "GPU"}, {"budget_cpu_e", "CPU E-Core"},
+    {"budget_cpu_p", "CPU P-Core"}, {"pkg", "Package"}, {"gpc", "GPC"},
+    {"gpm", "GPM"},
+};
+
+static const char *pretty_name(const char *label) {
+    for (size_t i = 0; i < G_N_ELEMENTS(pretty_names); i++)
+        if (!strcmp(pretty_names[i].label, label)) return pretty_names[i].name;
+    return label;
+}
+
+static enum group power_group(const char *label) {
+    if (!strncmp(label, "budget_", 7)) return GROUP_BUDGETS;
+    if (!strcmp(label, "pl1") || !strcmp(label, "pl2") || !strcmp(label, "syspl1"))
+        return GROUP_LIMITS;
+    return GROUP_TELEMETRY;
+}
+
+/* Read one line of a sysfs file into buf, stripping the newline */
+static int read_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    if (!fgets(buf, len, f)) {
         fclose(f);
-        return 0.0;
+        return -1;
     }
     fclose(f);
-    return val / 1000000.0;
-}
-
-/* Timer callback: update all values and status */
-static gboolean update_power(gpointer data) {
-    double values[6];
-    values[0] = read_val_w("/sys/class/hwmon/hwmon2/power2_input"); // soc_pkg
-    values[1] = read_val_w("/sys/class/hwmon/hwmon2/power1_input"); // sys_total
-    values[2] = read_val_w("/sys/class/hwmon/hwmon2/power4_input"); // cpu_p
-    values[3] = read_val_w("/sys/class/hwmon/hwmon2/power5_input"); // cpu_e
-    values[4] = read_val_w("/sys/class/hwmon/hwmon2/power6_input"); // vcore
-    values[5] = read_val_w("/sys/class/hwmon/hwmon2/power8_input"); // dc_input
-
-    for (int i = 0; i < 6; i++) {
-        gchar *text = g_strdup_printf("%.3f W", values[i]);
-        gtk_label_set_text(GTK_LABEL(labels[i]), text);
-        g_free(text);
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/* Find /sys/class/hwmon/hwmonN whose name is "spbm"; the index varies per boot */
+static int find_spbm_hwmon(char *path, size_t len) {
+    const char *env = getenv("SPBM_HWMON");
+    struct dirent *de;
+    char name[512], buf[64];
+    int ret = -1;
+    DIR *d;
+
+    // Override, e.g. with a directory that spbm-rec replay is filling
+    if (env && *env) {
+        snprintf(path, len, "%s", env);
+        return 0;
+    }
+    d = opendir("/sys/class/hwmon");
+    if (!d) return -1;
+    while ((de = readdir(d))) {
+        if (strncmp(de->d_name, "hwmon", 5)) continue;
+        snprintf(name, sizeof(name), "/sys/class/hwmon/%s/name", de->d_name);
+        if (read_line(name, buf, sizeof(buf)) || strcmp(buf, "spbm")) continue;
+        snprintf(path, len, "/sys/class/hwmon/%s", de->d_name);
+        ret = 0;
+        break;
+    }
+    closedir(d);
+    return ret;
+}
+
+static void add_metric(const char *type, int n, int idx, enum group group) {
+    struct metric *m = &metrics[n_metrics];
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/%s%d_label", hwmon_dir, type, n);
+    if (read_line(path, m->label, sizeof(m->label))) return;
+    m->idx = idx;
+    m->group = group == GROUP_ENERGY ? group : power_group(m->label);
+    m->shown = -1;
+    n_metrics++;
+}
+
+/* Discover the driver and its channels once, and open the snapshot */
+static const char *open_channels(void) {
+    char path[512];
+
+    if (find_spbm_hwmon(hwmon_dir, sizeof(hwmon_dir)))
+        return "spbm driver not found";
+    for (int i = 0; i < SPBM_NR_POWER; i++)
+        add_metric("power", i + 1, i, GROUP_TELEMETRY);
+    for (int i = 0; i < SPBM_NR_ENERGY; i++)
+        add_metric("energy", i + 1, SPBM_NR_POWER + i, GROUP_ENERGY);
+
+    snprintf(path, sizeof(path), "%s/snapshot", hwmon_dir);
+    snap_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (snap_fd < 0) return "spbm snapshot unavailable";
+    return n_metrics ? NULL : "no spbm channels found";
+}
+
+/* All channels from one pread() of the snapshot; mW, then mJ */
+static int read_snapshot(struct spbm_snapshot *snap, gint64 *vals) {
+    if (pread(snap_fd, snap, sizeof(*snap), 0) < (ssize_t)sizeof(*snap)) return -1;
+    for (int i = 0; i < SPBM_NR_POWER; i++)
+        vals[i] = snap->power[i];
+    for (int i = 0; i < SPBM_NR_ENERGY; i++)
+        vals[SPBM_NR_POWER + i] = snap->energy_uj[i] / 1000;
+    return 0;
+}
+
+/*
+ * Scrolling plots. Samples go into a preallocated ring, and each plot
+ * keeps a cairo surface with one column per sample, itself used as a
+ * ring: a new sample only paints its own column, and drawing blits the
+ * surface in two pieces starting at the oldest column. The trace is only
+ * rendered from scratch on resize or when the y range has to grow, so
+ * CPU and memory stay flat however long the monitor runs.
+ */
+struct plot {
+    GtkWidget *area;
+    cairo_surface_t *surface;         // NULL until the first resize
+    int width, height;
+    int col;                          // column of the newest sample
+    double max_w;                     // top of the y axis
+};
+
+static struct plot plots[SPBM_NR_POWER];
+static float history[SPBM_NR_POWER][HIST_LEN];   // watts
+static int hist_head;                 // next slot to write
+static int hist_len;
+
+static float hist_at(int ch, int age) {
+    return history[ch][(hist_head - 1 - age + HIST_LEN) % HIST_LEN];
+}
+
+static int plot_y(const struct plot *p, double w) {
+    int y = p->height - 1 - (int)(w / p->max_w * (p->height - 1));
+    return y < 0 ? 0 : y;
+}
+
+/* Paint column x for the sample `age` steps back, joined to the one before */
+static void plot_column(struct plot *p, cairo_t *cr, int ch, int x, int age) {
+    int y1 = plot_y(p, hist_at(ch, age));
+    int y0 = age + 1 < hist_len ? plot_y(p, hist_at(ch, age + 1)) : y1;
+    int top = y0 < y1 ? y0 : y1, bottom = y0 < y1 ? y1 : y0;
+
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_rectangle(cr, x, 0, 1, p->height);
+    cairo_fill(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_rgba(cr, 0.0, 0.4, 0.8, 0.15);
+    cairo_rectangle(cr, x, bottom, 1, p->height - bottom);
+    cairo_fill(cr);
+    cairo_set_source_rgba(cr, 0.0, 0.4, 0.8, 1.0);
+    cairo_rectangle(cr, x, top, 1, bottom - top + 1);
+    cairo_fill(cr);
+}
+
+/* Re-render the visible part of the history into the surface */
+static void plot_rebuild(struct plot *p, int ch) {
+    int n = hist_len < p->width ? hist_len : p->width;
+    cairo_t *cr;
+
+    if (!p->surface) return;
+    cr = cairo_create(p->surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    p->col = p->width - 1;
+    for (int age = n - 1; age >= 0; age--)
+        plot_column(p, cr, ch, p->width - 1 - age, age);
+    cairo_destroy(cr);
+    gtk_widget_queue_draw(p->area);
+}
+
+/* Add the newest sample of channel ch to its plot */
+static void plot_push(struct plot *p, int ch) {
+    double w = hist_at(ch, 0);
+    cairo_t *cr;
+
+    if (w > p->max_w) {
+        while (w > p->max_w) p->max_w *= 2;
+        plot_rebuild(p, ch);
+        return;
     }
+    if (!p->surface) return;
+    p->col = (p->col + 1) % p->width;
+    cr = cairo_create(p->surface);
+    plot_column(p, cr, ch, p->col, 0);
+    cairo_destroy(cr);
+    gtk_widget_queue_draw(p->area);
+}
+
+static void plot_draw(GtkDrawingArea *area, cairo_t *cr, int width, int height,
+                      gpointer data) {
+    struct plot *p = data;
+    int split = p->width - 1 - p->col;   // columns from the oldest to the end
+
+    if (!p->surface) return;
+    cairo_set_source_surface(cr, p->surface, -(p->col + 1), 0);
+    cairo_rectangle(cr, 0, 0, split, p->height);
+    cairo_fill(cr);
+    cairo_set_source_surface(cr, p->surface, split, 0);
+    cairo_rectangle(cr, split, 0, p->col + 1, p->height);
+    cairo_fill(cr);
+}
 
-    gchar *status = g_strdup_printf("Elapsed: %d sec", sec_counter++);
-    gtk_label_set_text(GTK_LABEL(status_label), status);
-    g_free(status);
+static void plot_resize(GtkDrawingArea *area, int width, int height,
+                        gpointer data) {
+    struct plot *p = data;
 
+    if (p->surface) cairo_surface_destroy(p->surface);
+    p->surface = NULL;
+    if (width <= 0 || height <= 0) return;
+    p->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    p->width = width;
+    p->height = height;
+    plot_rebuild(p, p - plots);
+}
+
+/* Append one sample of every power channel to the history and plots */
+static void history_push(const gint64 *vals) {
+    for (int i = 0; i < SPBM_NR_POWER; i++)
+        history[i][hist_head] = vals[i] / 1000.0f;
+    hist_head = (hist_head + 1) % HIST_LEN;
+    if (hist_len < HIST_LEN) hist_len++;
+    for (int i = 0; i < SPBM_NR_POWER; i++)
+        if (plots[i].area) plot_push(&plots[i], i);
+}
+
+/* Show the latest values and the status; labels only change with their text */
+static void show_values(const gint64 *vals) {
+    char text[32];
+    int sec;
+
+    for (int i = 0; i < n_metrics; i++) {
+        struct metric *m = &metrics[i];
+        gint64 v = vals[m->idx];
+
+        if (v == m->shown) continue;
+        m->shown = v;
+        g_snprintf(text, sizeof(text), "%" G_GINT64_FORMAT ".%03d %s",
+                   v / 1000, (int)(v % 1000), m->group == GROUP_ENERGY ? "J" : "W");
+        gtk_label_set_text(GTK_LABEL(m->value), text);
+    }
+
+    if (error_msg) {
+        gtk_label_set_text(GTK_LABEL(status_label), error_msg);
+        return;
+    }
+    sec = (g_get_monotonic_time() - start_us) / G_USEC_PER_SEC;
+    if (sec != shown_sec) {
+        shown_sec = sec;
+        g_snprintf(text, sizeof(text), "Elapsed: %d sec", sec);
+        gtk_label_set_text(GTK_LABEL(status_label), text);
+    }
+}
+
+/*
+ * Sampling. The preferred source is the driver's record stream on
+ * /dev/spbm: the fd sits in the main loop as a GSource and a watermark
+ * makes the driver wake us once per refresh period with a batch of
+ * records, which are decimated to SAMPLE_MS for the plots. Records carry
+ * the raw u32 energy counters, which are extended from a snapshot taken
+ * when the stream starts. Without the stream, the snapshot attribute is
+ * read once per refresh period instead.
+ * Either way sampling stops while the window is hidden or minimized.
+ */
+static const guint refresh_ms[] = {100, 250, 500, 1000, 2000, 5000};
+static const char *refresh_names[] = {"100 ms", "250 ms", "500 ms", "1 s",
+                                      "2 s", "5 s", NULL};
+static guint refresh_sel = 3;         // 1 s
+static guint source_id;               // GSource of the active sampler, 0 if none
+static int stream_fd = -1;
+static guint64 next_plot_ns;          // stream time of the next plot sample
+static gint64 stream_vals[SPBM_NR_CHANNELS];  // latest values from the stream
+static guint32 energy_raw[SPBM_NR_ENERGY];    // last raw counter seen
+static gboolean mapped, minimized;
+
+static struct spbm_record records[512];   // up to the driver's max watermark
+
+/* Stream callback: drain pending records */
+static gboolean on_stream(gint fd, GIOCondition cond, gpointer data) {
+    gboolean got = FALSE;
+    ssize_t n;
+
+    while ((n = read(fd, records, sizeof(records))) > 0) {
+        for (size_t r = 0; r < n / sizeof(records[0]); r++) {
+            const struct spbm_record *rec = &records[r];
+
+            for (int i = 0; i < SPBM_NR_POWER; i++)
+                if (rec->mask & (1u << i)) stream_vals[i] = rec->val[i];
+            for (int i = 0; i < SPBM_NR_ENERGY; i++) {
+                int idx = SPBM_NR_POWER + i;
+                gint32 delta = rec->val[idx] - energy_raw[i];
+                if (!(rec->mask & (1u << idx)) || delta <= 0) continue;
+                stream_vals[idx] += delta;   // wraps like the driver's counters
+                energy_raw[i] = rec->val[idx];
+            }
+            got = TRUE;
+            if (rec->timestamp_ns < next_plot_ns) continue;
+            if (rec->timestamp_ns - next_plot_ns > SAMPLE_MS * 1000000ull)
+                next_plot_ns = rec->timestamp_ns;
+            next_plot_ns += SAMPLE_MS * 1000000ull;
+            history_push(stream_vals);
+        }
+    }
+    if (got) show_values(stream_vals);
+    if (n < 0 && errno == EAGAIN)
+        return G_SOURCE_CONTINUE;
+
+    // Stream went away (driver unloaded); nothing more to read from it
+    close(stream_fd);
+    stream_fd = -1;
+    source_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Fallback timer callback: one snapshot pread() for all channels */
+static gboolean on_timer(gpointer data) {
+    gint64 vals[SPBM_NR_CHANNELS];
+    struct spbm_snapshot snap;
+
+    if (read_snapshot(&snap, vals)) return G_SOURCE_CONTINUE;
+    history_push(vals);
+    show_values(vals);
     return G_SOURCE_CONTINUE;
 }
 
+/* Open the record stream if it carries all our channels */
+static int stream_open(guint ms) {
+    char path[512], buf[64];
+    unsigned long mask, period_us;
+    struct spbm_snapshot snap;
+    guint32 watermark;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/sample_channels", hwmon_dir);
+    if (read_line(path, buf, sizeof(buf))) return -1;
+    mask = strtoul(buf, NULL, 0);
+    for (int i = 0; i < n_metrics; i++)
+        if (!(mask & (1ul << metrics[i].idx))) return -1;
+
+    // Locked mode records once per firmware cycle, not per sample period
+    snprintf(path, sizeof(path), "%s/sample_mode", hwmon_dir);
+    if (!read_line(path, buf, sizeof(buf)) && !strcmp(buf, "locked")) {
+        snprintf(path, sizeof(path), "%s/fw_period_us", hwmon_dir);
+        period_us = read_line(path, buf, sizeof(buf)) ? 100000 :
+                    strtoul(buf, NULL, 0);
+    } else {
+        snprintf(path, sizeof(path), "%s/sample_period_us", hwmon_dir);
+        if (read_line(path, buf, sizeof(buf))) return -1;
+        period_us = strtoul(buf, NULL, 0);
+    }
+    if (!period_us) return -1;
+
+    fd = open("/dev/spbm", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return -1;
+    watermark = ms * 1000ul / period_us;
+    if (watermark < 1) watermark = 1;
+    if (watermark > G_N_ELEMENTS(records)) watermark = G_N_ELEMENTS(records);
+    if (ioctl(fd, SPBM_IOC_SET_WATERMARK, &watermark)) {
+        close(fd);
+        return -1;
+    }
+
+    // Base for extending the raw energy counters in the records
+    if (read_snapshot(&snap, stream_vals)) {
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < SPBM_NR_ENERGY; i++)
+        energy_raw[i] = snap.energy[i];
+    return fd;
+}
+
+static void sampling_stop(void) {
+    if (source_id) g_source_remove(source_id);
+    source_id = 0;
+    // Closing the stream lets the driver stop its sampler
+    if (stream_fd >= 0) close(stream_fd);
+    stream_fd = -1;
+}
+
+/* (Re)start sampling if the window is visible, at the selected rate */
+static void sampling_update(void) {
+    guint ms = refresh_ms[refresh_sel];
+
+    sampling_stop();
+    if (!mapped || minimized || error_msg) return;
+
+    stream_fd = stream_open(ms);
+    if (stream_fd >= 0) {
+        next_plot_ns = 0;
+        // The main loop's first poll() attaches to the stream
+        source_id = g_unix_fd_add(stream_fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                  on_stream, NULL);
+    } else {
+        on_timer(NULL);
+        source_id = g_timeout_add(ms, on_timer, NULL);
+    }
+}
+
+static void on_map(GtkWidget *widget, gpointer data) {
+    mapped = GPOINTER_TO_INT(data);
+    sampling_update();
+}
+
+static void on_toplevel_state(GObject *surface, GParamSpec *pspec, gpointer data) {
+    gboolean min = !!(gdk_toplevel_get_state(GDK_TOPLEVEL(surface)) &
+                      GDK_TOPLEVEL_STATE_MINIMIZED);
+
+    if (min == minimized) return;
+    minimized = min;
+    sampling_update();
+}
+
+static void on_realize(GtkWidget *window, gpointer data) {
+    GdkSurface *surface = gtk_native_get_surface(GTK_NATIVE(window));
+
+    g_signal_connect(surface, "notify::state", G_CALLBACK(on_toplevel_state), NULL);
+}
+
+static void on_refresh_changed(GObject *dropdown, GParamSpec *pspec, gpointer data) {
+    refresh_sel = gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown));
+    if (refresh_sel >= G_N_ELEMENTS(refresh_ms)) refresh_sel = 3;
+    sampling_update();
+}
+
 /* Application activate callback */
 static void activate(GtkApplication *app, gpointer user_data) {
     GtkWidget *window = gtk_application_window_new(app);
     gtk_window_set_title(GTK_WINDOW(window), "DGX Spark Power Monitor");
-    gtk_window_set_default_size(GTK_WINDOW(window), 480, 360);
+    gtk_window_set_default_size(GTK_WINDOW(window), 760, 720);
 
     // Main vertical box container (margins use logical pixels, GTK automatically adapts to HiDPI)
     GtkWidget *main_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 16);
@@ -81,41 +505,88 @@ static void activate(GtkApplication *app, gpointer user_data) {
     gtk_center_box_set_center_widget(GTK_CENTER_BOX(title_box), title);
     gtk_box_append(GTK_BOX(main_box), title_box);
 
-    // ----- Card area (wrapping the metrics grid) -----
-    GtkWidget *frame = gtk_frame_new(NULL);
-    gtk_widget_add_css_class(frame, "card");
-    gtk_box_append(GTK_BOX(main_box), frame);
-
-    GtkWidget *grid = gtk_grid_new();
-    gtk_grid_set_column_spacing(GTK_GRID(grid), 32);
-    gtk_grid_set_row_spacing(GTK_GRID(grid), 12);
-    gtk_widget_set_margin_top(grid, 16);
-    gtk_widget_set_margin_bottom(grid, 16);
-    gtk_widget_set_margin_start(grid, 16);
-    gtk_widget_set_margin_end(grid, 16);
-    gtk_frame_set_child(GTK_FRAME(frame), grid);
-
-    const char *names[6] = {"SoC Package", "System Total", "CPU P-Core",
-                            "CPU E-Core", "Vcore", "DC Input"};
-
-    for (int i = 0; i < 6; i++) {
-        // Metric name
-        GtkWidget *name_label = gtk_label_new(names[i]);
-        gtk_widget_set_halign(name_label, GTK_ALIGN_START);
-        gtk_widget_set_valign(name_label, GTK_ALIGN_CENTER);
-        gtk_widget_add_css_class(name_label, "metric-name");
-        gtk_grid_attach(GTK_GRID(grid), name_label, 0, i, 1, 1);
-
-        // Value label
-        labels[i] = gtk_label_new("0.000 W");
-        gtk_widget_set_halign(labels[i], GTK_ALIGN_END);
-        gtk_widget_set_valign(labels[i], GTK_ALIGN_CENTER);
-        gtk_widget_add_css_class(labels[i], "metric-value");
-        gtk_grid_attach(GTK_GRID(grid), labels[i], 1, i, 1, 1);
+    // ----- Metric groups, one collapsible card each, scrolling if needed -----
+    error_msg = open_channels();
+
+    GtkWidget *scroll = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll), GTK_POLICY_NEVER,
+                                   GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_vexpand(scroll, TRUE);
+    gtk_box_append(GTK_BOX(main_box), scroll);
+
+    GtkWidget *groups_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scroll), groups_box);
+
+    for (int g = 0; g < N_GROUPS; g++) {
+        GtkWidget *grid = NULL;
+        int row = 0;
+
+        for (int i = 0; i < n_metrics; i++) {
+            struct metric *m = &metrics[i];
+            if (m->group != g) continue;
+
+            if (!grid) {
+                // Limits and budgets change rarely; start them collapsed
+                GtkWidget *expander = gtk_expander_new(group_names[g]);
+                gtk_expander_set_expanded(GTK_EXPANDER(expander),
+                                          g == GROUP_TELEMETRY || g == GROUP_ENERGY);
+                gtk_widget_add_css_class(expander, "group");
+                gtk_box_append(GTK_BOX(groups_box), expander);
+
+                GtkWidget *frame = gtk_frame_new(NULL);
+                gtk_widget_add_css_class(frame, "card");
+                gtk_expander_set_child(GTK_EXPANDER(expander), frame);
+
+                grid = gtk_grid_new();
+                gtk_grid_set_column_spacing(GTK_GRID(grid), 32);
+                gtk_grid_set_row_spacing(GTK_GRID(grid), 12);
+                gtk_widget_set_margin_top(grid, 16);
+                gtk_widget_set_margin_bottom(grid, 16);
+                gtk_widget_set_margin_start(grid, 16);
+                gtk_widget_set_margin_end(grid, 16);
+                gtk_frame_set_child(GTK_FRAME(frame), grid);
+            }
+
+            // Metric name
+            GtkWidget *name_label = gtk_label_new(pretty_name(m->label));
+            gtk_widget_set_tooltip_text(name_label, m->label);
+            gtk_widget_set_halign(name_label, GTK_ALIGN_START);
+            gtk_widget_set_valign(name_label, GTK_ALIGN_CENTER);
+            gtk_widget_add_css_class(name_label, "metric-name");
+            gtk_grid_attach(GTK_GRID(grid), name_label, 0, row, 1, 1);
+
+            // Value label
+            m->value = gtk_label_new(g == GROUP_ENERGY ? "0.000 J" : "0.000 W");
+            gtk_widget_set_halign(m->value, GTK_ALIGN_END);
+            gtk_widget_set_valign(m->value, GTK_ALIGN_CENTER);
+            gtk_widget_add_css_class(m->value, "metric-value");
+            gtk_grid_attach(GTK_GRID(grid), m->value, 1, row, 1, 1);
+
+            // History plot for power channels, as wide as the window allows
+            if (g != GROUP_ENERGY) {
+                struct plot *p = &plots[m->idx];
+
+                p->max_w = 1.0;
+                p->area = gtk_drawing_area_new();
+                gtk_drawing_area_set_content_width(GTK_DRAWING_AREA(p->area), 240);
+                gtk_drawing_area_set_content_height(GTK_DRAWING_AREA(p->area), 36);
+                gtk_widget_set_hexpand(p->area, TRUE);
+                gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(p->area),
+                                               plot_draw, p, NULL);
+                g_signal_connect(p->area, "resize", G_CALLBACK(plot_resize), p);
+                gtk_grid_attach(GTK_GRID(grid), p->area, 2, row, 1, 1);
+            }
+            row++;
+        }
     }
 
-    // ----- Status bar (right-aligned) -----
+    // ----- Status bar (refresh rate left, status right-aligned) -----
     GtkWidget *status_box = gtk_center_box_new();
+    GtkWidget *refresh = gtk_drop_down_new_from_strings(refresh_names);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(refresh), refresh_sel);
+    gtk_widget_set_tooltip_text(refresh, "Refresh rate");
+    g_signal_connect(refresh, "notify::selected", G_CALLBACK(on_refresh_changed), NULL);
+    gtk_center_box_set_start_widget(GTK_CENTER_BOX(status_box), refresh);
     status_label = gtk_label_new("Elapsed: 0 sec");
     gtk_widget_add_css_class(status_label, "status");
     gtk_center_box_set_end_widget(GTK_CENTER_BOX(status_box), status_label);
@@ -141,6 +612,11 @@ static void activate(GtkApplication *app, gpointer user_data) {
         "   border: 1px solid @borders;"
         "   box-shadow: 0 2px 8px rgba(0,0,0,0.1);"
         "}"
+        ".group > title {"
+        "   font-weight: 600;"
+        "   font-size: 12pt;"
+        "   margin-bottom: 6px;"
+        "}"
         ".metric-name {"
         "   font-family: inherit;"
         "   font-weight: 500;"
@@ -168,8 +644,12 @@ static void activate(GtkApplication *app, gpointer user_data) {
         GTK_STYLE_PROVIDER(provider),
         GTK_STYLE_PROVIDER_PRIORITY_USER);
 
-    // Start timer (update every second)
-    g_timeout_add_seconds(1, update_power, NULL);
+    // Sample only while the window is on screen
+    start_us = g_get_monotonic_time();
+    if (error_msg) gtk_label_set_text(GTK_LABEL(status_label), error_msg);
+    g_signal_connect(window, "map", G_CALLBACK(on_map), GINT_TO_POINTER(TRUE));
+    g_signal_connect(window, "unmap", G_CALLBACK(on_map), GINT_TO_POINTER(FALSE));
+    g_signal_connect(window, "realize", G_CALLBACK(on_realize), NULL);
 
     gtk_window_present(GTK_WINDOW(window));
 }
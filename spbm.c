@@ -18,6 +18,8 @@
  *   sudo modprobe spbm   (or auto-loaded via DKMS + udev)
  *   sensors spbm-*
  *   cat /sys/class/hwmon/hwmonN/power1_input   # microwatts
+ *   read(/dev/spbm)                            # struct spbm_record stream
+ *   mmap(/dev/spbm)                            # raw SPBM page, read-only
  *
  * Discovered by reverse-engineering the DSDT _DSM for NVDA8800.
  * No upstream driver exists as of kernel 7.0.
@@ -25,131 +27,2823 @@
 
 #include <linux/module.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
 #include <linux/io.h>
 #include <linux/acpi.h>
 #include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/perf_event.h>
+#include <linux/cpumask.h>
+#include <linux/cpuhotplug.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/sysfs.h>
+#include <linux/timekeeping.h>
+#include <linux/atomic.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/debugfs.h>
+#include <linux/jump_label.h>
+#include <linux/log2.h>
+#include <linux/overflow.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+
+#include "spbm_uapi.h"
 
 #define DRIVER_NAME	"spbm"
 #define SPBM_SIZE	0x1000
 
-/* SPBM _CRS memory resource index (0-based) */
-#define SPBM_RES_IDX	1
+/* SPBM _CRS memory resource index (0-based) */
+#define SPBM_RES_IDX	1
+
+/*
+ * Register offsets of the gb10 layout, see spbm_layouts[]. Firmware
+ * writes milliwatts for power, millijoules (cumulative) for energy.
+ * hwmon expects microwatts and microjoules respectively.
+ */
+
+/* Instantaneous power telemetry */
+#define TE_SYS_TOTAL	0x300
+#define TE_SOC_PKG	0x304
+#define TE_C_AND_G	0x308
+#define TE_CPU_P	0x30C
+#define TE_CPU_E	0x310
+#define TE_VCORE	0x314
+#define TE_VDDQ	0x318
+#define TE_CHR		0x31C
+#define TE_GPC_OUT	0x320
+#define TE_GPU_OUT	0x324
+#define TE_GPC_IN	0x328
+#define TE_GPU_IN	0x32C
+#define TE_SYS_IN	0x330
+#define TE_DLA_IN	0x334
+#define TE_PREREG_IN	0x338
+#define TE_DLA_OUT	0x33C
+
+/* Energy accumulators */
+#define EN_PKG		0x344
+#define EN_CPU_E	0x350
+#define EN_CPU_P	0x35C
+#define EN_GPC		0x368
+#define EN_GPM		0x374
+
+/* Power limits (effective, milliwatts) */
+#define PL1_EFF		0x160
+#define PL2_EFF		0x164
+#define SYSPL1_EFF	0x170
+
+/* Power budgets */
+#define BUD_CPU		0x600
+#define BUD_GPU		0x604
+#define BUD_CPU_E	0x680
+#define BUD_CPU_P	0x684
+
+/* Channel flags */
+#define SPBM_CHAN_LIVE	BIT(0)	/* never 0 on a running system */
+
+struct spbm_chan {
+	const char *label;
+	u8 flags;
+};
+
+/* Power channel indices, also the hwmon numbering (powerN = index + 1) */
+enum {
+	PWR_SYS_TOTAL, PWR_SOC_PKG, PWR_C_AND_G, PWR_CPU_P, PWR_CPU_E,
+	PWR_VCORE, PWR_VDDQ, PWR_CHR, PWR_GPU_OUT, PWR_GPC_OUT, PWR_GPU_IN,
+	PWR_GPC_IN, PWR_SYS_IN, PWR_PREREG_IN, PWR_DLA_IN, PWR_DLA_OUT,
+	PWR_PL1, PWR_PL2, PWR_SYSPL1,
+	PWR_BUD_CPU, PWR_BUD_GPU, PWR_BUD_CPU_E, PWR_BUD_CPU_P,
+};
+
+/* Energy channel indices (energyN = index + 1) */
+enum { NRG_PKG, NRG_CPU_E, NRG_CPU_P, NRG_GPC, NRG_GPM };
+
+static const struct spbm_chan pwr_chans[] = {
+	[PWR_SYS_TOTAL] = { "sys_total", SPBM_CHAN_LIVE },
+	[PWR_SOC_PKG]   = { "soc_pkg", SPBM_CHAN_LIVE },
+	[PWR_C_AND_G]   = { "cpu_gpu" },
+	[PWR_CPU_P]     = { "cpu_p" },
+	[PWR_CPU_E]     = { "cpu_e" },
+	[PWR_VCORE]     = { "vcore", SPBM_CHAN_LIVE },
+	[PWR_VDDQ]      = { "vddq", SPBM_CHAN_LIVE },
+	[PWR_CHR]       = { "dc_input", SPBM_CHAN_LIVE },
+	[PWR_GPU_OUT]   = { "gpu_out" },
+	[PWR_GPC_OUT]   = { "gpc_out" },
+	[PWR_GPU_IN]    = { "gpu_in" },
+	[PWR_GPC_IN]    = { "gpc_in" },
+	[PWR_SYS_IN]    = { "sys_in" },
+	[PWR_PREREG_IN] = { "prereg_in" },
+	[PWR_DLA_IN]    = { "dla_in" },
+	[PWR_DLA_OUT]   = { "dla_out" },
+	[PWR_PL1]       = { "pl1" },
+	[PWR_PL2]       = { "pl2" },
+	[PWR_SYSPL1]    = { "syspl1" },
+	[PWR_BUD_CPU]   = { "budget_cpu" },
+	[PWR_BUD_GPU]   = { "budget_gpu" },
+	[PWR_BUD_CPU_E] = { "budget_cpu_e" },
+	[PWR_BUD_CPU_P] = { "budget_cpu_p" },
+};
+#define N_PWR ARRAY_SIZE(pwr_chans)
+
+/* The first N_TE power channels are TE_* telemetry, the rest limits */
+#define N_TE	(PWR_DLA_OUT + 1)
+
+/* Accumulators only count up from boot, so none of them reads 0 */
+static const struct spbm_chan nrg_chans[] = {
+	[NRG_PKG]   = { "pkg", SPBM_CHAN_LIVE },
+	[NRG_CPU_E] = { "cpu_e", SPBM_CHAN_LIVE },
+	[NRG_CPU_P] = { "cpu_p", SPBM_CHAN_LIVE },
+	[NRG_GPC]   = { "gpc", SPBM_CHAN_LIVE },
+	[NRG_GPM]   = { "gpm", SPBM_CHAN_LIVE },
+};
+#define N_NRG ARRAY_SIZE(nrg_chans)
+
+/*
+ * Firmware layouts: the register offset of every channel, by unified
+ * index (power channels, then energy). One is picked at probe from the
+ * device's _HRV, see spbm_layout_init(). Specific revisions go first;
+ * the last entry matches any revision.
+ */
+#define SPBM_HRV_ANY	U64_MAX
+#define NRG(i)		(SPBM_NR_POWER + (i))
+
+struct spbm_layout {
+	const char *name;
+	u64 hrv;
+	u32 off[SPBM_NR_CHANNELS];
+};
+
+static const struct spbm_layout spbm_layouts[] = {
+	{
+		.name = "gb10",
+		.hrv = SPBM_HRV_ANY,
+		.off = {
+			[PWR_SYS_TOTAL] = TE_SYS_TOTAL,
+			[PWR_SOC_PKG]   = TE_SOC_PKG,
+			[PWR_C_AND_G]   = TE_C_AND_G,
+			[PWR_CPU_P]     = TE_CPU_P,
+			[PWR_CPU_E]     = TE_CPU_E,
+			[PWR_VCORE]     = TE_VCORE,
+			[PWR_VDDQ]      = TE_VDDQ,
+			[PWR_CHR]       = TE_CHR,
+			[PWR_GPU_OUT]   = TE_GPU_OUT,
+			[PWR_GPC_OUT]   = TE_GPC_OUT,
+			[PWR_GPU_IN]    = TE_GPU_IN,
+			[PWR_GPC_IN]    = TE_GPC_IN,
+			[PWR_SYS_IN]    = TE_SYS_IN,
+			[PWR_PREREG_IN] = TE_PREREG_IN,
+			[PWR_DLA_IN]    = TE_DLA_IN,
+			[PWR_DLA_OUT]   = TE_DLA_OUT,
+			[PWR_PL1]       = PL1_EFF,
+			[PWR_PL2]       = PL2_EFF,
+			[PWR_SYSPL1]    = SYSPL1_EFF,
+			[PWR_BUD_CPU]   = BUD_CPU,
+			[PWR_BUD_GPU]   = BUD_GPU,
+			[PWR_BUD_CPU_E] = BUD_CPU_E,
+			[PWR_BUD_CPU_P] = BUD_CPU_P,
+			[NRG(NRG_PKG)]   = EN_PKG,
+			[NRG(NRG_CPU_E)] = EN_CPU_E,
+			[NRG(NRG_CPU_P)] = EN_CPU_P,
+			[NRG(NRG_GPC)]   = EN_GPC,
+			[NRG(NRG_GPM)]   = EN_GPM,
+		},
+	},
+};
+
+/*
+ * Derived power channels, one per energy accumulator, reported as
+ * powerN_average after the raw channels (power24 = pkg_avg, ...).
+ */
+static const char * const avg_labels[] = {
+	"pkg_avg", "cpu_e_avg", "cpu_p_avg", "gpc_avg", "gpm_avg",
+};
+#define N_AVG ARRAY_SIZE(avg_labels)
+
+static_assert(N_PWR == SPBM_NR_POWER);
+static_assert(N_NRG == SPBM_NR_ENERGY);
+static_assert(N_AVG == N_NRG);
+
+/*
+ * Limited power domains: each effective limit or budget and the
+ * telemetry channels whose sum it caps. Bit i of the "limited" attribute
+ * is spbm_domains[i].
+ */
+struct spbm_domain {
+	const char *name;
+	u8 limit;
+	u8 draw[2];
+	u8 ndraw;
+};
+
+static const struct spbm_domain spbm_domains[] = {
+	{ "pl1",          PWR_PL1,       { PWR_SOC_PKG }, 1 },
+	{ "pl2",          PWR_PL2,       { PWR_SOC_PKG }, 1 },
+	{ "syspl1",       PWR_SYSPL1,    { PWR_SYS_TOTAL }, 1 },
+	{ "budget_cpu",   PWR_BUD_CPU,   { PWR_CPU_P, PWR_CPU_E }, 2 },
+	{ "budget_gpu",   PWR_BUD_GPU,   { PWR_GPU_OUT }, 1 },
+	{ "budget_cpu_e", PWR_BUD_CPU_E, { PWR_CPU_E }, 1 },
+	{ "budget_cpu_p", PWR_BUD_CPU_P, { PWR_CPU_P }, 1 },
+};
+#define N_DOM ARRAY_SIZE(spbm_domains)
+
+/* Channels smoothed by the worker, see spbm_ewma_update() */
+static const u8 ewma_chans[] = {
+	PWR_SYS_TOTAL, PWR_SOC_PKG, PWR_CPU_P, PWR_GPU_OUT,
+};
+#define N_EWMA_CH ARRAY_SIZE(ewma_chans)
+#define N_EWMA	3	/* time constants per channel */
+
+#define SPBM_AVG_HIST		600	/* worker samples kept for averages */
+
+struct spbm_nrg_hist {
+	u64 ts_ns;
+	u64 acc[N_NRG];
+};
+
+/* Read paths accounted in debugfs "stats" */
+enum spbm_path {
+	SPBM_PATH_MMIO,		/* one ioread32(), averaged over a pass */
+	SPBM_PATH_HWMON,	/* spbm_read(), end to end */
+	SPBM_PATH_SNAPSHOT,	/* snapshot attribute read */
+	SPBM_PATH_STREAM,	/* one record out of the ring */
+	SPBM_NR_PATHS,
+};
+
+#define SPBM_LAT_BUCKETS	24	/* [2^i, 2^(i+1)) ns, the last open */
+
+struct spbm_path_stats {
+	atomic64_t count;
+	atomic64_t total_ns;
+	atomic64_t hist[SPBM_LAT_BUCKETS];
+};
+
+struct spbm_priv {
+	void __iomem *base;
+	resource_size_t phys;
+	struct miscdevice misc;
+
+	/* channel layout, fixed at probe */
+	const char *layout;
+	bool layout_custom;		/* chan_offsets= applied */
+	u32 off[SPBM_NR_CHANNELS];
+	u32 valid;			/* channels that are not dead */
+
+	/* periodic worker, update_interval in ms */
+	struct delayed_work poll_work;
+	unsigned int update_interval;
+
+	/* 64-bit extension of the u32 EN_* accumulators, in mJ */
+	spinlock_t nrg_lock;
+	u32 nrg_last[N_NRG];
+	u64 nrg_acc[N_NRG];
+
+	/* energy history for powerN_average, under nrg_lock */
+	struct spbm_nrg_hist *hist;
+	unsigned int hist_head;		/* next slot to write */
+	unsigned int hist_len;
+	unsigned int avg_interval[N_AVG];	/* ms */
+
+	/* TE_* integrated by the worker (sample and hold), under nrg_lock */
+	u64 pwr_acc[N_TE];	/* uJ */
+	u32 pwr_last[N_TE];	/* mW */
+	u64 pwr_last_ns;
+
+	/* last coherent snapshot, see spbm_snapshot_get() */
+	seqlock_t snap_lock;
+	struct spbm_snapshot snap;
+	struct mutex refresh_lock;	/* one refresh at a time */
+	unsigned int cache_ms;		/* snapshot lifetime */
+
+	/* limit headroom, evaluated by the worker */
+	struct device *hwdev;		/* for sysfs_notify, NULL when gone */
+	unsigned int limit_pct;		/* "near the limit" margin */
+	unsigned int limit_samples;	/* consecutive samples to be limited */
+	unsigned int lim_count[N_DOM];
+	unsigned long limited;		/* bit per spbm_domains[] entry */
+
+	/* powerN_max/crit and the alarms the worker latches from them */
+	u32 pwr_max[N_TE];		/* mW, 0 = off */
+	u32 pwr_crit[N_TE];		/* mW, 0 = off */
+	unsigned long max_alarm;	/* bit per TE_* channel */
+	unsigned long crit_alarm;
+
+	/* EWMAs of ewma_chans[], mW << SPBM_EWMA_SHIFT, written by the worker */
+	u64 ewma[N_EWMA_CH][N_EWMA];
+	unsigned int ewma_tau[N_EWMA];	/* ms */
+	u64 ewma_last_ns;
+
+	/* debugfs instrumentation, only counted while spbm_stats_on */
+	struct dentry *debugfs;
+	struct spbm_path_stats stats[SPBM_NR_PATHS];
+	atomic64_t cache_hits;
+	atomic64_t cache_misses;
+	atomic64_t torn;		/* coherent reads that never settled */
+	struct mutex bench_lock;
+	unsigned int bench_reads;	/* per channel, last run */
+	u64 bench_ps[SPBM_NR_CHANNELS];	/* ps per ioread32() */
+
+	/* perf PMU */
+	struct pmu pmu;
+	unsigned int pmu_cpu;		/* events are all bound to it */
+	struct hlist_node cpuhp_node;
+	struct attribute_group pmu_events;
+	const struct attribute_group *pmu_groups[4];
+
+	/* streaming sampler */
+	struct hrtimer timer;
+	unsigned int period_us;
+	u32 chan_mask;
+	struct spbm_stream *stream;
+
+	/* phase-locked sampling, timer context except where noted */
+	bool lock_mode;			/* requested through sample_mode */
+	bool lk_active;			/* lock_mode as the timer last saw it */
+	bool lk_primed;			/* lk_probe holds a reading */
+	bool lk_locked;			/* read by sysfs */
+	int lk_chan;			/* channel watched for updates */
+	u32 lk_probe;
+	u64 lk_prev_ns;			/* previous probe read */
+	u64 lk_edge_ns;			/* last bracketed firmware update */
+	u64 lk_period_ns;		/* estimate, read by sysfs */
+	u64 lk_jitter_ns;		/* mean deviation, read by sysfs */
+	u64 lk_lead_ns;			/* wake this early before an update */
+	unsigned int lk_good;		/* consistent intervals in a row */
+};
+
+/* bin_attribute callbacks take a const attribute since 6.13 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+#define SPBM_BIN_ATTR	const struct bin_attribute
+#else
+#define SPBM_BIN_ATTR	struct bin_attribute
+#endif
+
+/* attribute_group::bin_attrs went const through bin_attrs_new in 6.13-6.15 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+#define SPBM_GROUP_BIN_ATTRS	bin_attrs
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+#define SPBM_GROUP_BIN_ATTRS	bin_attrs_new
+#else
+#define SPBM_GROUP_BIN_ATTRS	bin_attrs
+#endif
+
+/*
+ * Energy accumulators. The firmware counters are u32 millijoules and
+ * wrap after ~12 h at 100 W, ~1.2 h at 1 kW. Every sample folds the raw
+ * value into a 64-bit accumulator, and the periodic worker makes sure
+ * that happens far more often than half a wrap, the largest step the
+ * fold takes as forward. Samples taken concurrently may be folded out
+ * of order; a step backwards is ignored rather than counted as a wrap.
+ */
+
+#define SPBM_INTERVAL_MIN_MS	10
+#define SPBM_INTERVAL_MAX_MS	60000	/* vs ~36 min half-wrap at 1 kW */
+#define SPBM_AVG_MAX_MS		3600000
+
+static u64 spbm_energy_fold(struct spbm_priv *p, int ch, u32 raw)
+{
+	unsigned long flags;
+	u64 acc;
+
+	spin_lock_irqsave(&p->nrg_lock, flags);
+	if ((s32)(raw - p->nrg_last[ch]) > 0) {
+		p->nrg_acc[ch] += raw - p->nrg_last[ch];
+		p->nrg_last[ch] = raw;
+	}
+	acc = p->nrg_acc[ch];
+	spin_unlock_irqrestore(&p->nrg_lock, flags);
+
+	return acc;
+}
+
+static u64 spbm_energy_read(struct spbm_priv *p, int ch)
+{
+	return spbm_energy_fold(p, ch, ioread32(p->base + p->off[N_PWR + ch]));
+}
+
+/*
+ * Instrumentation for debugfs. The static key keeps the cost at a
+ * patched-out branch per read until someone enables stats_enable.
+ */
+
+static DEFINE_STATIC_KEY_FALSE(spbm_stats_on);
+
+static u64 spbm_stat_start(void)
+{
+	return static_branch_unlikely(&spbm_stats_on) ? ktime_get_ns() : 0;
+}
+
+/* Account @n operations of @path that together took from @t0 to now */
+static void spbm_stat_end(struct spbm_priv *p, enum spbm_path path, u64 t0,
+			  unsigned int n)
+{
+	struct spbm_path_stats *st = &p->stats[path];
+	u64 ns;
+
+	if (!static_branch_unlikely(&spbm_stats_on) || !t0 || !n)
+		return;
+	ns = ktime_get_ns() - t0;
+	atomic64_add(n, &st->count);
+	atomic64_add(ns, &st->total_ns);
+	ns = div_u64(ns, n);
+	atomic64_inc(&st->hist[min(ns ? ilog2(ns) : 0, SPBM_LAT_BUCKETS - 1)]);
+}
+
+static void spbm_stat_inc(atomic64_t *c)
+{
+	if (static_branch_unlikely(&spbm_stats_on))
+		atomic64_inc(c);
+}
+
+/*
+ * Coherent snapshots. The firmware rewrites the telemetry block once per
+ * PID loop period and publishes no sequence or timestamp word, so a
+ * single pass over the registers can straddle an update and mix two
+ * cycles. Passes are repeated until two in a row agree, meaning no
+ * update landed in between. The result is cached under snap_lock, and
+ * hwmon attributes, the snapshot attribute, the worker and the stream
+ * all take their channels from one such snapshot.
+ */
+
+#define SPBM_ALL_CHANNELS	GENMASK(SPBM_NR_CHANNELS - 1, 0)
+#define SPBM_COHERENT_PASSES	5
+#define SPBM_CACHE_MAX_MS	60000
+
+static unsigned int cache_ms = 100;	/* firmware PID loop period */
+module_param(cache_ms, uint, 0444);
+MODULE_PARM_DESC(cache_ms, "Initial snapshot cache lifetime in ms (0 = off)");
+
+/* Dead channels are never read and stay 0 */
+static void spbm_read_pass(struct spbm_priv *p, u32 mask, u32 *val)
+{
+	u64 t0 = spbm_stat_start();
+	int i;
+
+	mask &= p->valid;
+	for (i = 0; i < SPBM_NR_CHANNELS; i++)
+		val[i] = (mask & BIT(i)) ? ioread32(p->base + p->off[i]) : 0;
+	spbm_stat_end(p, SPBM_PATH_MMIO, t0, hweight32(mask));
+}
+
+/* Read the channels in @mask from one firmware cycle; false if torn */
+static bool spbm_read_coherent(struct spbm_priv *p, u32 mask, u32 *val)
+{
+	u32 prev[SPBM_NR_CHANNELS];
+	int pass;
+
+	spbm_read_pass(p, mask, prev);
+	for (pass = 1; pass < SPBM_COHERENT_PASSES; pass++) {
+		spbm_read_pass(p, mask, val);
+		if (!memcmp(prev, val, sizeof(prev)))
+			return true;
+		memcpy(prev, val, sizeof(prev));
+	}
+	spbm_stat_inc(&p->torn);
+	return false;
+}
+
+/*
+ * Layout selection and channel probing. layout= forces a table entry by
+ * name, and chan_offsets= overrides single offsets on top of it, as in
+ * "power2=0x304,energy1=0x344", so a firmware that moved a register
+ * works without a rebuild. A channel reading 0xFFFFFFFF at probe, or 0
+ * if it is one that is never 0, is dead: it is hidden from hwmon and
+ * never read again.
+ */
+
+static char *layout;
+module_param(layout, charp, 0444);
+MODULE_PARM_DESC(layout, "Force a register layout by name (default: by _HRV)");
+
+static char *chan_offsets;
+module_param(chan_offsets, charp, 0444);
+MODULE_PARM_DESC(chan_offsets, "Register offset overrides, e.g. power2=0x304,energy1=0x344");
+
+static bool probe_channels = true;
+module_param(probe_channels, bool, 0444);
+MODULE_PARM_DESC(probe_channels, "Hide channels that read as dead at probe");
+
+static u8 spbm_chan_flags(int i)
+{
+	return i < N_PWR ? pwr_chans[i].flags : nrg_chans[i - N_PWR].flags;
+}
+
+static const struct spbm_layout *spbm_layout_find(struct acpi_device *adev)
+{
+	struct device *dev = &adev->dev;
+	unsigned long long hrv;
+	int i;
+
+	if (layout && *layout) {
+		for (i = 0; i < ARRAY_SIZE(spbm_layouts); i++)
+			if (!strcmp(spbm_layouts[i].name, layout))
+				return &spbm_layouts[i];
+		dev_err(dev, "unknown layout \"%s\"\n", layout);
+		return NULL;
+	}
+
+	if (ACPI_FAILURE(acpi_evaluate_integer(adev->handle, "_HRV", NULL,
+					       &hrv)))
+		hrv = SPBM_HRV_ANY;
+	for (i = 0; i < ARRAY_SIZE(spbm_layouts); i++) {
+		if (spbm_layouts[i].hrv == hrv)
+			return &spbm_layouts[i];
+		if (spbm_layouts[i].hrv == SPBM_HRV_ANY) {
+			if (hrv != SPBM_HRV_ANY)
+				dev_warn(dev, "unknown _HRV %llu, assuming %s layout\n",
+					 hrv, spbm_layouts[i].name);
+			return &spbm_layouts[i];
+		}
+	}
+	return NULL;
+}
+
+static int spbm_parse_offsets(struct device *dev, struct spbm_priv *p)
+{
+	char *buf, *s, *ent;
+	int ret = 0;
+
+	if (!chan_offsets || !*chan_offsets)
+		return 0;
+	buf = kstrdup(chan_offsets, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	s = buf;
+	while ((ent = strsep(&s, ","))) {
+		unsigned int n, off, base, max;
+		char *num, *eq;
+
+		if (!*ent)
+			continue;
+		if (!strncmp(ent, "power", 5)) {
+			num = ent + 5;
+			base = 0;
+			max = N_PWR;
+		} else if (!strncmp(ent, "energy", 6)) {
+			num = ent + 6;
+			base = N_PWR;
+			max = N_NRG;
+		} else {
+			goto bad;
+		}
+		eq = strchr(num, '=');
+		if (!eq)
+			goto bad;
+		*eq = '\0';
+		if (kstrtouint(num, 10, &n) || !n || n > max ||
+		    kstrtouint(eq + 1, 0, &off) || off >= SPBM_SIZE || off % 4) {
+			*eq = '=';
+			goto bad;
+		}
+		p->off[base + n - 1] = off;
+		p->layout_custom = true;
+	}
+	goto out;
+
+bad:
+	dev_err(dev, "bad chan_offsets entry \"%s\"\n", ent);
+	ret = -EINVAL;
+out:
+	kfree(buf);
+	return ret;
+}
+
+static int spbm_layout_init(struct acpi_device *adev, struct spbm_priv *p)
+{
+	const struct spbm_layout *l = spbm_layout_find(adev);
+	struct device *dev = &adev->dev;
+	u32 val[SPBM_NR_CHANNELS];
+	int i, ret;
+
+	if (!l)
+		return -EINVAL;
+	p->layout = l->name;
+	memcpy(p->off, l->off, sizeof(p->off));
+	ret = spbm_parse_offsets(dev, p);
+	if (ret)
+		return ret;
+
+	p->valid = SPBM_ALL_CHANNELS;
+	if (!probe_channels)
+		return 0;
+
+	spbm_read_coherent(p, SPBM_ALL_CHANNELS, val);
+	for (i = 0; i < SPBM_NR_CHANNELS; i++)
+		if (val[i] == 0xFFFFFFFF ||
+		    (!val[i] && (spbm_chan_flags(i) & SPBM_CHAN_LIVE)))
+			p->valid &= ~BIT(i);
+	if (p->valid != SPBM_ALL_CHANNELS)
+		dev_info(dev, "hiding dead channels, mask 0x%08lx\n",
+			 ~p->valid & SPBM_ALL_CHANNELS);
+	return 0;
+}
+
+static bool spbm_chan_live(const struct spbm_priv *p, int i)
+{
+	return p->valid & BIT(i);
+}
+
+/* Fill @s from a full coherent read, folding the energy counters */
+static void spbm_build(struct spbm_priv *p, const u32 *val, u64 ts,
+		       struct spbm_snapshot *s)
+{
+	int i;
+
+	s->version = SPBM_SNAPSHOT_VERSION;
+	s->size = sizeof(*s);
+	s->timestamp_ns = ts;
+	for (i = 0; i < N_PWR; i++)
+		s->power[i] = val[i];
+	for (i = 0; i < N_NRG; i++) {
+		s->energy[i] = val[N_PWR + i];
+		s->energy_uj[i] = spbm_energy_fold(p, i, s->energy[i]) * 1000;
+	}
+}
+
+static void spbm_publish(struct spbm_priv *p, const struct spbm_snapshot *s)
+{
+	unsigned long flags;
+
+	write_seqlock_irqsave(&p->snap_lock, flags);
+	if (s->timestamp_ns > p->snap.timestamp_ns)
+		p->snap = *s;
+	write_sequnlock_irqrestore(&p->snap_lock, flags);
+}
+
+static void spbm_capture(struct spbm_priv *p, struct spbm_snapshot *s)
+{
+	u32 val[SPBM_NR_CHANNELS];
+
+	/* a torn read is still the best there is; the next one replaces it */
+	spbm_read_coherent(p, SPBM_ALL_CHANNELS, val);
+	spbm_build(p, val, ktime_get_ns(), s);
+	spbm_publish(p, s);
+}
+
+static void spbm_snapshot_cached(struct spbm_priv *p, struct spbm_snapshot *s)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&p->snap_lock);
+		*s = p->snap;
+	} while (read_seqretry(&p->snap_lock, seq));
+}
+
+/*
+ * Latest snapshot, taking a new one if the cached one is older than
+ * cache_ms. Concurrent callers wait for a single refresh instead of each
+ * reading the window, so MMIO traffic is bounded by one full read per
+ * cache_ms however many readers there are.
+ */
+static void spbm_snapshot_get(struct spbm_priv *p, struct spbm_snapshot *s)
+{
+	u64 max_age = (u64)READ_ONCE(p->cache_ms) * NSEC_PER_MSEC;
+
+	spbm_snapshot_cached(p, s);
+	if (ktime_get_ns() - s->timestamp_ns < max_age) {
+		spbm_stat_inc(&p->cache_hits);
+		return;
+	}
+
+	mutex_lock(&p->refresh_lock);
+	spbm_snapshot_cached(p, s);
+	if (ktime_get_ns() - s->timestamp_ns >= max_age) {
+		spbm_stat_inc(&p->cache_misses);
+		spbm_capture(p, s);
+	} else {
+		/* refreshed by whoever held the lock */
+		spbm_stat_inc(&p->cache_hits);
+	}
+	mutex_unlock(&p->refresh_lock);
+}
+
+/*
+ * Longest average the history backs. Its oldest entry is at least
+ * SPBM_AVG_HIST - 1 worker periods old once the history has filled.
+ */
+static unsigned int spbm_avg_max_ms(struct spbm_priv *p)
+{
+	return min_t(u64, (u64)(SPBM_AVG_HIST - 1) *
+		     READ_ONCE(p->update_interval), SPBM_AVG_MAX_MS);
+}
+
+/*
+ * Average power over the last avg_interval ms, from the energy consumed
+ * since the newest history entry at least that old. With less history
+ * than requested, the average covers what is there.
+ */
+static int spbm_power_average(struct spbm_priv *p, int ch, long *val)
+{
+	const struct spbm_nrg_hist *h = NULL;
+	u64 now_ns, from_ns, span_ns, then_ns = 0;
+	u64 acc, then_acc = 0;
+	struct spbm_snapshot s;
+	unsigned long flags;
+	unsigned int i;
+
+	spbm_snapshot_get(p, &s);
+	acc = s.energy_uj[ch] / 1000;
+	now_ns = s.timestamp_ns;
+	/* shortly after boot the interval can reach back past 0 */
+	span_ns = (u64)READ_ONCE(p->avg_interval[ch]) * NSEC_PER_MSEC;
+	from_ns = now_ns > span_ns ? now_ns - span_ns : 0;
+
+	spin_lock_irqsave(&p->nrg_lock, flags);
+	for (i = 1; i <= p->hist_len; i++) {
+		h = &p->hist[(p->hist_head + SPBM_AVG_HIST - i) % SPBM_AVG_HIST];
+		if (h->ts_ns <= from_ns)
+			break;
+	}
+	if (h) {
+		then_ns = h->ts_ns;
+		then_acc = h->acc[ch];
+	}
+	spin_unlock_irqrestore(&p->nrg_lock, flags);
+
+	if (!h || now_ns <= then_ns)
+		return -ENODATA;
+
+	/* mJ * 1e9 / ns = mW */
+	*val = (long)mul_u64_u64_div_u64(acc - then_acc, NSEC_PER_SEC,
+					 now_ns - then_ns) * 1000;
+	return 0;
+}
+
+/*
+ * Integrate TE_* power into energy, holding each reading until the next
+ * one. Readers extrapolate with the same held value, so the integral
+ * they see never goes backwards.
+ */
+static void spbm_power_integrate(struct spbm_priv *p,
+				 const struct spbm_snapshot *s)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&p->nrg_lock, flags);
+	if (s->timestamp_ns > p->pwr_last_ns) {
+		for (i = 0; i < N_TE; i++) {
+			p->pwr_acc[i] += mul_u64_u64_div_u64(p->pwr_last[i],
+						s->timestamp_ns - p->pwr_last_ns,
+						NSEC_PER_MSEC);
+			p->pwr_last[i] = s->power[i];
+		}
+		p->pwr_last_ns = s->timestamp_ns;
+	}
+	spin_unlock_irqrestore(&p->nrg_lock, flags);
+}
+
+/* Integrated TE_* channel @ch up to now, in uJ */
+static u64 spbm_power_energy(struct spbm_priv *p, int ch)
+{
+	unsigned long flags;
+	u64 uj;
+
+	spin_lock_irqsave(&p->nrg_lock, flags);
+	uj = p->pwr_acc[ch] + mul_u64_u64_div_u64(p->pwr_last[ch],
+						  ktime_get_ns() - p->pwr_last_ns,
+						  NSEC_PER_MSEC);
+	spin_unlock_irqrestore(&p->nrg_lock, flags);
+	return uj;
+}
+
+/*
+ * Power limit headroom. A domain is limited once its draw has been
+ * within limit_pct of the limit for limit_samples worker samples in a
+ * row, and stops being limited with the first sample below that. Changes
+ * are signalled with sysfs_notify() on "limited", so a scheduler can
+ * poll() it instead of computing headroom itself.
+ */
+
+#define SPBM_LIMIT_MAX_SAMPLES	100
+
+/* Limit minus draw of domain @d, in mW; false if the limit is not set */
+static bool spbm_headroom(const struct spbm_snapshot *s, int d, s64 *mw)
+{
+	const struct spbm_domain *dom = &spbm_domains[d];
+	s64 draw = 0;
+	int i;
+
+	if (!s->power[dom->limit])
+		return false;
+	for (i = 0; i < dom->ndraw; i++)
+		draw += s->power[dom->draw[i]];
+	*mw = (s64)s->power[dom->limit] - draw;
+	return true;
+}
+
+static void spbm_limits_update(struct spbm_priv *p,
+			       const struct spbm_snapshot *s)
+{
+	unsigned int pct = READ_ONCE(p->limit_pct);
+	unsigned int need = READ_ONCE(p->limit_samples);
+	unsigned long limited = 0;
+	struct device *hwdev;
+	s64 mw;
+	int d;
+
+	for (d = 0; d < N_DOM; d++) {
+		u32 limit = s->power[spbm_domains[d].limit];
+
+		if (spbm_headroom(s, d, &mw) &&
+		    mw * 100 <= (s64)limit * pct) {
+			if (p->lim_count[d] < need)
+				p->lim_count[d]++;
+		} else {
+			p->lim_count[d] = 0;
+		}
+		if (p->lim_count[d] >= need)
+			limited |= BIT(d);
+	}
+
+	if (limited == p->limited)
+		return;
+	WRITE_ONCE(p->limited, limited);
+	hwdev = READ_ONCE(p->hwdev);
+	if (hwdev)
+		sysfs_notify(&hwdev->kobj, NULL, "limited");
+}
+
+/*
+ * Threshold alarms. powerN_max_alarm and powerN_crit_alarm follow the
+ * worker's samples: set while the reading is at or above the threshold,
+ * clear once it drops below. Every change is signalled with
+ * hwmon_notify_event(), which wakes poll() on the alarm attribute and
+ * sends a uevent, so userspace can sleep until a threshold is crossed.
+ */
+
+static unsigned long spbm_alarm_mask(const struct spbm_snapshot *s,
+				     const u32 *thr)
+{
+	unsigned long mask = 0;
+	int ch;
+
+	for (ch = 0; ch < N_TE; ch++) {
+		u32 t = READ_ONCE(thr[ch]);
+
+		if (t && s->power[ch] >= t)
+			mask |= BIT(ch);
+	}
+	return mask;
+}
+
+static void spbm_alarms_notify(struct device *hwdev, unsigned long changed,
+			       u32 attr)
+{
+	int ch;
+
+	for_each_set_bit(ch, &changed, N_TE)
+		hwmon_notify_event(hwdev, hwmon_power, attr, ch);
+}
+
+static void spbm_alarms_update(struct spbm_priv *p,
+			       const struct spbm_snapshot *s)
+{
+	unsigned long max = spbm_alarm_mask(s, p->pwr_max);
+	unsigned long crit = spbm_alarm_mask(s, p->pwr_crit);
+	unsigned long max_chg = max ^ p->max_alarm;
+	unsigned long crit_chg = crit ^ p->crit_alarm;
+	struct device *hwdev;
+
+	if (!max_chg && !crit_chg)
+		return;
+	WRITE_ONCE(p->max_alarm, max);
+	WRITE_ONCE(p->crit_alarm, crit);
+	hwdev = READ_ONCE(p->hwdev);
+	if (!hwdev)
+		return;
+	spbm_alarms_notify(hwdev, max_chg, hwmon_power_max_alarm);
+	spbm_alarms_notify(hwdev, crit_chg, hwmon_power_crit_alarm);
+}
+
+/*
+ * Exponential moving averages. The worker period is configurable and
+ * samples can be late, so each update weighs the new reading by
+ * dt / (tau + dt) of the time since the last one instead of a fixed
+ * per-sample factor; for dt << tau that is 1 - exp(-dt / tau).
+ */
+
+#define SPBM_EWMA_SHIFT		12	/* fraction bits of p->ewma */
+#define SPBM_EWMA_W_SHIFT	16	/* fraction bits of the weight */
+
+static void spbm_ewma_update(struct spbm_priv *p,
+			     const struct spbm_snapshot *s)
+{
+	u64 dt_us;
+	int c, w;
+
+	if (s->timestamp_ns <= p->ewma_last_ns)
+		return;
+	dt_us = div_u64(s->timestamp_ns - p->ewma_last_ns, NSEC_PER_USEC);
+	p->ewma_last_ns = s->timestamp_ns;
+
+	for (w = 0; w < N_EWMA; w++) {
+		u64 tau_us = (u64)READ_ONCE(p->ewma_tau[w]) * USEC_PER_MSEC;
+		s64 k = div64_u64(dt_us << SPBM_EWMA_W_SHIFT, tau_us + dt_us);
+
+		for (c = 0; c < N_EWMA_CH; c++) {
+			s64 x = (s64)s->power[ewma_chans[c]] << SPBM_EWMA_SHIFT;
+			s64 v = p->ewma[c][w];
+
+			v += ((x - v) * k) >> SPBM_EWMA_W_SHIFT;
+			WRITE_ONCE(p->ewma[c][w], v);
+		}
+	}
+}
+
+static void spbm_poll_work(struct work_struct *work)
+{
+	struct spbm_priv *p = container_of(to_delayed_work(work),
+					   struct spbm_priv, poll_work);
+	struct spbm_snapshot s;
+	struct spbm_nrg_hist h;
+	unsigned long flags;
+	int i;
+
+	spbm_snapshot_get(p, &s);
+	spbm_power_integrate(p, &s);
+	spbm_limits_update(p, &s);
+	spbm_alarms_update(p, &s);
+	spbm_ewma_update(p, &s);
+
+	h.ts_ns = s.timestamp_ns;
+	for (i = 0; i < N_NRG; i++)
+		h.acc[i] = s.energy_uj[i] / 1000;
+
+	spin_lock_irqsave(&p->nrg_lock, flags);
+	p->hist[p->hist_head] = h;
+	p->hist_head = (p->hist_head + 1) % SPBM_AVG_HIST;
+	if (p->hist_len < SPBM_AVG_HIST)
+		p->hist_len++;
+	spin_unlock_irqrestore(&p->nrg_lock, flags);
+
+	queue_delayed_work(system_power_efficient_wq, &p->poll_work,
+			   msecs_to_jiffies(READ_ONCE(p->update_interval)));
+}
+
+static void spbm_stop_poll(void *data)
+{
+	struct spbm_priv *p = data;
+
+	cancel_delayed_work_sync(&p->poll_work);
+}
+
+/* Runs before the hwmon device goes; the worker must not notify it after */
+static void spbm_forget_hwdev(void *data)
+{
+	struct spbm_priv *p = data;
+
+	WRITE_ONCE(p->hwdev, NULL);
+	cancel_delayed_work_sync(&p->poll_work);
+}
+
+static int spbm_poll_init(struct device *dev, struct spbm_priv *p)
+{
+	u32 val[SPBM_NR_CHANNELS];
+	int i;
+
+	p->hist = devm_kcalloc(dev, SPBM_AVG_HIST, sizeof(*p->hist),
+			       GFP_KERNEL);
+	if (!p->hist)
+		return -ENOMEM;
+
+	spin_lock_init(&p->nrg_lock);
+	seqlock_init(&p->snap_lock);
+	mutex_init(&p->refresh_lock);
+	p->cache_ms = min(cache_ms, SPBM_CACHE_MAX_MS);
+
+	spbm_read_coherent(p, SPBM_ALL_CHANNELS, val);
+	for (i = 0; i < N_NRG; i++) {
+		p->nrg_last[i] = val[N_PWR + i];
+		p->nrg_acc[i] = p->nrg_last[i];
+		p->avg_interval[i] = 1000;
+	}
+	spbm_build(p, val, ktime_get_ns(), &p->snap);
+	for (i = 0; i < N_TE; i++)
+		p->pwr_last[i] = p->snap.power[i];
+	p->pwr_last_ns = p->snap.timestamp_ns;
+
+	for (i = 0; i < N_EWMA_CH * N_EWMA; i++)
+		p->ewma[i / N_EWMA][i % N_EWMA] =
+			(u64)p->snap.power[ewma_chans[i / N_EWMA]] <<
+			SPBM_EWMA_SHIFT;
+	p->ewma_tau[0] = 1000;
+	p->ewma_tau[1] = 10000;
+	p->ewma_tau[2] = 60000;
+	p->ewma_last_ns = p->snap.timestamp_ns;
+
+	p->limit_pct = 5;
+	p->limit_samples = 3;
+	p->update_interval = 100;	/* firmware PID loop period */
+	INIT_DELAYED_WORK(&p->poll_work, spbm_poll_work);
+	queue_delayed_work(system_power_efficient_wq, &p->poll_work,
+			   msecs_to_jiffies(p->update_interval));
+
+	return devm_add_action_or_reset(dev, spbm_stop_poll, p);
+}
+
+/*
+ * perf PMU. Every TE_* and EN_* channel is a system-wide counting event
+ * in microjoules, so "perf stat -e spbm/energy-pkg/" reports joules the
+ * way RAPL does. EN_* events count the wrap-extended accumulators; TE_*
+ * events (power-*) count the worker's integral of the power reading.
+ * There is no overflow interrupt and no sampling; perf core handles
+ * multiplexing against other PMUs. As with RAPL, every event is bound
+ * to one CPU, so per-CPU opens do not count the same joules N times,
+ * and the events move to another CPU when that one goes offline.
+ */
+
+static enum cpuhp_state spbm_cpuhp_state;
+
+/* Dead channels get no event, like they get no hwmon file */
+static bool spbm_pmu_valid(struct spbm_priv *p, u64 idx)
+{
+	if (idx >= N_TE && (idx < N_PWR || idx >= N_PWR + N_NRG))
+		return false;
+	return p->valid & BIT(idx);
+}
+
+static u64 spbm_pmu_counter(struct spbm_priv *p, u64 idx)
+{
+	if (idx >= N_PWR)
+		return spbm_energy_read(p, idx - N_PWR) * 1000;
+	return spbm_power_energy(p, idx);
+}
+
+static void spbm_pmu_update(struct perf_event *event)
+{
+	struct spbm_priv *p = container_of(event->pmu, struct spbm_priv, pmu);
+	u64 prev, now;
+
+	do {
+		prev = local64_read(&event->hw.prev_count);
+		now = spbm_pmu_counter(p, event->hw.config);
+	} while (local64_cmpxchg(&event->hw.prev_count, prev, now) != prev);
+
+	local64_add(now - prev, &event->count);
+}
+
+static int spbm_pmu_event_init(struct perf_event *event)
+{
+	struct spbm_priv *p = container_of(event->pmu, struct spbm_priv, pmu);
+	u64 cfg = event->attr.config;
+	unsigned int cpu;
+
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+	if (is_sampling_event(event) || event->attach_state & PERF_ATTACH_TASK)
+		return -EINVAL;
+	if (event->cpu < 0)
+		return -EINVAL;
+	if (!spbm_pmu_valid(p, cfg))
+		return -EINVAL;
+
+	cpu = READ_ONCE(p->pmu_cpu);
+	if (cpu >= nr_cpu_ids)
+		return -ENODEV;
+	event->cpu = cpu;
+	event->hw.config = cfg;
+	return 0;
+}
+
+static void spbm_pmu_start(struct perf_event *event, int flags)
+{
+	struct spbm_priv *p = container_of(event->pmu, struct spbm_priv, pmu);
+
+	local64_set(&event->hw.prev_count,
+		    spbm_pmu_counter(p, event->hw.config));
+	event->hw.state = 0;
+}
+
+static void spbm_pmu_stop(struct perf_event *event, int flags)
+{
+	if (event->hw.state & PERF_HES_STOPPED)
+		return;
+	spbm_pmu_update(event);
+	event->hw.state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int spbm_pmu_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+	if (flags & PERF_EF_START)
+		spbm_pmu_start(event, flags);
+	return 0;
+}
+
+static void spbm_pmu_del(struct perf_event *event, int flags)
+{
+	spbm_pmu_stop(event, PERF_EF_UPDATE);
+}
+
+static void spbm_pmu_read(struct perf_event *event)
+{
+	spbm_pmu_update(event);
+}
+
+static int spbm_pmu_online_cpu(unsigned int cpu, struct hlist_node *node)
+{
+	struct spbm_priv *p = hlist_entry_safe(node, struct spbm_priv,
+					       cpuhp_node);
+
+	if (p->pmu_cpu >= nr_cpu_ids)
+		WRITE_ONCE(p->pmu_cpu, cpu);
+	return 0;
+}
+
+static int spbm_pmu_offline_cpu(unsigned int cpu, struct hlist_node *node)
+{
+	struct spbm_priv *p = hlist_entry_safe(node, struct spbm_priv,
+					       cpuhp_node);
+	unsigned int target;
+
+	if (cpu != p->pmu_cpu)
+		return 0;
+	target = cpumask_any_but(cpu_online_mask, cpu);
+	if (target < nr_cpu_ids)
+		perf_pmu_migrate_context(&p->pmu, cpu, target);
+	WRITE_ONCE(p->pmu_cpu, target);
+	return 0;
+}
+
+/* Counters are not per-CPU; advertise one CPU so perf opens one event */
+static ssize_t cpumask_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct pmu *pmu = dev_get_drvdata(dev);
+	struct spbm_priv *p = container_of(pmu, struct spbm_priv, pmu);
+	unsigned int cpu = READ_ONCE(p->pmu_cpu);
+
+	if (cpu >= nr_cpu_ids)
+		return sysfs_emit(buf, "\n");
+	return cpumap_print_to_pagebuf(true, buf, cpumask_of(cpu));
+}
+static DEVICE_ATTR_RO(cpumask);
+
+static struct attribute *spbm_pmu_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL
+};
+
+static const struct attribute_group spbm_pmu_attr_group = {
+	.attrs = spbm_pmu_attrs,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *spbm_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL
+};
+
+static const struct attribute_group spbm_pmu_format_group = {
+	.name = "format",
+	.attrs = spbm_pmu_format_attrs,
+};
+
+static ssize_t spbm_pmu_event_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct dev_ext_attribute *ea = container_of(attr,
+						    struct dev_ext_attribute,
+						    attr);
+
+	return sysfs_emit(buf, "%s\n", (const char *)ea->var);
+}
+
+static int spbm_pmu_add_event(struct device *dev, struct dev_ext_attribute *ea,
+			      const char *name, const char *val)
+{
+	char *n = devm_kstrdup(dev, name, GFP_KERNEL);
+
+	if (!n)
+		return -ENOMEM;
+	strreplace(n, '_', '-');
+
+	sysfs_attr_init(&ea->attr.attr);
+	ea->attr.attr.name = n;
+	ea->attr.attr.mode = 0444;
+	ea->attr.show = spbm_pmu_event_show;
+	ea->var = (void *)val;
+	return 0;
+}
+
+/*
+ * Build the events/ directory from the channel tables: for every event
+ * "<name>" plus "<name>.unit" and "<name>.scale".
+ */
+static int spbm_pmu_init_events(struct device *dev, struct spbm_priv *p)
+{
+	struct dev_ext_attribute *ea;
+	struct attribute **attrs;
+	int i, n = 0, ret;
+
+	ea = devm_kcalloc(dev, (N_TE + N_NRG) * 3, sizeof(*ea), GFP_KERNEL);
+	attrs = devm_kcalloc(dev, (N_TE + N_NRG) * 3 + 1, sizeof(*attrs),
+			     GFP_KERNEL);
+	if (!ea || !attrs)
+		return -ENOMEM;
+
+	for (i = 0; i < N_PWR + N_NRG; i++) {
+		const char *kind = i < N_PWR ? "power" : "energy";
+		const char *label = i < N_PWR ? pwr_chans[i].label :
+						nrg_chans[i - N_PWR].label;
+		char name[48], *cfg;
+
+		if (!spbm_pmu_valid(p, i))
+			continue;
+
+		cfg = devm_kasprintf(dev, GFP_KERNEL, "event=0x%02x", i);
+		if (!cfg)
+			return -ENOMEM;
+
+		snprintf(name, sizeof(name), "%s-%s", kind, label);
+		ret = spbm_pmu_add_event(dev, &ea[n], name, cfg);
+		if (ret)
+			return ret;
+		attrs[n] = &ea[n].attr.attr;
+		n++;
+
+		snprintf(name, sizeof(name), "%s-%s.unit", kind, label);
+		ret = spbm_pmu_add_event(dev, &ea[n], name, "Joules");
+		if (ret)
+			return ret;
+		attrs[n] = &ea[n].attr.attr;
+		n++;
+
+		snprintf(name, sizeof(name), "%s-%s.scale", kind, label);
+		ret = spbm_pmu_add_event(dev, &ea[n], name, "1e-6");
+		if (ret)
+			return ret;
+		attrs[n] = &ea[n].attr.attr;
+		n++;
+	}
+
+	p->pmu_events.name = "events";
+	p->pmu_events.attrs = attrs;
+	p->pmu_groups[0] = &spbm_pmu_attr_group;
+	p->pmu_groups[1] = &spbm_pmu_format_group;
+	p->pmu_groups[2] = &p->pmu_events;
+	return 0;
+}
+
+static void spbm_pmu_unregister(void *data)
+{
+	perf_pmu_unregister(data);
+}
+
+static void spbm_pmu_cpuhp_remove(void *data)
+{
+	struct spbm_priv *p = data;
+
+	cpuhp_state_remove_instance_nocalls(spbm_cpuhp_state, &p->cpuhp_node);
+}
+
+static int spbm_pmu_register(struct device *dev, struct spbm_priv *p)
+{
+	int ret;
+
+	ret = spbm_pmu_init_events(dev, p);
+	if (ret)
+		return ret;
+
+	p->pmu = (struct pmu) {
+		.module = THIS_MODULE,
+		.parent = dev,
+		.attr_groups = p->pmu_groups,
+		.task_ctx_nr = perf_invalid_context,
+		.capabilities = PERF_PMU_CAP_NO_INTERRUPT |
+				PERF_PMU_CAP_NO_EXCLUDE,
+		.event_init = spbm_pmu_event_init,
+		.add = spbm_pmu_add,
+		.del = spbm_pmu_del,
+		.start = spbm_pmu_start,
+		.stop = spbm_pmu_stop,
+		.read = spbm_pmu_read,
+	};
+
+	/* no events until the hotplug callback has picked a CPU */
+	p->pmu_cpu = nr_cpu_ids;
+	ret = perf_pmu_register(&p->pmu, DRIVER_NAME, -1);
+	if (ret)
+		return ret;
+	ret = devm_add_action_or_reset(dev, spbm_pmu_unregister, &p->pmu);
+	if (ret)
+		return ret;
+
+	ret = cpuhp_state_add_instance(spbm_cpuhp_state, &p->cpuhp_node);
+	if (ret)
+		return ret;
+	return devm_add_action_or_reset(dev, spbm_pmu_cpuhp_remove, p);
+}
+
+/* Bulk snapshot */
+
+static ssize_t snapshot_read(struct file *filp, struct kobject *kobj,
+			     SPBM_BIN_ATTR *attr, char *buf,
+			     loff_t off, size_t count)
+{
+	struct spbm_priv *p = dev_get_drvdata(kobj_to_dev(kobj));
+	u64 t0 = spbm_stat_start();
+	struct spbm_snapshot s;
+	ssize_t ret;
+
+	spbm_snapshot_get(p, &s);
+	ret = memory_read_from_buffer(buf, count, &off, &s, sizeof(s));
+	spbm_stat_end(p, SPBM_PATH_SNAPSHOT, t0, 1);
+	return ret;
+}
+static BIN_ATTR_RO(snapshot, sizeof(struct spbm_snapshot));
+
+/*
+ * Streaming sampler. While at least one reader is attached, an hrtimer
+ * samples the selected channels every sample_period_us and appends a
+ * struct spbm_record to a per-device ring. The ring has a single
+ * producer (the timer) and is read without locks: the producer claims
+ * a slot before overwriting it, and readers discard a copy whose slot
+ * was claimed while they were reading it. A reader that falls more than
+ * SPBM_RING_LEN records behind skips ahead; the gap shows up in seq.
+ */
+
+#define SPBM_RING_LEN		1024	/* records, power of two */
+#define SPBM_PERIOD_MIN_US	1000
+#define SPBM_PERIOD_MAX_US	10000000
+
+static unsigned int sample_period_us = 10000;
+module_param(sample_period_us, uint, 0444);
+MODULE_PARM_DESC(sample_period_us, "Initial stream sample period in us");
+
+/*
+ * Ring and reader list, shared by the sampler and the open files.
+ * misc_deregister() does not revoke files that are already open, so
+ * each one holds a reference and the last put frees the ring. Teardown
+ * clears p under lock and stops the timer: from then on the files get
+ * -ENODEV and attaching no longer restarts the timer. The lock-free
+ * paths that still need p take it under RCU.
+ */
+struct spbm_stream {
+	struct kref ref;
+	struct spbm_priv __rcu *p;	/* NULL once the device is gone */
+	struct spbm_record *ring;
+	u64 head;		/* records published */
+	u64 claimed;		/* records started, head or head + 1 */
+	struct mutex lock;	/* p, nreaders, timer start/stop */
+	unsigned int nreaders;
+	spinlock_t readers_lock;	/* readers list, taken by the timer */
+	struct list_head readers;
+};
+
+struct spbm_reader {
+	struct spbm_stream *s;
+	struct list_head node;
+	wait_queue_head_t wq;
+	struct mutex lock;	/* serialises read() on one file */
+	bool attached;
+	u64 tail;
+	u32 watermark;		/* records pending before a wakeup */
+
+	/* delta format state, under lock */
+	u32 format;		/* SPBM_FORMAT_* */
+	u32 keyframe;		/* records between keyframes */
+	u32 key_seq;		/* seq of the last keyframe */
+	u32 have;		/* channels with a value in last[] */
+	u32 last[SPBM_NR_CHANNELS];
+	bool lost;		/* records dropped since the last one read */
+};
+
+static u64 spbm_stream_pending(struct spbm_reader *r, u64 head)
+{
+	return min_t(u64, head - READ_ONCE(r->tail), SPBM_RING_LEN);
+}
+
+/* Append one record of the selected channels and wake readers */
+static void spbm_sample_record(struct spbm_priv *p)
+{
+	struct spbm_stream *st = p->stream;
+	u32 mask = READ_ONCE(p->chan_mask) & p->valid;
+	u64 head = st->head;
+	struct spbm_snapshot s;
+	struct spbm_record *rec;
+	struct spbm_reader *r;
+
+	WRITE_ONCE(st->claimed, head + 1);
+	smp_wmb();
+
+	rec = &st->ring[head & (SPBM_RING_LEN - 1)];
+	spbm_read_coherent(p, mask, rec->val);
+	rec->timestamp_ns = ktime_get_ns();
+	rec->seq = (u32)head;
+	rec->mask = mask;
+
+	smp_store_release(&st->head, head + 1);
+
+	/* a full record is a snapshot too; spare hwmon readers a refresh */
+	if (mask == p->valid) {
+		spbm_build(p, rec->val, rec->timestamp_ns, &s);
+		spbm_publish(p, &s);
+	}
+
+	/*
+	 * Only wake readers that reached their watermark, so a reader
+	 * batching many records per wakeup does not get one per sample. A
+	 * stale tail only overestimates what is pending.
+	 */
+	spin_lock(&st->readers_lock);
+	list_for_each_entry(r, &st->readers, node)
+		if (spbm_stream_pending(r, head + 1) >= READ_ONCE(r->watermark))
+			wake_up_interruptible(&r->wq);
+	spin_unlock(&st->readers_lock);
+}
+
+/*
+ * Phase-locked mode. Instead of sampling every period_us, the timer
+ * watches one register that changes every firmware cycle (the pkg
+ * energy accumulator, which counts up whenever the SoC is powered) and
+ * records once per change. While acquiring, it probes every
+ * SPBM_LOCK_PROBE_US and estimates the update period and jitter from
+ * the intervals between changes. Once SPBM_LOCK_GOOD intervals in a row
+ * agree, it is locked: it sleeps until lk_lead_ns before the next
+ * expected update and probes from there, so each cycle costs a couple
+ * of probe reads and one record taken right after the update. An update
+ * that is missing well past its expected time drops back to acquiring.
+ */
+
+#define SPBM_LOCK_PROBE_US	250
+#define SPBM_LOCK_GOOD		8
+#define SPBM_LOCK_MIN_US	1000	/* shortest period believed */
+
+static void spbm_lock_reset(struct spbm_priv *p)
+{
+	p->lk_chan = spbm_chan_live(p, NRG(NRG_PKG)) ? NRG(NRG_PKG) :
+		     PWR_SYS_TOTAL;
+	p->lk_primed = false;
+	WRITE_ONCE(p->lk_locked, false);
+	p->lk_edge_ns = 0;
+	WRITE_ONCE(p->lk_period_ns, 0);
+	WRITE_ONCE(p->lk_jitter_ns, 0);
+	p->lk_lead_ns = 2 * SPBM_LOCK_PROBE_US * NSEC_PER_USEC;
+	p->lk_good = 0;
+}
+
+static void spbm_lock_lost(struct spbm_priv *p)
+{
+	WRITE_ONCE(p->lk_locked, false);
+	p->lk_good = 0;
+}
+
+/* Feed the update bracketed at @t into the period and jitter estimates */
+static void spbm_lock_edge(struct spbm_priv *p, u64 t)
+{
+	u64 period = p->lk_period_ns;
+	u64 dt = t - p->lk_edge_ns;
+	s64 dev;
+
+	if (!p->lk_edge_ns) {
+		p->lk_edge_ns = t;
+		return;
+	}
+	p->lk_edge_ns = t;
+	if (dt < SPBM_LOCK_MIN_US * NSEC_PER_USEC)
+		return;
+
+	if (!period) {
+		WRITE_ONCE(p->lk_period_ns, dt);
+		return;
+	}
+	/* one or more updates went unseen: use the per-cycle interval */
+	dt = div64_u64(dt, max_t(u64, DIV64_U64_ROUND_CLOSEST(dt, period), 1));
+	dev = abs((s64)dt - (s64)period);
+
+	if (dev * 4 > period) {
+		/* no match, start over from this interval */
+		WRITE_ONCE(p->lk_period_ns, dt);
+		WRITE_ONCE(p->lk_jitter_ns, 0);
+		spbm_lock_lost(p);
+		return;
+	}
+	WRITE_ONCE(p->lk_period_ns, period + ((s64)dt - (s64)period) / 8);
+	WRITE_ONCE(p->lk_jitter_ns,
+		   p->lk_jitter_ns + (dev - (s64)p->lk_jitter_ns) / 8);
+	p->lk_lead_ns = max_t(u64, 3 * p->lk_jitter_ns,
+			      2 * SPBM_LOCK_PROBE_US * NSEC_PER_USEC);
+	if (p->lk_good < SPBM_LOCK_GOOD)
+		p->lk_good++;
+	else
+		WRITE_ONCE(p->lk_locked, true);
+}
+
+/* One probe; returns the absolute time of the next one */
+static u64 spbm_lock_step(struct spbm_priv *p)
+{
+	u64 probe_ns = SPBM_LOCK_PROBE_US * NSEC_PER_USEC;
+	u64 now = ktime_get_ns();
+	u32 v = ioread32(p->base + p->off[p->lk_chan]);
+	bool edge = p->lk_primed && v != p->lk_probe;
+	u64 prev = p->lk_prev_ns;
+
+	p->lk_probe = v;
+	p->lk_primed = true;
+	p->lk_prev_ns = now;
+
+	if (edge) {
+		spbm_sample_record(p);
+		/*
+		 * Only a change seen one probe after the previous read pins
+		 * the update down; after a long sleep it was too early.
+		 */
+		if (now - prev <= 2 * probe_ns) {
+			spbm_lock_edge(p, now - (now - prev) / 2);
+		} else {
+			p->lk_edge_ns = 0;
+			if (READ_ONCE(p->lk_locked))
+				p->lk_lead_ns = min(2 * p->lk_lead_ns,
+						    p->lk_period_ns / 2);
+		}
+	}
+
+	if (!READ_ONCE(p->lk_locked) || !p->lk_edge_ns)
+		return now + probe_ns;
+	if (edge)
+		return max(p->lk_edge_ns + p->lk_period_ns - p->lk_lead_ns,
+			   now + probe_ns);
+	if (now > p->lk_edge_ns + p->lk_period_ns +
+		  max(p->lk_period_ns / 4, 4 * p->lk_jitter_ns))
+		spbm_lock_lost(p);
+	return now + probe_ns;
+}
+
+static enum hrtimer_restart spbm_sample_timer(struct hrtimer *t)
+{
+	struct spbm_priv *p = container_of(t, struct spbm_priv, timer);
+	bool lock = READ_ONCE(p->lock_mode);
+
+	if (lock != p->lk_active) {
+		p->lk_active = lock;
+		if (lock)
+			spbm_lock_reset(p);
+	}
+	if (lock) {
+		hrtimer_set_expires(t, ns_to_ktime(spbm_lock_step(p)));
+		return HRTIMER_RESTART;
+	}
+
+	spbm_sample_record(p);
+	hrtimer_forward_now(t, us_to_ktime(READ_ONCE(p->period_us)));
+	return HRTIMER_RESTART;
+}
+
+static void spbm_stream_free(struct kref *ref)
+{
+	struct spbm_stream *s = container_of(ref, struct spbm_stream, ref);
+
+	kvfree(s->ring);
+	mutex_destroy(&s->lock);
+	kfree(s);
+}
+
+static bool spbm_stream_gone(struct spbm_stream *s)
+{
+	return !rcu_access_pointer(s->p);
+}
+
+static int spbm_stream_attach(struct spbm_reader *r)
+{
+	struct spbm_stream *s = r->s;
+	struct spbm_priv *p;
+	int ret = 0;
+
+	mutex_lock(&s->lock);
+	p = rcu_dereference_protected(s->p, lockdep_is_held(&s->lock));
+	if (!p) {
+		ret = -ENODEV;
+	} else if (!r->attached) {
+		r->tail = smp_load_acquire(&s->head);
+		spin_lock_bh(&s->readers_lock);
+		list_add_tail(&r->node, &s->readers);
+		spin_unlock_bh(&s->readers_lock);
+		r->attached = true;
+		if (!s->nreaders++) {
+			/* the estimate is stale after a pause, lock again */
+			p->lk_active = false;
+			hrtimer_start(&p->timer, us_to_ktime(p->period_us),
+				      HRTIMER_MODE_REL_SOFT);
+		}
+	}
+	mutex_unlock(&s->lock);
+	return ret;
+}
+
+static void spbm_stream_detach(struct spbm_reader *r)
+{
+	struct spbm_stream *s = r->s;
+	struct spbm_priv *p;
+
+	mutex_lock(&s->lock);
+	if (r->attached) {
+		spin_lock_bh(&s->readers_lock);
+		list_del(&r->node);
+		spin_unlock_bh(&s->readers_lock);
+		r->attached = false;
+		/* after teardown the timer is stopped already */
+		p = rcu_dereference_protected(s->p, lockdep_is_held(&s->lock));
+		if (!--s->nreaders && p)
+			hrtimer_cancel(&p->timer);
+	}
+	mutex_unlock(&s->lock);
+}
+
+/* Copy the record at r->tail; false if it was overwritten meanwhile */
+static bool spbm_ring_fetch(struct spbm_reader *r, struct spbm_record *rec)
+{
+	struct spbm_stream *s = r->s;
+	u64 head = smp_load_acquire(&s->head);
+	u64 claimed;
+
+	if (head - r->tail > SPBM_RING_LEN)
+		r->tail = head - SPBM_RING_LEN;
+
+	*rec = s->ring[r->tail & (SPBM_RING_LEN - 1)];
+	smp_rmb();
+
+	claimed = READ_ONCE(s->claimed);
+	if (claimed - r->tail > SPBM_RING_LEN) {
+		r->tail = claimed - SPBM_RING_LEN;
+		return false;
+	}
+	return true;
+}
+
+#define SPBM_KEYFRAME_MAX	65535
+
+/* A full delta record then needs no padding past SPBM_DELTA_MAX */
+static_assert(SPBM_NR_CHANNELS % 2 == 0);
+
+/*
+ * Encode @rec into @out in @r's format. Returns its size, or 0 for a
+ * delta record that has nothing to say.
+ */
+static size_t spbm_stream_encode(struct spbm_reader *r,
+				 const struct spbm_record *rec, void *out)
+{
+	struct spbm_delta *d = out;
+	u32 changed = 0;
+	bool key;
+	int i, n = 0;
+
+	if (r->format == SPBM_FORMAT_FULL) {
+		memcpy(out, rec, sizeof(*rec));
+		return sizeof(*rec);
+	}
+
+	key = !r->have || rec->seq - r->key_seq >= r->keyframe;
+	for (i = 0; i < SPBM_NR_CHANNELS; i++) {
+		if (!(rec->mask & BIT(i)))
+			continue;
+		if (key || !(r->have & BIT(i)) || rec->val[i] != r->last[i]) {
+			changed |= BIT(i);
+			d->val[n++] = rec->val[i];
+		}
+		r->last[i] = rec->val[i];
+	}
+	r->have |= rec->mask;
+	if (!changed && !key && !r->lost)
+		return 0;
+
+	if (key)
+		r->key_seq = rec->seq;
+	if (n % 2)
+		d->val[n] = 0;	/* padding */
+	d->timestamp_ns = rec->timestamp_ns;
+	d->seq = rec->seq;
+	d->mask = changed;
+	d->flags = (key ? SPBM_DELTA_KEYFRAME : 0) |
+		   (r->lost ? SPBM_DELTA_LOST : 0);
+	d->size = struct_size(d, val, round_up(n, 2));
+	r->lost = false;
+	return d->size;
+}
+
+static bool spbm_stream_avail(struct spbm_reader *r)
+{
+	return smp_load_acquire(&r->s->head) != READ_ONCE(r->tail);
+}
+
+static bool spbm_stream_ready(struct spbm_reader *r)
+{
+	return spbm_stream_pending(r, smp_load_acquire(&r->s->head)) >=
+	       READ_ONCE(r->watermark);
+}
+
+static ssize_t spbm_stream_read(struct file *filp, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct spbm_reader *r = filp->private_data;
+	union {
+		struct spbm_record rec;
+		u8 delta[SPBM_DELTA_MAX];
+	} out;
+	struct spbm_record rec;
+	size_t done = 0, len, max;
+	struct spbm_priv *p;
+	int ret;
+
+	ret = spbm_stream_attach(r);
+	if (ret)
+		return ret;
+
+	if (mutex_lock_interruptible(&r->lock))
+		return -ERESTARTSYS;
+
+	/* a record never straddles two reads */
+	max = r->format == SPBM_FORMAT_FULL ? sizeof(rec) : SPBM_DELTA_MAX;
+	if (count < max) {
+		mutex_unlock(&r->lock);
+		return -EINVAL;
+	}
+
+	while (done + max <= count) {
+		u64 t0, tail;
+
+		if (spbm_stream_gone(r->s)) {
+			ret = -ENODEV;
+			break;
+		}
+		/* blocking reads wait for the watermark, then take what is there */
+		if (!spbm_stream_avail(r) ||
+		    (!done && !(filp->f_flags & O_NONBLOCK) &&
+		     !spbm_stream_ready(r))) {
+			if (done)
+				break;
+			if (filp->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				break;
+			}
+			mutex_unlock(&r->lock);
+			ret = wait_event_interruptible(r->wq,
+						       spbm_stream_ready(r) ||
+						       spbm_stream_gone(r->s));
+			if (ret)
+				return ret;
+			if (mutex_lock_interruptible(&r->lock))
+				return -ERESTARTSYS;
+			continue;
+		}
+		t0 = spbm_stat_start();
+		tail = r->tail;
+		if (!spbm_ring_fetch(r, &rec)) {
+			r->lost = true;
+			continue;
+		}
+		if (r->tail != tail)
+			r->lost = true;
+		len = spbm_stream_encode(r, &rec, &out);
+		if (len && copy_to_user(buf + done, &out, len)) {
+			ret = -EFAULT;
+			break;
+		}
+		rcu_read_lock();
+		p = rcu_dereference(r->s->p);
+		if (p)
+			spbm_stat_end(p, SPBM_PATH_STREAM, t0, 1);
+		rcu_read_unlock();
+		WRITE_ONCE(r->tail, r->tail + 1);
+		done += len;
+	}
+
+	mutex_unlock(&r->lock);
+	return done ? done : ret;
+}
+
+static __poll_t spbm_stream_poll(struct file *filp, poll_table *wait)
+{
+	struct spbm_reader *r = filp->private_data;
+
+	if (spbm_stream_attach(r))
+		return EPOLLERR | EPOLLHUP;
+	poll_wait(filp, &r->wq, wait);
+
+	if (spbm_stream_gone(r->s))
+		return EPOLLERR | EPOLLHUP;
+	return spbm_stream_ready(r) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/*
+ * Raw shared memory view. Privileged collectors can mmap() the SPBM
+ * page read-only and sample registers with plain loads, skipping the
+ * syscall per sample that hwmon and the snapshot attribute cost.
+ */
+static int spbm_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct spbm_reader *r = filp->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	resource_size_t phys = 0;
+	struct spbm_priv *p;
+
+	if (!perfmon_capable())
+		return -EPERM;
+	rcu_read_lock();
+	p = rcu_dereference(r->s->p);
+	if (p)
+		phys = p->phys;
+	rcu_read_unlock();
+	if (!phys)
+		return -ENODEV;
+	/*
+	 * The mapping granule is a whole page; with pages larger than the
+	 * SPBM window userspace would see unrelated physical memory.
+	 */
+	if (!PAGE_ALIGNED(phys) || SPBM_SIZE % PAGE_SIZE)
+		return -ENODEV;
+	if (vma->vm_pgoff || size > SPBM_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vma->vm_page_prot = pgprot_device(vma->vm_page_prot);
+	return remap_pfn_range(vma, vma->vm_start, PHYS_PFN(phys), size,
+			       vma->vm_page_prot);
+}
+
+static int spbm_open(struct inode *inode, struct file *filp)
+{
+	struct spbm_priv *p = container_of(filp->private_data,
+					   struct spbm_priv, misc);
+	struct spbm_reader *r;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+
+	r->s = p->stream;
+	kref_get(&r->s->ref);
+	r->watermark = 1;
+	r->keyframe = 100;
+	init_waitqueue_head(&r->wq);
+	mutex_init(&r->lock);
+	filp->private_data = r;
+
+	return stream_open(inode, filp);
+}
+
+static long spbm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct spbm_reader *r = filp->private_data;
+	struct spbm_stream_format fmt;
+	struct spbm_layout_info li;
+	struct spbm_priv *p;
+	u32 val;
+
+	if (spbm_stream_gone(r->s))
+		return -ENODEV;
+
+	switch (cmd) {
+	case SPBM_IOC_SET_WATERMARK:
+		if (get_user(val, (u32 __user *)arg))
+			return -EFAULT;
+		if (!val || val > SPBM_RING_LEN / 2)
+			return -EINVAL;
+		WRITE_ONCE(r->watermark, val);
+		/* a lower watermark may already be met */
+		wake_up_interruptible(&r->wq);
+		return 0;
+	case SPBM_IOC_GET_WATERMARK:
+		return put_user(READ_ONCE(r->watermark), (u32 __user *)arg);
+	case SPBM_IOC_GET_LAYOUT:
+		rcu_read_lock();
+		p = rcu_dereference(r->s->p);
+		if (p) {
+			li.valid = p->valid;
+			memcpy(li.offset, p->off, sizeof(li.offset));
+		}
+		rcu_read_unlock();
+		if (!p)
+			return -ENODEV;
+		if (copy_to_user((void __user *)arg, &li, sizeof(li)))
+			return -EFAULT;
+		return 0;
+	case SPBM_IOC_SET_FORMAT:
+		if (copy_from_user(&fmt, (void __user *)arg, sizeof(fmt)))
+			return -EFAULT;
+		if (fmt.format > SPBM_FORMAT_DELTA ||
+		    fmt.keyframe > SPBM_KEYFRAME_MAX)
+			return -EINVAL;
+		if (mutex_lock_interruptible(&r->lock))
+			return -ERESTARTSYS;
+		r->format = fmt.format;
+		if (fmt.keyframe)
+			r->keyframe = fmt.keyframe;
+		r->have = 0;	/* start over with a keyframe */
+		mutex_unlock(&r->lock);
+		return 0;
+	case SPBM_IOC_GET_FORMAT:
+		fmt.format = READ_ONCE(r->format);
+		fmt.keyframe = READ_ONCE(r->keyframe);
+		if (copy_to_user((void __user *)arg, &fmt, sizeof(fmt)))
+			return -EFAULT;
+		return 0;
+	}
+	return -ENOTTY;
+}
+
+static int spbm_release(struct inode *inode, struct file *filp)
+{
+	struct spbm_reader *r = filp->private_data;
+
+	spbm_stream_detach(r);
+	kref_put(&r->s->ref, spbm_stream_free);
+	mutex_destroy(&r->lock);
+	kfree(r);
+	return 0;
+}
+
+static const struct file_operations spbm_fops = {
+	.owner = THIS_MODULE,
+	.open = spbm_open,
+	.release = spbm_release,
+	.read = spbm_stream_read,
+	.poll = spbm_stream_poll,
+	.unlocked_ioctl = spbm_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = spbm_mmap,
+	.llseek = noop_llseek,
+};
+
+static void spbm_misc_deregister(void *data)
+{
+	misc_deregister(data);
+}
+
+static void spbm_stream_teardown(void *data)
+{
+	struct spbm_priv *p = data;
+	struct spbm_stream *s = p->stream;
+	struct spbm_reader *r;
+
+	mutex_lock(&s->lock);
+	RCU_INIT_POINTER(s->p, NULL);
+	mutex_unlock(&s->lock);
+	hrtimer_cancel(&p->timer);
+
+	/* blocked readers see the device gone */
+	spin_lock_bh(&s->readers_lock);
+	list_for_each_entry(r, &s->readers, node)
+		wake_up_interruptible(&r->wq);
+	spin_unlock_bh(&s->readers_lock);
+
+	synchronize_rcu();
+	kref_put(&s->ref, spbm_stream_free);
+}
+
+static int spbm_stream_init(struct device *dev, struct spbm_priv *p)
+{
+	struct spbm_stream *s;
+	int ret;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+	s->ring = kvcalloc(SPBM_RING_LEN, sizeof(*s->ring), GFP_KERNEL);
+	if (!s->ring) {
+		kfree(s);
+		return -ENOMEM;
+	}
+	kref_init(&s->ref);
+	RCU_INIT_POINTER(s->p, p);
+	INIT_LIST_HEAD(&s->readers);
+	spin_lock_init(&s->readers_lock);
+	mutex_init(&s->lock);
+	p->stream = s;
+
+	p->period_us = clamp(sample_period_us, SPBM_PERIOD_MIN_US,
+			     SPBM_PERIOD_MAX_US);
+	p->chan_mask = GENMASK(SPBM_NR_CHANNELS - 1, 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&p->timer, spbm_sample_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL_SOFT);
+#else
+	hrtimer_init(&p->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	p->timer.function = spbm_sample_timer;
+#endif
+
+	ret = devm_add_action_or_reset(dev, spbm_stream_teardown, p);
+	if (ret)
+		return ret;
+
+	p->misc.minor = MISC_DYNAMIC_MINOR;
+	p->misc.name = DRIVER_NAME;
+	p->misc.fops = &spbm_fops;
+	p->misc.parent = dev;
+	p->misc.mode = 0444;
+
+	ret = misc_register(&p->misc);
+	if (ret)
+		return ret;
+	return devm_add_action_or_reset(dev, spbm_misc_deregister, &p->misc);
+}
+
+/* Limit headroom attributes */
+
+static ssize_t headroom_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+	struct spbm_snapshot s;
+	s64 mw;
+
+	spbm_snapshot_get(p, &s);
+	if (!spbm_headroom(&s, to_sensor_dev_attr(attr)->index, &mw))
+		return -ENODATA;
+	return sysfs_emit(buf, "%lld\n", mw * 1000);	/* uW */
+}
+
+static SENSOR_DEVICE_ATTR_RO(headroom_pl1, headroom, 0);
+static SENSOR_DEVICE_ATTR_RO(headroom_pl2, headroom, 1);
+static SENSOR_DEVICE_ATTR_RO(headroom_syspl1, headroom, 2);
+static SENSOR_DEVICE_ATTR_RO(headroom_budget_cpu, headroom, 3);
+static SENSOR_DEVICE_ATTR_RO(headroom_budget_gpu, headroom, 4);
+static SENSOR_DEVICE_ATTR_RO(headroom_budget_cpu_e, headroom, 5);
+static SENSOR_DEVICE_ATTR_RO(headroom_budget_cpu_p, headroom, 6);
+static_assert(N_DOM == 7);
+
+static ssize_t limited_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "0x%02lx\n", READ_ONCE(p->limited));
+}
+static DEVICE_ATTR_RO(limited);
+
+static ssize_t limit_threshold_pct_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(p->limit_pct));
+}
+
+static ssize_t limit_threshold_pct_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (val > 100)
+		return -EINVAL;
+
+	WRITE_ONCE(p->limit_pct, val);
+	return count;
+}
+static DEVICE_ATTR_RW(limit_threshold_pct);
+
+static ssize_t limit_samples_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(p->limit_samples));
+}
+
+static ssize_t limit_samples_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (!val || val > SPBM_LIMIT_MAX_SAMPLES)
+		return -EINVAL;
+
+	WRITE_ONCE(p->limit_samples, val);
+	return count;
+}
+static DEVICE_ATTR_RW(limit_samples);
+
+/* Moving averages: ewma<w>_<channel> in uW, ewma<w>_tau_ms */
+
+static ssize_t ewma_show(struct device *dev,
+			 struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+	struct sensor_device_attribute_2 *sa = to_sensor_dev_attr_2(attr);
+	u64 v = READ_ONCE(p->ewma[sa->index][sa->nr]);
+
+	return sysfs_emit(buf, "%llu\n", (v * 1000) >> SPBM_EWMA_SHIFT);
+}
+
+static SENSOR_DEVICE_ATTR_2_RO(ewma1_sys_total, ewma, 0, 0);
+static SENSOR_DEVICE_ATTR_2_RO(ewma2_sys_total, ewma, 1, 0);
+static SENSOR_DEVICE_ATTR_2_RO(ewma3_sys_total, ewma, 2, 0);
+static SENSOR_DEVICE_ATTR_2_RO(ewma1_soc_pkg, ewma, 0, 1);
+static SENSOR_DEVICE_ATTR_2_RO(ewma2_soc_pkg, ewma, 1, 1);
+static SENSOR_DEVICE_ATTR_2_RO(ewma3_soc_pkg, ewma, 2, 1);
+static SENSOR_DEVICE_ATTR_2_RO(ewma1_cpu_p, ewma, 0, 2);
+static SENSOR_DEVICE_ATTR_2_RO(ewma2_cpu_p, ewma, 1, 2);
+static SENSOR_DEVICE_ATTR_2_RO(ewma3_cpu_p, ewma, 2, 2);
+static SENSOR_DEVICE_ATTR_2_RO(ewma1_gpu_out, ewma, 0, 3);
+static SENSOR_DEVICE_ATTR_2_RO(ewma2_gpu_out, ewma, 1, 3);
+static SENSOR_DEVICE_ATTR_2_RO(ewma3_gpu_out, ewma, 2, 3);
+static_assert(N_EWMA_CH == 4 && N_EWMA == 3);
+
+static ssize_t ewma_tau_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(p->ewma_tau[to_sensor_dev_attr(attr)->index]));
+}
+
+static ssize_t ewma_tau_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (!val || val > SPBM_AVG_MAX_MS)
+		return -EINVAL;
+
+	/* The averages carry on from their current value */
+	WRITE_ONCE(p->ewma_tau[to_sensor_dev_attr(attr)->index], val);
+	return count;
+}
+
+static SENSOR_DEVICE_ATTR_RW(ewma1_tau_ms, ewma_tau, 0);
+static SENSOR_DEVICE_ATTR_RW(ewma2_tau_ms, ewma_tau, 1);
+static SENSOR_DEVICE_ATTR_RW(ewma3_tau_ms, ewma_tau, 2);
+
+/* Register layout in use, marked when chan_offsets= changed it */
+static ssize_t layout_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%s%s\n", p->layout,
+			  p->layout_custom ? "+custom" : "");
+}
+static DEVICE_ATTR_RO(layout);
+
+/* Cache and sampler controls */
+
+static ssize_t cache_ms_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(p->cache_ms));
+}
+
+static ssize_t cache_ms_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(p->cache_ms, min(val, SPBM_CACHE_MAX_MS));
+	return count;
+}
+static DEVICE_ATTR_RW(cache_ms);
+
+static ssize_t sample_period_us_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(p->period_us));
+}
+
+static ssize_t sample_period_us_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(p->period_us, clamp(val, SPBM_PERIOD_MIN_US,
+				       SPBM_PERIOD_MAX_US));
+	return count;
+}
+static DEVICE_ATTR_RW(sample_period_us);
+
+static ssize_t sample_channels_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "0x%08x\n", READ_ONCE(p->chan_mask));
+}
+
+static ssize_t sample_channels_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+	u32 val;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (val & ~GENMASK(SPBM_NR_CHANNELS - 1, 0))
+		return -EINVAL;
+
+	WRITE_ONCE(p->chan_mask, val);
+	return count;
+}
+static DEVICE_ATTR_RW(sample_channels);
+
+static const char * const spbm_sample_modes[] = { "periodic", "locked" };
+
+static ssize_t sample_mode_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%s\n",
+			  spbm_sample_modes[READ_ONCE(p->lock_mode)]);
+}
+
+static ssize_t sample_mode_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+	int mode;
+
+	mode = sysfs_match_string(spbm_sample_modes, buf);
+	if (mode < 0)
+		return mode;
+	if (mode && !spbm_chan_live(p, NRG(NRG_PKG)) &&
+	    !spbm_chan_live(p, PWR_SYS_TOTAL))
+		return -ENODEV;
+
+	WRITE_ONCE(p->lock_mode, mode);
+	return count;
+}
+static DEVICE_ATTR_RW(sample_mode);
+
+/* Measured firmware cadence; ENODATA unless the locked sampler has lock */
+static ssize_t fw_period_us_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	if (!READ_ONCE(p->lk_locked))
+		return -ENODATA;
+	return sysfs_emit(buf, "%llu\n",
+			  div_u64(READ_ONCE(p->lk_period_ns), NSEC_PER_USEC));
+}
+static DEVICE_ATTR_RO(fw_period_us);
+
+static ssize_t fw_jitter_us_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	if (!READ_ONCE(p->lk_locked))
+		return -ENODATA;
+	return sysfs_emit(buf, "%llu\n",
+			  div_u64(READ_ONCE(p->lk_jitter_ns), NSEC_PER_USEC));
+}
+static DEVICE_ATTR_RO(fw_jitter_us);
+
+static struct attribute *spbm_attrs[] = {
+	&sensor_dev_attr_headroom_pl1.dev_attr.attr,
+	&sensor_dev_attr_headroom_pl2.dev_attr.attr,
+	&sensor_dev_attr_headroom_syspl1.dev_attr.attr,
+	&sensor_dev_attr_headroom_budget_cpu.dev_attr.attr,
+	&sensor_dev_attr_headroom_budget_gpu.dev_attr.attr,
+	&sensor_dev_attr_headroom_budget_cpu_e.dev_attr.attr,
+	&sensor_dev_attr_headroom_budget_cpu_p.dev_attr.attr,
+	&dev_attr_limited.attr,
+	&dev_attr_limit_threshold_pct.attr,
+	&dev_attr_limit_samples.attr,
+	&sensor_dev_attr_ewma1_sys_total.dev_attr.attr,
+	&sensor_dev_attr_ewma2_sys_total.dev_attr.attr,
+	&sensor_dev_attr_ewma3_sys_total.dev_attr.attr,
+	&sensor_dev_attr_ewma1_soc_pkg.dev_attr.attr,
+	&sensor_dev_attr_ewma2_soc_pkg.dev_attr.attr,
+	&sensor_dev_attr_ewma3_soc_pkg.dev_attr.attr,
+	&sensor_dev_attr_ewma1_cpu_p.dev_attr.attr,
+	&sensor_dev_attr_ewma2_cpu_p.dev_attr.attr,
+	&sensor_dev_attr_ewma3_cpu_p.dev_attr.attr,
+	&sensor_dev_attr_ewma1_gpu_out.dev_attr.attr,
+	&sensor_dev_attr_ewma2_gpu_out.dev_attr.attr,
+	&sensor_dev_attr_ewma3_gpu_out.dev_attr.attr,
+	&sensor_dev_attr_ewma1_tau_ms.dev_attr.attr,
+	&sensor_dev_attr_ewma2_tau_ms.dev_attr.attr,
+	&sensor_dev_attr_ewma3_tau_ms.dev_attr.attr,
+	&dev_attr_layout.attr,
+	&dev_attr_cache_ms.attr,
+	&dev_attr_sample_period_us.attr,
+	&dev_attr_sample_channels.attr,
+	&dev_attr_sample_mode.attr,
+	&dev_attr_fw_period_us.attr,
+	&dev_attr_fw_jitter_us.attr,
+	NULL
+};
+
+static SPBM_BIN_ATTR *spbm_bin_attrs[] = {
+	&bin_attr_snapshot,
+	NULL
+};
+
+/* in place before the device's uevent, so udev sees snapshot too */
+static const struct attribute_group spbm_group = {
+	.attrs = spbm_attrs,
+	.SPBM_GROUP_BIN_ATTRS = spbm_bin_attrs,
+};
+
+static const struct attribute_group *spbm_groups[] = {
+	&spbm_group,
+	NULL
+};
 
 /*
- * Register offsets. Firmware writes milliwatts for power,
- * millijoules (cumulative) for energy.
- * hwmon expects microwatts and microjoules respectively.
+ * debugfs: <debugfs>/spbm/
+ *   stats_enable  1 to account the read paths (static key, default off)
+ *   <device>/, one per bound device:
+ *   stats         per-path counts, mean and log2 latency histogram,
+ *                 snapshot cache hits; any write clears them
+ *   bench         write N to read every live channel N times back to
+ *                 back; read for ns per ioread32() of each channel
  */
 
-/* Instantaneous power telemetry */
-#define TE_SYS_TOTAL	0x300
-#define TE_SOC_PKG	0x304
-#define TE_C_AND_G	0x308
-#define TE_CPU_P	0x30C
-#define TE_CPU_E	0x310
-#define TE_VCORE	0x314
-#define TE_VDDQ	0x318
-#define TE_CHR		0x31C
-#define TE_GPC_OUT	0x320
-#define TE_GPU_OUT	0x324
-#define TE_GPC_IN	0x328
-#define TE_GPU_IN	0x32C
-#define TE_SYS_IN	0x330
-#define TE_DLA_IN	0x334
-#define TE_PREREG_IN	0x338
-#define TE_DLA_OUT	0x33C
+#define SPBM_BENCH_MAX_READS	100000
 
-/* Energy accumulators */
-#define EN_PKG		0x344
-#define EN_CPU_E	0x350
-#define EN_CPU_P	0x35C
-#define EN_GPC		0x368
-#define EN_GPM		0x374
+static const char * const spbm_path_names[SPBM_NR_PATHS] = {
+	[SPBM_PATH_MMIO]     = "mmio",
+	[SPBM_PATH_HWMON]    = "hwmon",
+	[SPBM_PATH_SNAPSHOT] = "snapshot",
+	[SPBM_PATH_STREAM]   = "stream",
+};
 
-/* Power limits (effective, milliwatts) */
-#define PL1_EFF		0x160
-#define PL2_EFF		0x164
-#define SYSPL1_EFF	0x170
+static int spbm_stats_enable_get(void *data, u64 *val)
+{
+	*val = static_key_enabled(&spbm_stats_on);
+	return 0;
+}
 
-/* Power budgets */
-#define BUD_CPU		0x600
-#define BUD_GPU		0x604
-#define BUD_CPU_E	0x680
-#define BUD_CPU_P	0x684
+static int spbm_stats_enable_set(void *data, u64 val)
+{
+	if (val)
+		static_branch_enable(&spbm_stats_on);
+	else
+		static_branch_disable(&spbm_stats_on);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(spbm_stats_enable_fops, spbm_stats_enable_get,
+			 spbm_stats_enable_set, "%llu\n");
 
-struct spbm_chan {
-	u32 offset;
-	const char *label;
-};
+static int spbm_stats_show(struct seq_file *m, void *unused)
+{
+	struct spbm_priv *p = m->private;
+	u64 hits = atomic64_read(&p->cache_hits);
+	u64 misses = atomic64_read(&p->cache_misses);
+	int i, b;
 
-static const struct spbm_chan pwr_chans[] = {
-	{ TE_SYS_TOTAL, "sys_total" },
-	{ TE_SOC_PKG,   "soc_pkg" },
-	{ TE_C_AND_G,   "cpu_gpu" },
-	{ TE_CPU_P,     "cpu_p" },
-	{ TE_CPU_E,     "cpu_e" },
-	{ TE_VCORE,     "vcore" },
-	{ TE_VDDQ,      "vddq" },
-	{ TE_CHR,       "dc_input" },
-	{ TE_GPU_OUT,   "gpu_out" },
-	{ TE_GPC_OUT,   "gpc_out" },
-	{ TE_GPU_IN,    "gpu_in" },
-	{ TE_GPC_IN,    "gpc_in" },
-	{ TE_SYS_IN,    "sys_in" },
-	{ TE_PREREG_IN, "prereg_in" },
-	{ TE_DLA_IN,    "dla_in" },
-	{ TE_DLA_OUT,   "dla_out" },
-	{ PL1_EFF,      "pl1" },
-	{ PL2_EFF,      "pl2" },
-	{ SYSPL1_EFF,   "syspl1" },
-	{ BUD_CPU,      "budget_cpu" },
-	{ BUD_GPU,      "budget_gpu" },
-	{ BUD_CPU_E,    "budget_cpu_e" },
-	{ BUD_CPU_P,    "budget_cpu_p" },
+	seq_printf(m, "%-10s %12s %10s\n", "path", "count", "mean_ns");
+	for (i = 0; i < SPBM_NR_PATHS; i++) {
+		u64 n = atomic64_read(&p->stats[i].count);
+		u64 ns = atomic64_read(&p->stats[i].total_ns);
+
+		seq_printf(m, "%-10s %12llu %10llu\n", spbm_path_names[i], n,
+			   n ? div64_u64(ns, n) : 0);
+	}
+
+	seq_printf(m, "\ncache hits %llu misses %llu (%llu%% hits), torn %llu\n",
+		   hits, misses,
+		   hits + misses ? div64_u64(hits * 100, hits + misses) : 0,
+		   (u64)atomic64_read(&p->torn));
+
+	for (i = 0; i < SPBM_NR_PATHS; i++) {
+		seq_printf(m, "\n%s latency (ns):\n", spbm_path_names[i]);
+		for (b = 0; b < SPBM_LAT_BUCKETS; b++) {
+			u64 n = atomic64_read(&p->stats[i].hist[b]);
+
+			if (!n)
+				continue;
+			if (b == SPBM_LAT_BUCKETS - 1)
+				seq_printf(m, "  >= %-10llu %12llu\n",
+					   1ULL << b, n);
+			else
+				seq_printf(m, "  <  %-10llu %12llu\n",
+					   2ULL << b, n);
+		}
+	}
+	return 0;
+}
+
+static int spbm_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, spbm_stats_show, inode->i_private);
+}
+
+static ssize_t spbm_stats_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct spbm_priv *p = ((struct seq_file *)file->private_data)->private;
+	int i, b;
+
+	for (i = 0; i < SPBM_NR_PATHS; i++) {
+		atomic64_set(&p->stats[i].count, 0);
+		atomic64_set(&p->stats[i].total_ns, 0);
+		for (b = 0; b < SPBM_LAT_BUCKETS; b++)
+			atomic64_set(&p->stats[i].hist[b], 0);
+	}
+	atomic64_set(&p->cache_hits, 0);
+	atomic64_set(&p->cache_misses, 0);
+	atomic64_set(&p->torn, 0);
+	return count;
+}
+
+static const struct file_operations spbm_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = spbm_stats_open,
+	.read = seq_read,
+	.write = spbm_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
 };
-#define N_PWR ARRAY_SIZE(pwr_chans)
 
-static const struct spbm_chan nrg_chans[] = {
-	{ EN_PKG,   "pkg" },
-	{ EN_CPU_E, "cpu_e" },
-	{ EN_CPU_P, "cpu_p" },
-	{ EN_GPC,   "gpc" },
-	{ EN_GPM,   "gpm" },
+static const char *spbm_chan_name(int i, char *buf, size_t len)
+{
+	if (i < N_PWR)
+		snprintf(buf, len, "power%d %s", i + 1, pwr_chans[i].label);
+	else
+		snprintf(buf, len, "energy%d %s", i - (int)N_PWR + 1,
+			 nrg_chans[i - N_PWR].label);
+	return buf;
+}
+
+static int spbm_bench_show(struct seq_file *m, void *unused)
+{
+	struct spbm_priv *p = m->private;
+	char name[32];
+	int i;
+
+	mutex_lock(&p->bench_lock);
+	if (!p->bench_reads) {
+		seq_puts(m, "not run, write a read count to start\n");
+		goto out;
+	}
+	seq_printf(m, "%u reads per channel\n", p->bench_reads);
+	for (i = 0; i < SPBM_NR_CHANNELS; i++) {
+		spbm_chan_name(i, name, sizeof(name));
+		if (!spbm_chan_live(p, i))
+			seq_printf(m, "%-24s %12s\n", name, "dead");
+		else
+			seq_printf(m, "%-24s %8llu.%03llu ns\n", name,
+				   p->bench_ps[i] / 1000, p->bench_ps[i] % 1000);
+	}
+out:
+	mutex_unlock(&p->bench_lock);
+	return 0;
+}
+
+static int spbm_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, spbm_bench_show, inode->i_private);
+}
+
+/* Back-to-back reads of one register at a time, so no pass logic is timed */
+static ssize_t spbm_bench_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct spbm_priv *p = ((struct seq_file *)file->private_data)->private;
+	unsigned int n, k;
+	int i, ret;
+
+	ret = kstrtouint_from_user(buf, count, 0, &n);
+	if (ret)
+		return ret;
+	if (!n || n > SPBM_BENCH_MAX_READS)
+		return -EINVAL;
+
+	mutex_lock(&p->bench_lock);
+	for (i = 0; i < SPBM_NR_CHANNELS; i++) {
+		void __iomem *reg = p->base + p->off[i];
+		u64 t0;
+
+		p->bench_ps[i] = 0;
+		if (!spbm_chan_live(p, i))
+			continue;
+		t0 = ktime_get_ns();
+		for (k = 0; k < n; k++)
+			ioread32(reg);
+		p->bench_ps[i] = div_u64((ktime_get_ns() - t0) * 1000, n);
+		cond_resched();
+	}
+	p->bench_reads = n;
+	mutex_unlock(&p->bench_lock);
+	return count;
+}
+
+static const struct file_operations spbm_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = spbm_bench_open,
+	.read = seq_read,
+	.write = spbm_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
 };
-#define N_NRG ARRAY_SIZE(nrg_chans)
 
-struct spbm_priv {
-	void __iomem *base;
+/* Shared by all devices, as the static key is */
+static struct dentry *spbm_debugfs_root;
+
+static void spbm_debugfs_remove(void *data)
+{
+	debugfs_remove_recursive(data);
+}
+
+/* debugfs is best effort; failures leave the device working */
+static int spbm_debugfs_init(struct device *dev, struct spbm_priv *p)
+{
+	mutex_init(&p->bench_lock);
+	p->debugfs = debugfs_create_dir(dev_name(dev), spbm_debugfs_root);
+	debugfs_create_file("stats", 0600, p->debugfs, p, &spbm_stats_fops);
+	debugfs_create_file("bench", 0600, p->debugfs, p, &spbm_bench_fops);
+	return devm_add_action_or_reset(dev, spbm_debugfs_remove, p->debugfs);
+}
+
+/*
+ * BPF. bpf_spbm_read() hands tracing programs a channel of the cached
+ * snapshot, so a sched_switch or irq handler can tag its event with the
+ * current power without leaving the kernel. It never reads the window:
+ * the value is as old as the last refresh, at most update_interval when
+ * nobody else reads. The channel index is the one of struct spbm_record
+ * and the PMU's event=; power comes back in mW, energy in uJ.
+ *
+ * There is one SPBM per system, so the kfunc reads the device published
+ * in spbm_bpf_dev. Tracing programs may run in NMI, on top of a writer of
+ * snap_lock, so the read gives up after a few tries instead of spinning.
+ */
+
+#ifdef CONFIG_BPF_SYSCALL
+
+#define SPBM_BPF_TRIES	4
+
+static struct spbm_priv __rcu *spbm_bpf_dev;
+
+__bpf_kfunc_start_defs();
+
+/**
+ * bpf_spbm_read - cached reading of one SPBM channel
+ * @channel: 0..SPBM_NR_POWER-1 for power, then the energy channels
+ *
+ * Return: mW or uJ, -EINVAL for a bad or dead channel, -ENODEV without a
+ * device, -EBUSY if the snapshot was being replaced every time.
+ */
+__bpf_kfunc s64 bpf_spbm_read(u32 channel)
+{
+	struct spbm_priv *p;
+	unsigned int seq;
+	s64 ret = -ENODEV;
+	int i;
+
+	if (channel >= SPBM_NR_CHANNELS)
+		return -EINVAL;
+
+	rcu_read_lock();
+	p = rcu_dereference(spbm_bpf_dev);
+	if (p && !spbm_chan_live(p, channel))
+		ret = -EINVAL;
+	else if (p)
+		ret = -EBUSY;
+	for (i = 0; ret == -EBUSY && i < SPBM_BPF_TRIES; i++) {
+		s64 v;
+
+		seq = raw_read_seqcount(&p->snap_lock.seqcount);
+		if (seq & 1)
+			continue;
+		v = channel < N_PWR ? p->snap.power[channel] :
+				      p->snap.energy_uj[channel - N_PWR];
+		if (!read_seqcount_retry(&p->snap_lock.seqcount, seq))
+			ret = v;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(spbm_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_spbm_read)
+BTF_KFUNCS_END(spbm_kfunc_ids)
+
+static const struct btf_kfunc_id_set spbm_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set = &spbm_kfunc_ids,
 };
 
+static int spbm_bpf_register(void)
+{
+	return register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING,
+					 &spbm_kfunc_set);
+}
+
+static void spbm_bpf_unpublish(void *data)
+{
+	RCU_INIT_POINTER(spbm_bpf_dev, NULL);
+	synchronize_rcu();
+}
+
+static int spbm_bpf_publish(struct device *dev, struct spbm_priv *p)
+{
+	if (rcu_access_pointer(spbm_bpf_dev)) {
+		dev_warn(dev, "bpf_spbm_read() already serves another device\n");
+		return 0;
+	}
+	rcu_assign_pointer(spbm_bpf_dev, p);
+	return devm_add_action_or_reset(dev, spbm_bpf_unpublish, p);
+}
+
+#else
+
+static int spbm_bpf_register(void)
+{
+	return 0;
+}
+
+static int spbm_bpf_publish(struct device *dev, struct spbm_priv *p)
+{
+	return 0;
+}
+
+#endif /* CONFIG_BPF_SYSCALL */
+
 /* hwmon callbacks */
 
 static umode_t spbm_visible(const void *data, enum hwmon_sensor_types type,
 			     u32 attr, int ch)
 {
+	const struct spbm_priv *p = data;
+
+	if (type == hwmon_chip && attr == hwmon_chip_update_interval)
+		return 0644;
+	/* powerN_average channels follow their accumulator, at the same index */
+	if ((type == hwmon_power && ch < N_PWR + N_AVG &&
+	     !spbm_chan_live(p, ch)) ||
+	    (type == hwmon_energy && ch < N_NRG &&
+	     !spbm_chan_live(p, N_PWR + ch)))
+		return 0;
 	if (type == hwmon_power && ch < N_PWR &&
 	    (attr == hwmon_power_input || attr == hwmon_power_label))
 		return 0444;
+	if (type == hwmon_power && ch < N_TE) {
+		if (attr == hwmon_power_max || attr == hwmon_power_crit)
+			return 0644;
+		if (attr == hwmon_power_max_alarm ||
+		    attr == hwmon_power_crit_alarm)
+			return 0444;
+	}
+	if (type == hwmon_power && ch >= N_PWR && ch < N_PWR + N_AVG) {
+		if (attr == hwmon_power_average_interval)
+			return 0644;
+		if (attr == hwmon_power_average || attr == hwmon_power_label)
+			return 0444;
+	}
 	if (type == hwmon_energy && ch < N_NRG &&
 	    (attr == hwmon_energy_input || attr == hwmon_energy_label))
 		return 0444;
 	return 0;
 }
 
-static int spbm_read(struct device *dev, enum hwmon_sensor_types type,
-		     u32 attr, int ch, long *val)
+static int spbm_read_one(struct device *dev, enum hwmon_sensor_types type,
+			 u32 attr, int ch, long *val)
 {
 	struct spbm_priv *p = dev_get_drvdata(dev);
-	u32 raw;
+	struct spbm_snapshot s;
 
+	if (type == hwmon_chip && attr == hwmon_chip_update_interval) {
+		*val = READ_ONCE(p->update_interval);
+		return 0;
+	}
 	if (type == hwmon_power && attr == hwmon_power_input && ch < N_PWR) {
-		raw = ioread32(p->base + pwr_chans[ch].offset);
-		*val = (long)raw * 1000; /* mW -> uW */
+		spbm_snapshot_get(p, &s);
+		*val = (long)s.power[ch] * 1000; /* mW -> uW */
 		return 0;
 	}
+	if (type == hwmon_power && ch < N_TE) {
+		switch (attr) {
+		case hwmon_power_max:
+			*val = (long)READ_ONCE(p->pwr_max[ch]) * 1000;
+			return 0;
+		case hwmon_power_crit:
+			*val = (long)READ_ONCE(p->pwr_crit[ch]) * 1000;
+			return 0;
+		case hwmon_power_max_alarm:
+			*val = !!(READ_ONCE(p->max_alarm) & BIT(ch));
+			return 0;
+		case hwmon_power_crit_alarm:
+			*val = !!(READ_ONCE(p->crit_alarm) & BIT(ch));
+			return 0;
+		}
+	}
+	if (type == hwmon_power && ch >= N_PWR && ch < N_PWR + N_AVG) {
+		if (attr == hwmon_power_average)
+			return spbm_power_average(p, ch - N_PWR, val);
+		if (attr == hwmon_power_average_interval) {
+			*val = READ_ONCE(p->avg_interval[ch - N_PWR]);
+			return 0;
+		}
+	}
 	if (type == hwmon_energy && attr == hwmon_energy_input && ch < N_NRG) {
-		raw = ioread32(p->base + nrg_chans[ch].offset);
-		*val = (long)raw * 1000; /* mJ -> uJ */
+		/* 64-bit, wrap-extended */
+		spbm_snapshot_get(p, &s);
+		*val = (long)s.energy_uj[ch];
+		return 0;
+	}
+	return -EOPNOTSUPP;
+}
+
+static int spbm_read(struct device *dev, enum hwmon_sensor_types type,
+		     u32 attr, int ch, long *val)
+{
+	u64 t0 = spbm_stat_start();
+	int ret;
+
+	ret = spbm_read_one(dev, type, attr, ch, val);
+	spbm_stat_end(dev_get_drvdata(dev), SPBM_PATH_HWMON, t0, 1);
+	return ret;
+}
+
+static int spbm_write(struct device *dev, enum hwmon_sensor_types type,
+		      u32 attr, int ch, long val)
+{
+	struct spbm_priv *p = dev_get_drvdata(dev);
+
+	if (type == hwmon_chip && attr == hwmon_chip_update_interval) {
+		unsigned int max;
+		int i;
+
+		WRITE_ONCE(p->update_interval,
+			   clamp_val(val, SPBM_INTERVAL_MIN_MS,
+				     SPBM_INTERVAL_MAX_MS));
+		/* a shorter history no longer backs the longest averages */
+		max = spbm_avg_max_ms(p);
+		for (i = 0; i < N_AVG; i++)
+			if (READ_ONCE(p->avg_interval[i]) > max)
+				WRITE_ONCE(p->avg_interval[i], max);
+		mod_delayed_work(system_power_efficient_wq, &p->poll_work, 0);
+		return 0;
+	}
+	if (type == hwmon_power && attr == hwmon_power_average_interval &&
+	    ch >= N_PWR && ch < N_PWR + N_AVG) {
+		/* report the window actually used, as hwmon expects */
+		WRITE_ONCE(p->avg_interval[ch - N_PWR],
+			   clamp_val(val, 1, spbm_avg_max_ms(p)));
+		return 0;
+	}
+	if (type == hwmon_power && ch < N_TE &&
+	    (attr == hwmon_power_max || attr == hwmon_power_crit)) {
+		u32 *thr = attr == hwmon_power_max ? &p->pwr_max[ch] :
+						     &p->pwr_crit[ch];
+
+		/* uW -> mW, 0 disables the alarm */
+		WRITE_ONCE(*thr, clamp_val(val, 0, (long)U32_MAX * 1000) / 1000);
 		return 0;
 	}
 	return -EOPNOTSUPP;
@@ -162,6 +2856,10 @@ static int spbm_read_string(struct device *dev, enum hwmon_sensor_types type,
 		*str = pwr_chans[ch].label;
 		return 0;
 	}
+	if (type == hwmon_power && ch < N_PWR + N_AVG) {
+		*str = avg_labels[ch - N_PWR];
+		return 0;
+	}
 	if (type == hwmon_energy && ch < N_NRG) {
 		*str = nrg_chans[ch].label;
 		return 0;
@@ -173,13 +2871,25 @@ static const struct hwmon_ops spbm_ops = {
 	.is_visible = spbm_visible,
 	.read = spbm_read,
 	.read_string = spbm_read_string,
+	.write = spbm_write,
 };
 
 /* Build config arrays with a trailing 0 sentinel */
 
-static const u32 pwr_cfg[N_PWR + 1] = {
-	[0 ... N_PWR - 1] = HWMON_P_INPUT | HWMON_P_LABEL,
-	[N_PWR] = 0,
+static const u32 chip_cfg[] = {
+	HWMON_C_UPDATE_INTERVAL,
+	0,
+};
+
+static const u32 pwr_cfg[N_PWR + N_AVG + 1] = {
+	[0 ... N_TE - 1] = HWMON_P_INPUT | HWMON_P_LABEL |
+			   HWMON_P_MAX | HWMON_P_CRIT |
+			   HWMON_P_MAX_ALARM | HWMON_P_CRIT_ALARM,
+	[N_TE ... N_PWR - 1] = HWMON_P_INPUT | HWMON_P_LABEL,
+	[N_PWR ... N_PWR + N_AVG - 1] = HWMON_P_AVERAGE |
+					HWMON_P_AVERAGE_INTERVAL |
+					HWMON_P_LABEL,
+	[N_PWR + N_AVG] = 0,
 };
 
 static const u32 nrg_cfg[N_NRG + 1] = {
@@ -187,6 +2897,11 @@ static const u32 nrg_cfg[N_NRG + 1] = {
 	[N_NRG] = 0,
 };
 
+static const struct hwmon_channel_info chip_info = {
+	.type = hwmon_chip,
+	.config = chip_cfg,
+};
+
 static const struct hwmon_channel_info pwr_info = {
 	.type = hwmon_power,
 	.config = pwr_cfg,
@@ -198,7 +2913,7 @@ static const struct hwmon_channel_info nrg_info = {
 };
 
 static const struct hwmon_channel_info * const spbm_info[] = {
-	&pwr_info, &nrg_info, NULL,
+	&chip_info, &pwr_info, &nrg_info, NULL,
 };
 
 static const struct hwmon_chip_info spbm_chip = {
@@ -217,7 +2932,6 @@ static int spbm_add(struct acpi_device *adev)
 	struct spbm_priv *p;
 	struct device *hwdev;
 	int idx = 0, ret;
-	u32 test;
 
 	p = devm_kzalloc(dev, sizeof(*p), GFP_KERNEL);
 	if (!p)
@@ -248,26 +2962,54 @@ static int spbm_add(struct acpi_device *adev)
 	p->base = devm_ioremap(dev, phys, SPBM_SIZE);
 	if (!p->base)
 		return -ENOMEM;
+	p->phys = phys;
+
+	ret = spbm_layout_init(adev, p);
+	if (ret)
+		return ret;
+
+	ret = spbm_poll_init(dev, p);
+	if (ret)
+		return ret;
 
 	/* Sanity check */
-	test = ioread32(p->base + TE_SYS_TOTAL);
-	if (test == 0 || test == 0xFFFFFFFF)
-		dev_warn(dev, "SYS_TOTAL=%u, telemetry may be inactive\n",
-			 test);
+	if (!p->snap.power[PWR_SYS_TOTAL])
+		dev_warn(dev, "SYS_TOTAL reads 0, telemetry may be inactive\n");
 	else
-		dev_info(dev, "live at 0x%llx: SYS=%u mW, SOC=%u mW, "
-			 "CPU_P=%u mW, GPU=%u mW\n", (u64)phys, test,
-			 ioread32(p->base + TE_SOC_PKG),
-			 ioread32(p->base + TE_CPU_P),
-			 ioread32(p->base + TE_GPU_OUT));
+		dev_info(dev, "live at 0x%llx (%s layout): SYS=%u mW, "
+			 "SOC=%u mW, CPU_P=%u mW, GPU=%u mW\n", (u64)phys,
+			 p->layout, p->snap.power[PWR_SYS_TOTAL],
+			 p->snap.power[PWR_SOC_PKG], p->snap.power[PWR_CPU_P],
+			 p->snap.power[PWR_GPU_OUT]);
+
+	ret = spbm_stream_init(dev, p);
+	if (ret)
+		return ret;
+
+	ret = spbm_pmu_register(dev, p);
+	if (ret)
+		return ret;
+
+	ret = spbm_debugfs_init(dev, p);
+	if (ret)
+		return ret;
+
+	ret = spbm_bpf_publish(dev, p);
+	if (ret)
+		return ret;
 
 	hwdev = devm_hwmon_device_register_with_info(dev, DRIVER_NAME, p,
-						     &spbm_chip, NULL);
+						     &spbm_chip, spbm_groups);
 	if (IS_ERR(hwdev))
 		return PTR_ERR(hwdev);
+	WRITE_ONCE(p->hwdev, hwdev);
+	ret = devm_add_action_or_reset(dev, spbm_forget_hwdev, p);
+	if (ret)
+		return ret;
 
-	dev_info(dev, "registered %zu power + %zu energy hwmon channels\n",
-		 N_PWR, N_NRG);
+	dev_info(dev, "registered %u of %zu power + %zu average + %zu energy hwmon channels\n",
+		 hweight32(p->valid & GENMASK(N_PWR - 1, 0)), N_PWR, N_AVG,
+		 N_NRG);
 
 	return 0;
 }
@@ -285,7 +3027,43 @@ static struct acpi_driver spbm_driver = {
 		.add = spbm_add,
 	},
 };
-module_acpi_driver(spbm_driver);
+
+static int __init spbm_init(void)
+{
+	int ret;
+
+	/* without module BTF there are no kfuncs, the rest still works */
+	ret = spbm_bpf_register();
+	if (ret)
+		pr_info(DRIVER_NAME ": bpf_spbm_read() unavailable (%d)\n", ret);
+
+	ret = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN, "hwmon/spbm:online",
+				      spbm_pmu_online_cpu,
+				      spbm_pmu_offline_cpu);
+	if (ret < 0)
+		return ret;
+	spbm_cpuhp_state = ret;
+
+	spbm_debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
+	debugfs_create_file_unsafe("stats_enable", 0600, spbm_debugfs_root,
+				   NULL, &spbm_stats_enable_fops);
+
+	ret = acpi_bus_register_driver(&spbm_driver);
+	if (ret) {
+		debugfs_remove_recursive(spbm_debugfs_root);
+		cpuhp_remove_multi_state(spbm_cpuhp_state);
+	}
+	return ret;
+}
+module_init(spbm_init);
+
+static void __exit spbm_exit(void)
+{
+	acpi_bus_unregister_driver(&spbm_driver);
+	debugfs_remove_recursive(spbm_debugfs_root);
+	cpuhp_remove_multi_state(spbm_cpuhp_state);
+}
+module_exit(spbm_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("DGX Spark Power Telemetry");
@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * NVIDIA DGX Spark (GB10) SPBM driver userspace ABI
+ *
+ * Shared between spbm.c and the userspace tools. Everything in here is
+ * fixed-layout and versioned; new fields are only ever appended, and
+ * readers should check the version/size words before trusting fields
+ * they know about.
+ *
+ * Power values are raw firmware milliwatts, energy values raw firmware
+ * millijoules, in the same channel order as the hwmon attributes:
+ * power[i] is powerN_input with N = i + 1, energy[i] is energyN_input.
+ * Where a single channel index is needed (masks, stream records), power
+ * channels come first: index i < SPBM_NR_POWER is power[i], the rest
+ * are energy[i - SPBM_NR_POWER].
+ */
+
+#ifndef _SPBM_UAPI_H
+#define _SPBM_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define SPBM_NR_POWER		23
+#define SPBM_NR_ENERGY		5
+#define SPBM_NR_CHANNELS	(SPBM_NR_POWER + SPBM_NR_ENERGY)
+
+/*
+ * Bulk snapshot, read from the "snapshot" binary attribute of the spbm
+ * hwmon device (/sys/class/hwmon/hwmonN/snapshot). One pread() of
+ * sizeof(struct spbm_snapshot) at offset 0 returns all channels from a
+ * single firmware update cycle. Reads at a non-zero offset may come from
+ * a later snapshot than the previous chunk.
+ */
+#define SPBM_SNAPSHOT_VERSION	2
+
+struct spbm_snapshot {
+	__u32 version;		/* SPBM_SNAPSHOT_VERSION */
+	__u32 size;		/* sizeof(struct spbm_snapshot) */
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC at capture */
+	__u32 power[SPBM_NR_POWER];	/* mW */
+	__u32 energy[SPBM_NR_ENERGY];	/* mJ, free-running u32 */
+	/* version 2 */
+	__u64 energy_uj[SPBM_NR_ENERGY];	/* uJ, 64-bit, never wraps */
+};
+
+/*
+ * Stream record, read() from /dev/spbm. The driver samples the channels
+ * in sample_channels every sample_period_us (hwmon sysfs knobs) while a
+ * reader is attached; each open file gets every record from its first
+ * read()/poll() on. seq increments by one per record, so a jump means
+ * the reader fell behind and records were dropped. read() returns whole
+ * records only and blocks until the file's watermark (default 1) is
+ * reached unless it is O_NONBLOCK; poll()/epoll report EPOLLIN once that
+ * many records are pending. A non-blocking read() returns whatever is
+ * pending.
+ */
+struct spbm_record {
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC at capture */
+	__u32 seq;
+	__u32 mask;		/* bit i set: val[i] was sampled */
+	__u32 val[SPBM_NR_CHANNELS];	/* mW, then mJ; 0 if not sampled */
+};
+
+/*
+ * Delta stream record, read() instead of struct spbm_record by files set
+ * to SPBM_FORMAT_DELTA. val[] holds only the channels in mask, in
+ * channel order, and size is the whole record padded to 8 bytes, so
+ * records are packed back to back. A keyframe carries every sampled channel; other records
+ * carry the channels whose value changed since the previous record on
+ * this file, and records where nothing changed are not returned at all,
+ * so here a seq jump alone means no change. Records the reader fell
+ * behind on are flagged on the next one with SPBM_DELTA_LOST. The first
+ * record after opening or switching format is a keyframe.
+ */
+struct spbm_delta {
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC at capture */
+	__u32 seq;
+	__u32 mask;		/* bit i set: channel i is in val[] */
+	__u32 flags;		/* SPBM_DELTA_* */
+	__u32 size;		/* bytes to the next record */
+	__u32 val[];		/* mW, then mJ */
+};
+
+#define SPBM_DELTA_KEYFRAME	0x1
+#define SPBM_DELTA_LOST		0x2
+
+/* Largest delta record; read() buffers must hold at least one */
+#define SPBM_DELTA_MAX	(sizeof(struct spbm_delta) + \
+			 SPBM_NR_CHANNELS * sizeof(__u32))
+
+/*
+ * ioctls on /dev/spbm, per open file.
+ *
+ * SPBM_IOC_SET_WATERMARK: number of pending records (1 to 512) needed
+ * before read() unblocks and poll() reports EPOLLIN. Readers that only
+ * want a batch every N sample periods set it to N and get one wakeup per
+ * batch instead of one per sample.
+ */
+#define SPBM_IOC_MAGIC		0xB5
+#define SPBM_IOC_SET_WATERMARK	_IOW(SPBM_IOC_MAGIC, 0x01, __u32)
+#define SPBM_IOC_GET_WATERMARK	_IOR(SPBM_IOC_MAGIC, 0x02, __u32)
+
+/*
+ * SPBM_IOC_GET_LAYOUT: register offset of every channel in the page that
+ * mmap() maps, after layout selection and chan_offsets=, and the mask of
+ * channels that are live. Dead channels were found unreadable at probe.
+ */
+struct spbm_layout_info {
+	__u32 valid;		/* bit i set: channel i is live */
+	__u32 offset[SPBM_NR_CHANNELS];	/* bytes into the SPBM page */
+};
+
+#define SPBM_IOC_GET_LAYOUT	_IOR(SPBM_IOC_MAGIC, 0x03, struct spbm_layout_info)
+
+/*
+ * SPBM_IOC_SET_FORMAT: what read() returns on this file. SPBM_FORMAT_FULL
+ * (default) is struct spbm_record; SPBM_FORMAT_DELTA is struct spbm_delta
+ * with a keyframe at least every keyframe records (1 to 65535, default
+ * 100; 0 keeps the current interval).
+ */
+#define SPBM_FORMAT_FULL	0
+#define SPBM_FORMAT_DELTA	1
+
+struct spbm_stream_format {
+	__u32 format;		/* SPBM_FORMAT_* */
+	__u32 keyframe;		/* records between keyframes */
+};
+
+#define SPBM_IOC_SET_FORMAT	_IOW(SPBM_IOC_MAGIC, 0x04, struct spbm_stream_format)
+#define SPBM_IOC_GET_FORMAT	_IOR(SPBM_IOC_MAGIC, 0x05, struct spbm_stream_format)
+
+#endif /* _SPBM_UAPI_H */
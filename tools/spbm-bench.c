@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spbm-bench - compare the cost of the SPBM read paths
+ *
+ * Times each way of getting telemetry out of the driver, back to back on
+ * the calling thread:
+ *
+ *   sysfs   pread() + parse of every powerN_input/energyN_input file
+ *   bulk    pread() of the snapshot attribute
+ *   mmap    plain loads from the mapped SPBM page (needs CAP_PERFMON)
+ *   ring    read() of records from /dev/spbm, time spent in read() only
+ *
+ * An op is one file, one pread, one load or one record; a sample is all
+ * live channels once. sysfs and bulk go through the driver's snapshot
+ * cache, so their cost is mostly that of a cache hit. Paths that are not
+ * available (no permission, no /dev/spbm) are skipped.
+ *
+ * Build: make -C tools
+ * Usage: spbm-bench [-n iterations] [-t ring_seconds]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+
+#define SPBM_DEV	"/dev/spbm"
+#define SPBM_PAGE	4096
+#define RING_BATCH	64
+
+struct result {
+	const char *path;
+	uint64_t ops;
+	uint64_t ns;
+	double ops_per_sample;
+	char note[64];
+};
+
+static void print_result(const struct result *r)
+{
+	double per_op;
+
+	if (!r->ops) {
+		printf("%-8s %10s %12s %12s  %s\n", r->path, "-", "-", "-",
+		       r->note);
+		return;
+	}
+	per_op = (double)r->ns / r->ops;
+	printf("%-8s %10llu %12.1f %12.1f  %s\n", r->path,
+	       (unsigned long long)r->ops, per_op,
+	       per_op * r->ops_per_sample, r->note);
+}
+
+static void bench_sysfs(const char *hwmon, long iters, struct result *r)
+{
+	int fd[SPBM_NR_CHANNELS], nfd = 0, i;
+	char path[512], buf[32];
+	uint64_t t0;
+	long n;
+
+	for (i = 0; i < SPBM_NR_CHANNELS; i++) {
+		if (i < SPBM_NR_POWER)
+			snprintf(path, sizeof(path), "%s/power%d_input",
+				 hwmon, i + 1);
+		else
+			snprintf(path, sizeof(path), "%s/energy%d_input",
+				 hwmon, i - SPBM_NR_POWER + 1);
+		fd[nfd] = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd[nfd] >= 0)
+			nfd++;
+	}
+	if (!nfd) {
+		snprintf(r->note, sizeof(r->note), "no _input files");
+		return;
+	}
+
+	t0 = spbm_now_ns();
+	for (n = 0; n < iters; n++) {
+		for (i = 0; i < nfd; i++) {
+			ssize_t len = pread(fd[i], buf, sizeof(buf) - 1, 0);
+
+			if (len > 0) {
+				buf[len] = '\0';
+				strtoull(buf, NULL, 10);
+			}
+		}
+	}
+	r->ns = spbm_now_ns() - t0;
+	r->ops = (uint64_t)iters * nfd;
+	r->ops_per_sample = nfd;
+	snprintf(r->note, sizeof(r->note), "%d files per sample", nfd);
+
+	for (i = 0; i < nfd; i++)
+		close(fd[i]);
+}
+
+static void bench_bulk(const char *hwmon, long iters, struct result *r)
+{
+	struct spbm_snapshot s;
+	uint64_t t0;
+	long n;
+	int fd;
+
+	fd = spbm_snapshot_open(hwmon);
+	if (fd < 0 || spbm_snapshot_read(fd, &s, 2)) {
+		snprintf(r->note, sizeof(r->note), "snapshot: %s",
+			 strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	t0 = spbm_now_ns();
+	for (n = 0; n < iters; n++)
+		spbm_snapshot_read(fd, &s, 2);
+	r->ns = spbm_now_ns() - t0;
+	r->ops = iters;
+	r->ops_per_sample = 1;
+	snprintf(r->note, sizeof(r->note), "one pread per sample");
+	close(fd);
+}
+
+static void bench_mmap(long iters, struct result *r)
+{
+	struct spbm_layout_info li;
+	const volatile uint32_t *page;
+	uint32_t off[SPBM_NR_CHANNELS];
+	volatile uint32_t sink;
+	int fd, nch = 0, i;
+	uint64_t t0;
+	long n;
+
+	fd = open(SPBM_DEV, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		snprintf(r->note, sizeof(r->note), SPBM_DEV ": %s",
+			 strerror(errno));
+		return;
+	}
+	if (ioctl(fd, SPBM_IOC_GET_LAYOUT, &li)) {
+		snprintf(r->note, sizeof(r->note), "GET_LAYOUT: %s",
+			 strerror(errno));
+		close(fd);
+		return;
+	}
+	page = mmap(NULL, SPBM_PAGE, PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		snprintf(r->note, sizeof(r->note), "mmap: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+	for (i = 0; i < SPBM_NR_CHANNELS; i++)
+		if (li.valid & (1u << i))
+			off[nch++] = li.offset[i] / 4;
+
+	t0 = spbm_now_ns();
+	for (n = 0; n < iters; n++)
+		for (i = 0; i < nch; i++)
+			sink = page[off[i]];
+	r->ns = spbm_now_ns() - t0;
+	r->ops = (uint64_t)iters * nch;
+	r->ops_per_sample = nch;
+	snprintf(r->note, sizeof(r->note), "%d loads per sample, no coherency",
+		 nch);
+	(void)sink;
+
+	munmap((void *)page, SPBM_PAGE);
+	close(fd);
+}
+
+static void bench_ring(const char *hwmon, long seconds, struct result *r)
+{
+	static struct spbm_record rec[RING_BATCH];
+	char path[512], buf[32];
+	uint64_t end, t0;
+	struct pollfd pfd;
+	FILE *f;
+	int fd;
+
+	fd = open(SPBM_DEV, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		snprintf(r->note, sizeof(r->note), SPBM_DEV ": %s",
+			 strerror(errno));
+		return;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	end = spbm_now_ns() + seconds * 1000000000ull;
+	while (spbm_now_ns() < end) {
+		ssize_t len;
+
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		t0 = spbm_now_ns();
+		len = read(fd, rec, sizeof(rec));
+		if (len <= 0)
+			continue;
+		r->ns += spbm_now_ns() - t0;
+		r->ops += len / sizeof(rec[0]);
+	}
+	r->ops_per_sample = 1;
+
+	snprintf(path, sizeof(path), "%s/sample_period_us", hwmon);
+	f = fopen(path, "r");
+	if (f && fgets(buf, sizeof(buf), f))
+		snprintf(r->note, sizeof(r->note), "per record, period %ld us",
+			 strtol(buf, NULL, 10));
+	else
+		snprintf(r->note, sizeof(r->note), "per record");
+	if (f)
+		fclose(f);
+	close(fd);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n iterations] [-t ring_seconds]\n"
+		"  -n n  samples per path for sysfs, bulk and mmap (default 10000)\n"
+		"  -t s  how long to read the record stream (default 2)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct result res[4] = {
+		{ .path = "sysfs" }, { .path = "bulk" },
+		{ .path = "mmap" }, { .path = "ring" },
+	};
+	long iters = 10000, seconds = 2;
+	char hwmon[256];
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:t:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			iters = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (iters < 1 || seconds < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (spbm_find_hwmon(hwmon, sizeof(hwmon))) {
+		fprintf(stderr, "Error: spbm driver not found in /sys/class/hwmon/\n");
+		return 1;
+	}
+
+	bench_sysfs(hwmon, iters, &res[0]);
+	bench_bulk(hwmon, iters, &res[1]);
+	bench_mmap(iters, &res[2]);
+	if (seconds)
+		bench_ring(hwmon, seconds, &res[3]);
+	else
+		snprintf(res[3].note, sizeof(res[3].note), "skipped (-t 0)");
+
+	printf("%-8s %10s %12s %12s  %s\n", "path", "ops", "ns/op",
+	       "ns/sample", "");
+	for (i = 0; i < sizeof(res) / sizeof(res[0]); i++)
+		print_result(&res[i]);
+	return 0;
+}
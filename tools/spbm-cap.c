@@ -0,0 +1,497 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spbm-cap - closed-loop node power capping
+ *
+ * Holds a power channel (sys_total by default) at or below a target by
+ * lowering the cpufreq maximum frequency of the CPU clusters. Firmware
+ * clamps the SoC only once PL1 is reached. This controller acts before
+ * that, on any channel, and favours the cluster that costs the most:
+ *
+ *   u = 0..1   P-cores (Cortex-X925) from their top frequency to the bottom
+ *   u = 1..2   then the E-cores (Cortex-A725)
+ *
+ * u is a PI controller on the error relative to the target. Each period
+ * it is fed the mean power over that period: from the energy delta when
+ * the channel has an accumulator (soc_pkg: EN_PKG), otherwise from the
+ * mean of the 100 ms firmware samples. With -L the target also follows
+ * the firmware limit of the channel's domain (PL1_EFF for soc_pkg,
+ * SYSPL1_EFF for sys_total) minus a margin, so the node settles below
+ * the firmware clamp instead of bouncing off it.
+ *
+ * With -b, a cgroup of batch work is moved onto the E-cores while the
+ * cap is active and given its original cpuset back once the node has
+ * stayed under the target with the controller at rest. The original
+ * cpufreq limits and cpuset are restored on exit.
+ *
+ * Build: make -C tools
+ * Usage: spbm-cap [-W watts] [-L] [-c channel] [-p ms] [-b cgroup] [-v]
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+
+#define CPUFREQ_DIR	"/sys/devices/system/cpu/cpufreq"
+#define MAX_POLICIES	SPBM_MAX_CPUS
+#define SAMPLE_MS	100		/* firmware update period */
+#define RELEASE_TICKS	10		/* at rest before batch work returns */
+#define U_MAX		2.0
+
+/* Channels that have an accumulator, and the limit of their domain */
+static const struct {
+	const char *power;
+	const char *energy;
+	const char *limit;
+} domains[] = {
+	{ "soc_pkg",	"pkg",		"pl1" },
+	{ "sys_total",	NULL,		"syspl1" },
+	{ "cpu_p",	"cpu_p",	NULL },
+	{ "cpu_e",	"cpu_e",	NULL },
+};
+#define N_DOMAINS	(sizeof(domains) / sizeof(domains[0]))
+
+struct policy {
+	char dir[320];
+	enum spbm_cluster cluster;
+	unsigned long min_khz;
+	unsigned long max_khz;
+	unsigned long orig_khz;		/* scaling_max_freq at startup */
+	unsigned long set_khz;		/* last written */
+};
+
+struct cap {
+	/* configuration */
+	double watts;			/* 0 = only the firmware limit */
+	bool follow_limit;
+	double margin_pct;
+	long period;			/* ms */
+	double kp, ki;
+	bool verbose;
+	const char *batch;		/* cgroup directory or NULL */
+
+	/* channels */
+	int pwr, nrg, lim;		/* snapshot indexes, -1 if none */
+
+	/* actuators */
+	struct policy pol[MAX_POLICIES];
+	int npol;
+	uint64_t e_mask;		/* E-core CPUs */
+	char batch_orig[256];		/* cpuset.cpus at startup */
+	bool batch_moved;
+	unsigned int rest_ticks;
+
+	/* controller */
+	double integ;
+	double u;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int read_ulong(const char *path, unsigned long *v)
+{
+	char buf[64];
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	*v = strtoul(buf, NULL, 10);
+	return 0;
+}
+
+static int write_str(const char *path, const char *s)
+{
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	ssize_t n;
+
+	if (fd < 0)
+		return -1;
+	n = write(fd, s, strlen(s));
+	close(fd);
+	return n == (ssize_t)strlen(s) ? 0 : -1;
+}
+
+static void format_cpulist(uint64_t mask, char *buf, size_t len)
+{
+	size_t off = 0;
+	int a, b;
+
+	buf[0] = '\0';
+	for (a = 0; a < SPBM_MAX_CPUS && off < len; a++) {
+		if (!(mask & (1ull << a)))
+			continue;
+		for (b = a; b + 1 < SPBM_MAX_CPUS && (mask & (1ull << (b + 1)));
+		     b++)
+			;
+		off += snprintf(buf + off, len - off, off ? ",%d" : "%d", a);
+		if (b > a && off < len)
+			off += snprintf(buf + off, len - off, "-%d", b);
+		a = b;
+	}
+}
+
+/* One entry per cpufreq policy, classified by the cluster of its CPUs */
+static int policies_init(struct cap *c, const struct spbm_topology *t)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(CPUFREQ_DIR);
+	if (!d)
+		return -1;
+	while ((de = readdir(d)) && c->npol < MAX_POLICIES) {
+		struct policy *p = &c->pol[c->npol];
+		char path[384], buf[256];
+		uint64_t cpus;
+		FILE *f;
+		int cpu;
+
+		if (strncmp(de->d_name, "policy", 6))
+			continue;
+		snprintf(p->dir, sizeof(p->dir), CPUFREQ_DIR "/%s", de->d_name);
+
+		snprintf(path, sizeof(path), "%s/related_cpus", p->dir);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (!fgets(buf, sizeof(buf), f)) {
+			fclose(f);
+			continue;
+		}
+		fclose(f);
+		/* related_cpus is space separated */
+		for (cpu = 0; buf[cpu]; cpu++)
+			if (buf[cpu] == ' ')
+				buf[cpu] = ',';
+		if (spbm_parse_cpulist(buf, &cpus) || !cpus)
+			continue;
+		cpu = __builtin_ctzll(cpus);
+		if (cpu >= t->ncpus)
+			continue;
+		p->cluster = t->cluster[cpu];
+
+		snprintf(path, sizeof(path), "%s/cpuinfo_min_freq", p->dir);
+		if (read_ulong(path, &p->min_khz))
+			continue;
+		snprintf(path, sizeof(path), "%s/cpuinfo_max_freq", p->dir);
+		if (read_ulong(path, &p->max_khz))
+			continue;
+		snprintf(path, sizeof(path), "%s/scaling_max_freq", p->dir);
+		if (read_ulong(path, &p->orig_khz) || access(path, W_OK))
+			continue;
+		p->set_khz = p->orig_khz;
+		c->npol++;
+	}
+	closedir(d);
+	return c->npol ? 0 : -1;
+}
+
+static void policy_set(struct policy *p, unsigned long khz)
+{
+	char path[384], buf[32];
+
+	if (khz == p->set_khz)
+		return;
+	snprintf(path, sizeof(path), "%s/scaling_max_freq", p->dir);
+	snprintf(buf, sizeof(buf), "%lu", khz);
+	if (!write_str(path, buf))
+		p->set_khz = khz;
+}
+
+/* frac 0 = top frequency, 1 = bottom */
+static void cluster_set(struct cap *c, enum spbm_cluster cl, double frac)
+{
+	int i;
+
+	for (i = 0; i < c->npol; i++) {
+		struct policy *p = &c->pol[i];
+
+		if (p->cluster == cl)
+			policy_set(p, p->max_khz -
+				   (unsigned long)(frac * (p->max_khz - p->min_khz)));
+	}
+}
+
+static unsigned long cluster_khz(const struct cap *c, enum spbm_cluster cl)
+{
+	int i;
+
+	for (i = 0; i < c->npol; i++)
+		if (c->pol[i].cluster == cl)
+			return c->pol[i].set_khz;
+	return 0;
+}
+
+static void batch_move(struct cap *c, bool to_e)
+{
+	char path[512], list[256];
+
+	if (!c->batch || c->batch_moved == to_e)
+		return;
+	snprintf(path, sizeof(path), "%s/cpuset.cpus", c->batch);
+	if (to_e)
+		format_cpulist(c->e_mask, list, sizeof(list));
+	else
+		snprintf(list, sizeof(list), "%s", c->batch_orig);
+	if (write_str(path, list[0] ? list : "\n")) {
+		perror(path);
+		c->batch = NULL;	/* do not retry every tick */
+		return;
+	}
+	c->batch_moved = to_e;
+}
+
+static void restore(struct cap *c)
+{
+	int i;
+
+	for (i = 0; i < c->npol; i++)
+		policy_set(&c->pol[i], c->pol[i].orig_khz);
+	batch_move(c, false);
+}
+
+static double target_watts(const struct cap *c, const struct spbm_snapshot *s)
+{
+	double t = c->watts;
+
+	if (c->follow_limit && c->lim >= 0 && s->power[c->lim]) {
+		double lim = s->power[c->lim] / 1000.0 *
+			     (100 - c->margin_pct) / 100;
+
+		if (!t || lim < t)
+			t = lim;
+	}
+	return t;
+}
+
+/* One control step on the mean power of the last period */
+static void control(struct cap *c, double watts, double target)
+{
+	double e = (watts - target) / target;
+
+	c->integ += c->ki * e;
+	if (c->integ < 0)
+		c->integ = 0;
+	if (c->integ > U_MAX)
+		c->integ = U_MAX;
+	c->u = c->integ + c->kp * e;
+	if (c->u < 0)
+		c->u = 0;
+	if (c->u > U_MAX)
+		c->u = U_MAX;
+
+	cluster_set(c, SPBM_CLUSTER_P, c->u < 1 ? c->u : 1);
+	cluster_set(c, SPBM_CLUSTER_E, c->u > 1 ? c->u - 1 : 0);
+
+	if (c->u > 0) {
+		c->rest_ticks = 0;
+		batch_move(c, true);
+	} else if (++c->rest_ticks >= RELEASE_TICKS) {
+		batch_move(c, false);
+	}
+}
+
+static void sleep_until(struct timespec *t, long ms)
+{
+	t->tv_nsec += (ms % 1000) * 1000000;
+	t->tv_sec += ms / 1000 + t->tv_nsec / 1000000000;
+	t->tv_nsec %= 1000000000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-W watts] [-L] [-c channel] [-p ms] [-b cgroup] [-v]\n"
+		"  -W watts    cap on the channel\n"
+		"  -L          also stay -m percent below the firmware limit\n"
+		"  -m pct      margin for -L (default 3)\n"
+		"  -c channel  power channel to cap (default sys_total)\n"
+		"  -p ms       control period (default 500, multiple of %d)\n"
+		"  -k kp,ki    controller gains per period (default 0.5,0.2)\n"
+		"  -b cgroup   cgroup v2 directory of batch work to move to E-cores\n"
+		"  -v          print one line per period\n",
+		prog, SAMPLE_MS);
+}
+
+int main(int argc, char **argv)
+{
+	struct cap c = {
+		.margin_pct = 3, .period = 500, .kp = 0.5, .ki = 0.2,
+		.pwr = -1, .nrg = -1, .lim = -1,
+	};
+	const char *channel = "sys_total";
+	struct spbm_snapshot s, prev;
+	struct sigaction sa = { 0 };
+	struct spbm_topology topo;
+	struct timespec next;
+	uint64_t start_ns, last_ts, sum_mw = 0;
+	unsigned int nsum = 0, i;
+	char hwmon[256];
+	int opt, snap_fd, cpu;
+
+	while ((opt = getopt(argc, argv, "W:Lm:c:p:k:b:vh")) != -1) {
+		switch (opt) {
+		case 'W':
+			c.watts = strtod(optarg, NULL);
+			break;
+		case 'L':
+			c.follow_limit = true;
+			break;
+		case 'm':
+			c.margin_pct = strtod(optarg, NULL);
+			break;
+		case 'c':
+			channel = optarg;
+			break;
+		case 'p':
+			c.period = strtol(optarg, NULL, 0);
+			break;
+		case 'k':
+			if (sscanf(optarg, "%lf,%lf", &c.kp, &c.ki) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'b':
+			c.batch = optarg;
+			break;
+		case 'v':
+			c.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if ((c.watts <= 0 && !c.follow_limit) || c.watts < 0 ||
+	    c.period < SAMPLE_MS || c.period % SAMPLE_MS ||
+	    c.margin_pct < 0 || c.margin_pct >= 100 || c.kp < 0 || c.ki <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (spbm_find_hwmon(hwmon, sizeof(hwmon))) {
+		fprintf(stderr, "Error: spbm driver not found in /sys/class/hwmon/\n");
+		return 1;
+	}
+	c.pwr = spbm_channel_index(hwmon, "power", channel);
+	if (c.pwr < 0) {
+		fprintf(stderr, "Error: no %s power channel\n", channel);
+		return 1;
+	}
+	for (i = 0; i < N_DOMAINS; i++) {
+		if (strcmp(domains[i].power, channel))
+			continue;
+		if (domains[i].energy)
+			c.nrg = spbm_channel_index(hwmon, "energy",
+						   domains[i].energy);
+		if (domains[i].limit)
+			c.lim = spbm_channel_index(hwmon, "power",
+						   domains[i].limit);
+	}
+	if (c.follow_limit && c.lim < 0) {
+		fprintf(stderr, "Error: -L: %s has no firmware limit\n", channel);
+		return 1;
+	}
+	snap_fd = spbm_snapshot_open(hwmon);
+	if (snap_fd < 0 || spbm_snapshot_read(snap_fd, &s, 2)) {
+		fprintf(stderr, "Error: spbm snapshot unavailable\n");
+		return 1;
+	}
+
+	if (spbm_topology_read(&topo) || policies_init(&c, &topo)) {
+		fprintf(stderr, "Error: no writable cpufreq policies\n");
+		return 1;
+	}
+	for (cpu = 0; cpu < topo.ncpus; cpu++)
+		if (topo.cluster[cpu] == SPBM_CLUSTER_E)
+			c.e_mask |= 1ull << cpu;
+	if (c.batch) {
+		char path[512];
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/cpuset.cpus", c.batch);
+		f = fopen(path, "r");
+		if (!f || !fgets(c.batch_orig, sizeof(c.batch_orig), f)) {
+			perror(path);
+			return 1;
+		}
+		fclose(f);
+		c.batch_orig[strcspn(c.batch_orig, "\n")] = '\0';
+	}
+
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (c.verbose)
+		printf("%8s %9s %9s %6s %9s %9s\n", "sec", "power(W)",
+		       "target(W)", "u", "P(MHz)", "E(MHz)");
+
+	prev = s;
+	start_ns = spbm_now_ns();
+	last_ts = s.timestamp_ns;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!stop) {
+		double watts, target;
+
+		for (i = 0; i < c.period / SAMPLE_MS && !stop; i++) {
+			sleep_until(&next, SAMPLE_MS);
+			if (spbm_snapshot_read(snap_fd, &s, 2) ||
+			    s.timestamp_ns == last_ts)
+				continue;
+			last_ts = s.timestamp_ns;
+			sum_mw += s.power[c.pwr];
+			nsum++;
+		}
+		if (stop || !nsum || s.timestamp_ns <= prev.timestamp_ns)
+			continue;
+
+		/* the energy delta is the exact mean over the period */
+		if (c.nrg >= 0)
+			watts = (s.energy_uj[c.nrg] - prev.energy_uj[c.nrg]) *
+				1e3 / (s.timestamp_ns - prev.timestamp_ns);
+		else
+			watts = sum_mw / 1000.0 / nsum;
+		target = target_watts(&c, &s);
+		if (target > 0)
+			control(&c, watts, target);
+
+		if (c.verbose) {
+			printf("%8.1f %9.3f %9.3f %6.3f %9lu %9lu%s\n",
+			       (spbm_now_ns() - start_ns) / 1e9,
+			       watts, target, c.u,
+			       cluster_khz(&c, SPBM_CLUSTER_P) / 1000,
+			       cluster_khz(&c, SPBM_CLUSTER_E) / 1000,
+			       c.batch_moved ? "  batch on E" : "");
+			fflush(stdout);
+		}
+		prev = s;
+		sum_mw = 0;
+		nsum = 0;
+	}
+
+	restore(&c);
+	close(snap_fd);
+	return 0;
+}
@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spbm-cgenergy - attribute CPU cluster energy to cgroups
+ *
+ * On every tick, the EN_CPU_P and EN_CPU_E deltas are split between
+ * cgroups in proportion to the CPU time each cgroup spent on P-cores
+ * (Cortex-X925) and E-cores (Cortex-A725). The result is a cumulative
+ * energy_uj file per cgroup, written to a tree under the output
+ * directory that mirrors the cgroup hierarchy:
+ *
+ *   /run/spbm-cgroup/system.slice/foo.service/energy_uj
+ *
+ * Everything is batched per tick from counters the kernel already keeps
+ * (cpu.stat, /proc/stat), so there is no per-context-switch cost. The
+ * per-cluster split of a cgroup's CPU time is estimated from how busy
+ * each cluster was within its cpuset.cpus.effective. That is exact for
+ * cgroups confined to one cluster, and an approximation for cgroups
+ * spanning both. Energy of a cgroup includes its descendants, as
+ * cpu.stat does. Idle cluster energy is not attributed.
+ *
+ * Build: make -C tools
+ * Usage: spbm-cgenergy [-i ms] [-r cgroup_root] [-o output_dir]
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+
+#define HASH_SIZE	1024
+
+struct cgroup {
+	struct cgroup *next;
+	char *rel;		/* path relative to the cgroup root, "" = root */
+	uint64_t usage_us;	/* last cpu.stat usage_usec */
+	double energy_uj;
+	uint64_t written;	/* value last written to energy_uj */
+	int fd;			/* open energy_uj, -1 until created */
+	unsigned int gen;	/* tick the cgroup was last seen */
+};
+
+struct state {
+	const char *root;
+	const char *out;
+	struct spbm_topology topo;
+	uint64_t cpu_mask[SPBM_NR_CLUSTERS];
+	uint64_t busy_prev[SPBM_MAX_CPUS];
+	uint64_t busy_us[SPBM_MAX_CPUS];	/* delta this tick */
+	uint64_t cluster_busy_us[SPBM_NR_CLUSTERS];
+	double cluster_uj[SPBM_NR_CLUSTERS];	/* energy delta this tick */
+	long clk_tck;
+	unsigned int gen;
+	struct cgroup *hash[HASH_SIZE];
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static unsigned int hash_str(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h % HASH_SIZE;
+}
+
+static struct cgroup *cgroup_get(struct state *st, const char *rel)
+{
+	unsigned int h = hash_str(rel);
+	struct cgroup *cg;
+
+	for (cg = st->hash[h]; cg; cg = cg->next)
+		if (!strcmp(cg->rel, rel))
+			return cg;
+
+	cg = calloc(1, sizeof(*cg));
+	if (!cg)
+		return NULL;
+	cg->rel = strdup(rel);
+	if (!cg->rel) {
+		free(cg);
+		return NULL;
+	}
+	cg->fd = -1;
+	cg->usage_us = UINT64_MAX;	/* no baseline yet */
+	cg->next = st->hash[h];
+	st->hash[h] = cg;
+	return cg;
+}
+
+static int mkdir_p(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	return mkdir(path, 0755) && errno != EEXIST ? -1 : 0;
+}
+
+static void cgroup_publish(struct state *st, struct cgroup *cg)
+{
+	uint64_t val = (uint64_t)cg->energy_uj;
+	char buf[32], path[4096];
+	int n;
+
+	if (cg->fd >= 0 && val == cg->written)
+		return;
+
+	if (cg->fd < 0) {
+		snprintf(path, sizeof(path), "%s/%s", st->out, cg->rel);
+		if (mkdir_p(path))
+			return;
+		strncat(path, "/energy_uj", sizeof(path) - strlen(path) - 1);
+		cg->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (cg->fd < 0)
+			return;
+	}
+
+	/* Fixed width so a rewrite in place never leaves a stale tail */
+	n = snprintf(buf, sizeof(buf), "%20" PRIu64 "\n", val);
+	if (pwrite(cg->fd, buf, n, 0) == n)
+		cg->written = val;
+}
+
+static int read_usage(int dfd, uint64_t *usage)
+{
+	char buf[256];
+	FILE *f;
+	int fd;
+
+	fd = openat(dfd, "cpu.stat", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), f)) {
+		if (sscanf(buf, "usage_usec %" SCNu64, usage) == 1) {
+			fclose(f);
+			return 0;
+		}
+	}
+	fclose(f);
+	return -1;
+}
+
+static uint64_t read_cpuset(struct state *st, int dfd)
+{
+	uint64_t all = st->cpu_mask[SPBM_CLUSTER_P] | st->cpu_mask[SPBM_CLUSTER_E];
+	uint64_t mask;
+	char buf[256];
+	ssize_t n;
+	int fd;
+
+	fd = openat(dfd, "cpuset.cpus.effective", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return all;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return all;
+	buf[n] = '\0';
+	if (spbm_parse_cpulist(buf, &mask) || !(mask & all))
+		return all;
+	return mask & all;
+}
+
+static void account(struct state *st, struct cgroup *cg, uint64_t usage,
+		    uint64_t cpus)
+{
+	uint64_t busy[SPBM_NR_CLUSTERS] = { 0 };
+	double du, share;
+	int cpu, c;
+
+	if (cg->usage_us == UINT64_MAX || usage < cg->usage_us) {
+		cg->usage_us = usage;
+		return;
+	}
+	du = usage - cg->usage_us;
+	cg->usage_us = usage;
+	if (!du)
+		return;
+
+	for (cpu = 0; cpu < st->topo.ncpus; cpu++)
+		if (cpus & (1ull << cpu))
+			busy[st->topo.cluster[cpu]] += st->busy_us[cpu];
+
+	for (c = 0; c < SPBM_NR_CLUSTERS; c++) {
+		uint64_t in_set = busy[SPBM_CLUSTER_P] + busy[SPBM_CLUSTER_E];
+
+		if (!st->cluster_busy_us[c])
+			continue;
+		if (in_set)
+			share = du * busy[c] / in_set;
+		else
+			share = du * __builtin_popcountll(cpus & st->cpu_mask[c]) /
+				__builtin_popcountll(cpus);
+		if (share > st->cluster_busy_us[c])
+			share = st->cluster_busy_us[c];
+		cg->energy_uj += st->cluster_uj[c] * share /
+				 st->cluster_busy_us[c];
+	}
+}
+
+static void walk(struct state *st, int dfd, char *rel, size_t len)
+{
+	struct cgroup *cg;
+	struct dirent *de;
+	uint64_t usage;
+	DIR *d;
+
+	if (!read_usage(dfd, &usage)) {
+		cg = cgroup_get(st, rel);
+		if (cg) {
+			account(st, cg, usage, read_cpuset(st, dfd));
+			cg->gen = st->gen;
+			cgroup_publish(st, cg);
+		}
+	}
+
+	d = fdopendir(dfd);
+	if (!d) {
+		close(dfd);
+		return;
+	}
+	while ((de = readdir(d))) {
+		size_t n = strlen(de->d_name);
+		int sub;
+
+		if (de->d_type != DT_DIR || de->d_name[0] == '.')
+			continue;
+		if (len + n + 2 >= PATH_MAX)
+			continue;
+		sub = openat(dirfd(d), de->d_name,
+			     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (sub < 0)
+			continue;
+		rel[len] = '\0';
+		if (len)
+			strcat(rel, "/");
+		strcat(rel, de->d_name);
+		walk(st, sub, rel, strlen(rel));
+		rel[len] = '\0';
+	}
+	closedir(d);
+}
+
+static int by_depth(const void *a, const void *b)
+{
+	const struct cgroup *x = *(struct cgroup * const *)a;
+	const struct cgroup *y = *(struct cgroup * const *)b;
+
+	return (int)strlen(y->rel) - (int)strlen(x->rel);
+}
+
+/* Drop cgroups that went away, deepest first so their dirs are empty */
+static void reap(struct state *st)
+{
+	struct cgroup **gone = NULL, **pp, *cg;
+	size_t n = 0, i;
+	char path[4096];
+	int h;
+
+	for (h = 0; h < HASH_SIZE; h++) {
+		for (pp = &st->hash[h]; (cg = *pp);) {
+			struct cgroup **tmp;
+
+			if (cg->gen == st->gen) {
+				pp = &cg->next;
+				continue;
+			}
+			tmp = realloc(gone, (n + 1) * sizeof(*gone));
+			if (!tmp)
+				break;
+			*pp = cg->next;
+			gone = tmp;
+			gone[n++] = cg;
+		}
+	}
+	if (n)
+		qsort(gone, n, sizeof(*gone), by_depth);
+
+	for (i = 0; i < n; i++) {
+		cg = gone[i];
+		if (cg->fd >= 0) {
+			close(cg->fd);
+			snprintf(path, sizeof(path), "%s/%s/energy_uj",
+				 st->out, cg->rel);
+			unlink(path);
+			*strrchr(path, '/') = '\0';
+			rmdir(path);
+		}
+		free(cg->rel);
+		free(cg);
+	}
+	free(gone);
+}
+
+static int sample_cpus(struct state *st)
+{
+	uint64_t busy[SPBM_MAX_CPUS] = { 0 };
+	int cpu;
+
+	if (spbm_cpu_busy(busy, st->topo.ncpus))
+		return -1;
+
+	memset(st->cluster_busy_us, 0, sizeof(st->cluster_busy_us));
+	for (cpu = 0; cpu < st->topo.ncpus; cpu++) {
+		uint64_t d = busy[cpu] >= st->busy_prev[cpu] ?
+			     busy[cpu] - st->busy_prev[cpu] : 0;
+
+		st->busy_us[cpu] = d * 1000000 / st->clk_tck;
+		st->busy_prev[cpu] = busy[cpu];
+		st->cluster_busy_us[st->topo.cluster[cpu]] += st->busy_us[cpu];
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-i ms] [-r cgroup_root] [-o output_dir]\n"
+		"  -i ms    accounting tick (default 1000)\n"
+		"  -r dir   cgroup v2 mount (default /sys/fs/cgroup)\n"
+		"  -o dir   where energy_uj files go (default /run/spbm-cgroup)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct state st = {
+		.root = "/sys/fs/cgroup",
+		.out = "/run/spbm-cgroup",
+	};
+	int ch_nrg[SPBM_NR_CLUSTERS];
+	uint64_t prev_uj[SPBM_NR_CLUSTERS];
+	struct itimerspec its = { 0 };
+	struct sigaction sa = { 0 };
+	struct spbm_snapshot snap;
+	char hwmon[256], rel[PATH_MAX];
+	long interval = 1000;
+	int opt, snap_fd, tfd, c;
+
+	while ((opt = getopt(argc, argv, "i:r:o:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			st.root = optarg;
+			break;
+		case 'o':
+			st.out = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (interval < 10) {
+		fprintf(stderr, "interval must be at least 10 ms\n");
+		return 1;
+	}
+
+	if (spbm_find_hwmon(hwmon, sizeof(hwmon))) {
+		fprintf(stderr, "Error: spbm driver not found in /sys/class/hwmon/\n");
+		return 1;
+	}
+	ch_nrg[SPBM_CLUSTER_P] = spbm_channel_index(hwmon, "energy", "cpu_p");
+	ch_nrg[SPBM_CLUSTER_E] = spbm_channel_index(hwmon, "energy", "cpu_e");
+	snap_fd = spbm_snapshot_open(hwmon);
+	if (ch_nrg[SPBM_CLUSTER_P] < 0 || ch_nrg[SPBM_CLUSTER_E] < 0 ||
+	    snap_fd < 0 || spbm_snapshot_read(snap_fd, &snap, 2)) {
+		fprintf(stderr, "Error: spbm snapshot with cpu_p/cpu_e energy unavailable\n");
+		return 1;
+	}
+	if (spbm_topology_read(&st.topo)) {
+		fprintf(stderr, "Error: cannot read CPU topology\n");
+		return 1;
+	}
+	for (c = 0; c < st.topo.ncpus; c++)
+		st.cpu_mask[st.topo.cluster[c]] |= 1ull << c;
+	st.clk_tck = sysconf(_SC_CLK_TCK);
+
+	for (c = 0; c < SPBM_NR_CLUSTERS; c++)
+		prev_uj[c] = snap.energy_uj[ch_nrg[c]];
+	sample_cpus(&st);
+
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("timerfd_create");
+		return 1;
+	}
+	its.it_interval.tv_sec = interval / 1000;
+	its.it_interval.tv_nsec = (interval % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	timerfd_settime(tfd, 0, &its, NULL);
+
+	while (!stop) {
+		uint64_t expirations;
+		int dfd;
+
+		if (read(tfd, &expirations, sizeof(expirations)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("timerfd");
+			break;
+		}
+
+		if (spbm_snapshot_read(snap_fd, &snap, 2) || sample_cpus(&st))
+			continue;
+		for (c = 0; c < SPBM_NR_CLUSTERS; c++) {
+			uint64_t uj = snap.energy_uj[ch_nrg[c]];
+
+			st.cluster_uj[c] = uj - prev_uj[c];
+			prev_uj[c] = uj;
+		}
+
+		st.gen++;
+		dfd = open(st.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dfd < 0) {
+			perror(st.root);
+			break;
+		}
+		rel[0] = '\0';
+		walk(&st, dfd, rel, 0);
+		reap(&st);
+	}
+
+	close(tfd);
+	close(snap_fd);
+	return 0;
+}
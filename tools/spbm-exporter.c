@@ -0,0 +1,827 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spbm-exporter - Prometheus exporter for SPBM telemetry
+ *
+ * Serves every power and energy channel of the spbm hwmon device on
+ * GET /metrics in the Prometheus text format, labelled with the hwmon
+ * channel labels:
+ *
+ *   spbm_power_watts{channel="sys_total"} 41.250
+ *   spbm_energy_joules_total{channel="pkg"} 123456.789
+ *
+ * Each scrape is one pread() of the bulk snapshot attribute on an fd
+ * opened at startup, formatted into a static buffer. Labels are read
+ * once at startup, nothing is allocated per scrape, and the process
+ * sleeps in accept() between scrapes. Requests are served one at a time.
+ *
+ * For many nodes, scraping every channel at a high rate does not scale.
+ * Push mode (-p) samples locally instead. Every -w seconds it sends one
+ * UDP datagram holding the window's min/max/mean of each power channel
+ * and the 64-bit energy accumulators. Collector
+ * mode (-c) receives those batches from any number of nodes. It serves
+ * per-node series and the rack-wide sum of sys_total and dc_input on
+ * /metrics. The network cost is one datagram of a few hundred bytes per
+ * node and window, whatever the sampling rate.
+ *
+ * A batch is "SPBA", a version byte, then LEB128 varints: epoch, seq,
+ * window length in ms, sample count, channel mask, node name (length,
+ * bytes). Then, for each channel in the mask, its label (length, bytes),
+ * followed by min, max - min and mean - min in mW for power or the
+ * accumulator in uJ for energy. The epoch is the sender's start time,
+ * CLOCK_REALTIME in ns, so seq restarting from 0 is told apart from a
+ * late datagram. Energy is absolute and the collector takes the deltas,
+ * so a lost datagram only delays energy to the next one.
+ *
+ * Build: make -C tools
+ * Usage: spbm-exporter [-l [addr:]port]
+ *        spbm-exporter -p host:port [-i ms] [-w s] [-n node]
+ *        spbm-exporter -c [addr:]port [-l [addr:]port]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+
+#define DEFAULT_PORT	"9877"
+#define LABEL_LEN	32
+#define REQ_LEN		1024
+#define BODY_LEN	(1 << 20)	/* collector: MAX_NODES of every channel */
+
+#define BATCH_MAGIC	"SPBA"
+#define BATCH_VERSION	2
+#define BATCH_LEN	1472		/* one unfragmented datagram */
+#define NODE_LEN	64
+#define MAX_NODES	64
+#define STALE_WINDOWS	3		/* node left out of rack sums after */
+
+/* Channels the collector sums across nodes */
+static const char * const rack_channels[] = { "sys_total", "dc_input" };
+#define N_RACK	(sizeof(rack_channels) / sizeof(rack_channels[0]))
+
+static char power_label[SPBM_NR_POWER][LABEL_LEN];
+static char energy_label[SPBM_NR_ENERGY][LABEL_LEN];
+static char req[REQ_LEN];
+static char body[BODY_LEN];
+static char head[256];
+static bool collector;		/* /metrics shows received batches */
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/* Append to body at *off, never past BODY_LEN */
+static void emit(size_t *off, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void emit(size_t *off, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (*off >= BODY_LEN)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(body + *off, BODY_LEN - *off, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		*off += n;
+}
+
+static size_t format_metrics(int snap_fd)
+{
+	struct spbm_snapshot s;
+	size_t off = 0;
+	int i;
+
+	if (spbm_snapshot_read(snap_fd, &s, 2)) {
+		emit(&off, "# TYPE spbm_up gauge\nspbm_up 0\n");
+		return off;
+	}
+
+	emit(&off, "# HELP spbm_power_watts SPBM power telemetry, limits and budgets.\n"
+		   "# TYPE spbm_power_watts gauge\n");
+	for (i = 0; i < SPBM_NR_POWER; i++)
+		if (power_label[i][0])
+			emit(&off, "spbm_power_watts{channel=\"%s\"} %u.%03u\n",
+			     power_label[i], s.power[i] / 1000,
+			     s.power[i] % 1000);
+
+	emit(&off, "# HELP spbm_energy_joules_total SPBM energy accumulators.\n"
+		   "# TYPE spbm_energy_joules_total counter\n");
+	for (i = 0; i < SPBM_NR_ENERGY; i++)
+		if (energy_label[i][0])
+			emit(&off, "spbm_energy_joules_total{channel=\"%s\"} %" PRIu64 ".%06" PRIu64 "\n",
+			     energy_label[i], (uint64_t)s.energy_uj[i] / 1000000,
+			     (uint64_t)s.energy_uj[i] % 1000000);
+
+	emit(&off, "# TYPE spbm_up gauge\nspbm_up 1\n");
+	return off < BODY_LEN ? off : BODY_LEN - 1;
+}
+
+static size_t format_collector(void);
+
+static void send_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void serve(int fd, int snap_fd)
+{
+	const char *status = "404 Not Found";
+	size_t len = 0, hlen;
+	ssize_t n;
+
+	/* Only the request line matters; stop once it is complete */
+	while (len < REQ_LEN - 1) {
+		n = recv(fd, req + len, REQ_LEN - 1 - len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		len += n;
+		req[len] = '\0';
+		if (strchr(req, '\n'))
+			break;
+	}
+
+	if (!strncmp(req, "GET /metrics ", 13) ||
+	    !strncmp(req, "GET /metrics?", 13)) {
+		status = "200 OK";
+		len = collector ? format_collector() : format_metrics(snap_fd);
+	} else {
+		len = 0;
+	}
+
+	hlen = snprintf(head, sizeof(head),
+			"HTTP/1.0 %s\r\n"
+			"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", status, len);
+	send_all(fd, head, hlen);
+	send_all(fd, body, len);
+}
+
+/* TCP socket listening on @spec, or with SOCK_DGRAM one bound to it */
+static int listen_on(const char *spec, int type)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = type,
+		.ai_flags = AI_PASSIVE,
+	};
+	char host[256] = "";
+	const char *port = spec;
+	struct addrinfo *ai, *a;
+	const char *colon;
+	int fd = -1, one = 1, ret;
+
+	colon = strrchr(spec, ':');
+	if (colon) {
+		size_t n = colon - spec;
+
+		if (n >= sizeof(host))
+			return -1;
+		memcpy(host, spec, n);
+		host[n] = '\0';
+		port = colon + 1;
+	}
+
+	ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &ai);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", spec, gai_strerror(ret));
+		return -1;
+	}
+	for (a = ai; a; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+			    a->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, a->ai_addr, a->ai_addrlen) &&
+		    (type != SOCK_STREAM || !listen(fd, 16)))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (fd < 0)
+		perror(spec);
+	return fd;
+}
+
+/* Push mode */
+
+struct window {
+	uint64_t start_ns;
+	uint32_t n;
+	uint32_t min[SPBM_NR_POWER];
+	uint32_t max[SPBM_NR_POWER];
+	uint64_t sum[SPBM_NR_POWER];
+};
+
+static void window_reset(struct window *w, const struct spbm_snapshot *s)
+{
+	int i;
+
+	w->start_ns = s->timestamp_ns;
+	w->n = 0;
+	for (i = 0; i < SPBM_NR_POWER; i++) {
+		w->min[i] = UINT32_MAX;
+		w->max[i] = 0;
+		w->sum[i] = 0;
+	}
+}
+
+static void window_add(struct window *w, const struct spbm_snapshot *s)
+{
+	int i;
+
+	for (i = 0; i < SPBM_NR_POWER; i++) {
+		if (s->power[i] < w->min[i])
+			w->min[i] = s->power[i];
+		if (s->power[i] > w->max[i])
+			w->max[i] = s->power[i];
+		w->sum[i] += s->power[i];
+	}
+	w->n++;
+}
+
+static uint8_t *put_string(uint8_t *p, const char *str)
+{
+	size_t len = strlen(str);
+
+	p = spbm_put_varint(p, len);
+	memcpy(p, str, len);
+	return p + len;
+}
+
+/* Batch of the window ending at snapshot @s; worst case well in BATCH_LEN */
+static size_t encode_batch(uint8_t *buf, uint64_t epoch, uint32_t seq,
+			   const char *node, const struct window *w,
+			   const struct spbm_snapshot *s)
+{
+	uint8_t *p = buf;
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < SPBM_NR_POWER; i++)
+		if (power_label[i][0])
+			mask |= 1u << i;
+	for (i = 0; i < SPBM_NR_ENERGY; i++)
+		if (energy_label[i][0])
+			mask |= 1u << (SPBM_NR_POWER + i);
+
+	memcpy(p, BATCH_MAGIC, 4);
+	p += 4;
+	*p++ = BATCH_VERSION;
+	p = spbm_put_varint(p, epoch);
+	p = spbm_put_varint(p, seq);
+	p = spbm_put_varint(p, (s->timestamp_ns - w->start_ns) / 1000000);
+	p = spbm_put_varint(p, w->n);
+	p = spbm_put_varint(p, mask);
+	p = put_string(p, node);
+
+	for (i = 0; i < SPBM_NR_POWER; i++) {
+		uint32_t mean;
+
+		if (!(mask & (1u << i)))
+			continue;
+		mean = w->sum[i] / w->n;
+		p = put_string(p, power_label[i]);
+		p = spbm_put_varint(p, w->min[i]);
+		p = spbm_put_varint(p, w->max[i] - w->min[i]);
+		p = spbm_put_varint(p, mean - w->min[i]);
+	}
+	for (i = 0; i < SPBM_NR_ENERGY; i++) {
+		if (!(mask & (1u << (SPBM_NR_POWER + i))))
+			continue;
+		p = put_string(p, energy_label[i]);
+		p = spbm_put_varint(p, s->energy_uj[i]);
+	}
+	return p - buf;
+}
+
+static int connect_to(const char *spec)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *ai, *a;
+	char host[256];
+	const char *colon;
+	int fd = -1, ret;
+	size_t n;
+
+	colon = strrchr(spec, ':');
+	if (!colon || colon == spec ||
+	    (n = colon - spec) >= sizeof(host)) {
+		fprintf(stderr, "%s: expected host:port\n", spec);
+		return -1;
+	}
+	memcpy(host, spec, n);
+	host[n] = '\0';
+
+	ret = getaddrinfo(host, colon + 1, &hints, &ai);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", spec, gai_strerror(ret));
+		return -1;
+	}
+	for (a = ai; a; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+			    a->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, a->ai_addr, a->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (fd < 0)
+		perror(spec);
+	return fd;
+}
+
+static void sleep_until(struct timespec *t, long ms)
+{
+	t->tv_nsec += (ms % 1000) * 1000000;
+	t->tv_sec += ms / 1000 + t->tv_nsec / 1000000000;
+	t->tv_nsec %= 1000000000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+}
+
+static int push(int snap_fd, const char *spec, const char *node,
+		long interval, long window_s)
+{
+	static uint8_t batch[BATCH_LEN];
+	struct spbm_snapshot s;
+	struct timespec next;
+	uint64_t last_ts, epoch;
+	struct window w;
+	uint32_t seq = 0;
+	int fd;
+
+	fd = connect_to(spec);
+	if (fd < 0)
+		return 1;
+
+	if (spbm_snapshot_read(snap_fd, &s, 2))
+		return 1;
+	window_reset(&w, &s);
+	last_ts = s.timestamp_ns;
+	clock_gettime(CLOCK_REALTIME, &next);
+	epoch = next.tv_sec * 1000000000ull + next.tv_nsec;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!stop) {
+		sleep_until(&next, interval);
+		/* cached snapshots repeat; count each firmware sample once */
+		if (spbm_snapshot_read(snap_fd, &s, 2) ||
+		    s.timestamp_ns == last_ts)
+			continue;
+		last_ts = s.timestamp_ns;
+		window_add(&w, &s);
+
+		if (s.timestamp_ns - w.start_ns < window_s * 1000000000ull)
+			continue;
+		/* a lost datagram loses a window of power stats, not energy */
+		send(fd, batch, encode_batch(batch, epoch, seq++, node, &w, &s),
+		     0);
+		window_reset(&w, &s);
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* Collector mode */
+
+struct node_chan {
+	char label[LABEL_LEN];
+	uint32_t min, max, mean;	/* mW */
+	uint64_t energy_uj;		/* sum of deltas received */
+	uint64_t acc_uj;		/* node's accumulator, last batch */
+};
+
+struct node {
+	char name[NODE_LEN];
+	uint64_t seen_ns;
+	uint32_t window_ms;
+	uint32_t nsamples;
+	uint64_t epoch;
+	uint32_t seq;
+	uint64_t batches;
+	uint64_t lost;			/* batches missing from seq */
+	uint32_t mask;
+	struct node_chan ch[SPBM_NR_CHANNELS];
+};
+
+static struct node nodes[MAX_NODES];
+static int n_nodes;
+
+static const uint8_t *get_string(const uint8_t *p, const uint8_t *end,
+				 char *buf, size_t len)
+{
+	uint64_t n;
+
+	p = spbm_get_varint(p, end, &n);
+	if (!p || n >= len || n > (uint64_t)(end - p))
+		return NULL;
+	memcpy(buf, p, n);
+	buf[n] = '\0';
+	return p + n;
+}
+
+static struct node *node_get(const char *name)
+{
+	int i;
+
+	for (i = 0; i < n_nodes; i++)
+		if (!strcmp(nodes[i].name, name))
+			return &nodes[i];
+	if (n_nodes == MAX_NODES)
+		return NULL;
+	memset(&nodes[n_nodes], 0, sizeof(nodes[0]));
+	snprintf(nodes[n_nodes].name, NODE_LEN, "%s", name);
+	return &nodes[n_nodes++];
+}
+
+/* Label values end up in the exposition format verbatim */
+static bool label_ok(const char *s)
+{
+	for (; *s; s++)
+		if (*s == '"' || *s == '\\' || *s < ' ')
+			return false;
+	return true;
+}
+
+static bool node_fresh(const struct node *nd, uint64_t now)
+{
+	return now - nd->seen_ns <=
+	       (uint64_t)nd->window_ms * STALE_WINDOWS * 1000000;
+}
+
+static int decode_batch(const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	struct node_chan ch[SPBM_NR_CHANNELS];
+	uint64_t epoch, seq, window_ms, n, mask, v[3], now;
+	char name[NODE_LEN];
+	struct node *nd;
+	bool restart;
+	int i, k;
+
+	if (len < 5 || memcmp(p, BATCH_MAGIC, 4) || p[4] != BATCH_VERSION)
+		return -1;
+	p += 5;
+	if (!(p = spbm_get_varint(p, end, &epoch)) ||
+	    !(p = spbm_get_varint(p, end, &seq)) ||
+	    !(p = spbm_get_varint(p, end, &window_ms)) ||
+	    !(p = spbm_get_varint(p, end, &n)) ||
+	    !(p = spbm_get_varint(p, end, &mask)) ||
+	    !(p = get_string(p, end, name, sizeof(name))) || !n ||
+	    !label_ok(name) || mask >> SPBM_NR_CHANNELS)
+		return -1;
+
+	memset(ch, 0, sizeof(ch));
+	for (i = 0; i < SPBM_NR_CHANNELS; i++) {
+		if (!(mask & (1ull << i)))
+			continue;
+		p = get_string(p, end, ch[i].label, LABEL_LEN);
+		if (!p || !label_ok(ch[i].label))
+			return -1;
+		for (k = 0; k < (i < SPBM_NR_POWER ? 3 : 1); k++) {
+			p = spbm_get_varint(p, end, &v[k]);
+			if (!p)
+				return -1;
+		}
+		if (i < SPBM_NR_POWER) {
+			ch[i].min = v[0];
+			ch[i].max = v[0] + v[1];
+			ch[i].mean = v[0] + v[2];
+		} else {
+			ch[i].energy_uj = v[0];
+		}
+	}
+
+	nd = node_get(name);
+	if (!nd)
+		return -1;
+	/*
+	 * A later epoch is a restarted sender, and so is any other epoch
+	 * once the node has gone quiet. Otherwise only a seq past the last
+	 * one counts; duplicates and late datagrams are dropped.
+	 */
+	now = spbm_now_ns();
+	restart = !nd->batches || epoch > nd->epoch ||
+		  (epoch != nd->epoch && !node_fresh(nd, now));
+	if (!restart && (epoch != nd->epoch || seq <= nd->seq))
+		return -1;
+	if (!restart)
+		nd->lost += seq - nd->seq - 1;
+
+	for (i = 0; i < SPBM_NR_CHANNELS; i++) {
+		uint64_t acc = ch[i].energy_uj;
+
+		ch[i].acc_uj = acc;
+		ch[i].energy_uj = nd->ch[i].energy_uj;
+		if (i >= SPBM_NR_POWER && (mask & nd->mask & (1ull << i))) {
+			/* a reloaded driver counts from 0 again */
+			ch[i].energy_uj += acc >= nd->ch[i].acc_uj ?
+					   acc - nd->ch[i].acc_uj : acc;
+		}
+		nd->ch[i] = ch[i];
+	}
+	nd->epoch = epoch;
+	nd->seq = seq;
+	nd->batches++;
+	nd->mask = mask;
+	nd->window_ms = window_ms;
+	nd->nsamples = n;
+	nd->seen_ns = now;
+	return 0;
+}
+
+static void emit_mw(size_t *off, const char *series, const char *node,
+		    const char *chan, uint32_t mw)
+{
+	emit(off, "%s{node=\"%s\",channel=\"%s\"} %u.%03u\n", series, node,
+	     chan, mw / 1000, mw % 1000);
+}
+
+static size_t format_collector(void)
+{
+	static const char * const stat[] = { "min", "max", "mean" };
+	uint64_t now = spbm_now_ns();
+	size_t off = 0;
+	int i, c, k, fresh = 0;
+
+	for (k = 0; k < 3; k++) {
+		emit(&off, "# HELP spbm_node_power_%s_watts Per-node %s over the last pushed window.\n"
+			   "# TYPE spbm_node_power_%s_watts gauge\n",
+		     stat[k], stat[k], stat[k]);
+		for (i = 0; i < n_nodes; i++) {
+			const struct node *nd = &nodes[i];
+
+			for (c = 0; c < SPBM_NR_POWER; c++) {
+				const struct node_chan *ch = &nd->ch[c];
+				char series[48];
+
+				if (!(nd->mask & (1u << c)))
+					continue;
+				snprintf(series, sizeof(series),
+					 "spbm_node_power_%s_watts", stat[k]);
+				emit_mw(&off, series, nd->name, ch->label,
+					k == 0 ? ch->min :
+					k == 1 ? ch->max : ch->mean);
+			}
+		}
+	}
+
+	emit(&off, "# HELP spbm_node_energy_joules_total Per-node energy since the collector first heard from it.\n"
+		   "# TYPE spbm_node_energy_joules_total counter\n");
+	for (i = 0; i < n_nodes; i++) {
+		for (c = SPBM_NR_POWER; c < SPBM_NR_CHANNELS; c++) {
+			const struct node_chan *ch = &nodes[i].ch[c];
+
+			if (!(nodes[i].mask & (1u << c)))
+				continue;
+			emit(&off, "spbm_node_energy_joules_total{node=\"%s\",channel=\"%s\"} %" PRIu64 ".%06" PRIu64 "\n",
+			     nodes[i].name, ch->label, ch->energy_uj / 1000000,
+			     ch->energy_uj % 1000000);
+		}
+	}
+
+	emit(&off, "# HELP spbm_node_lost_batches_total Windows missing from the node's sequence.\n"
+		   "# TYPE spbm_node_lost_batches_total counter\n");
+	for (i = 0; i < n_nodes; i++)
+		emit(&off, "spbm_node_lost_batches_total{node=\"%s\"} %" PRIu64 "\n",
+		     nodes[i].name, nodes[i].lost);
+
+	emit(&off, "# HELP spbm_node_up Whether the node pushed within %d windows.\n"
+		   "# TYPE spbm_node_up gauge\n", STALE_WINDOWS);
+	for (i = 0; i < n_nodes; i++) {
+		bool up = node_fresh(&nodes[i], now);
+
+		emit(&off, "spbm_node_up{node=\"%s\"} %d\n", nodes[i].name, up);
+		fresh += up;
+	}
+
+	/*
+	 * Rack sums over nodes that are up. The sum of means is the rack's
+	 * mean; the sum of maxima is an upper bound, as nodes peak apart.
+	 */
+	emit(&off, "# HELP spbm_rack_power_watts Sum of node means, nodes that are up.\n"
+		   "# TYPE spbm_rack_power_watts gauge\n"
+		   "# HELP spbm_rack_power_max_watts Sum of node maxima, nodes that are up.\n"
+		   "# TYPE spbm_rack_power_max_watts gauge\n");
+	for (k = 0; k < (int)N_RACK; k++) {
+		uint64_t mean = 0, max = 0;
+
+		for (i = 0; i < n_nodes; i++) {
+			if (!node_fresh(&nodes[i], now))
+				continue;
+			for (c = 0; c < SPBM_NR_POWER; c++) {
+				if ((nodes[i].mask & (1u << c)) &&
+				    !strcmp(nodes[i].ch[c].label,
+					    rack_channels[k])) {
+					mean += nodes[i].ch[c].mean;
+					max += nodes[i].ch[c].max;
+				}
+			}
+		}
+		emit(&off, "spbm_rack_power_watts{channel=\"%s\"} %" PRIu64 ".%03" PRIu64 "\n",
+		     rack_channels[k], mean / 1000, mean % 1000);
+		emit(&off, "spbm_rack_power_max_watts{channel=\"%s\"} %" PRIu64 ".%03" PRIu64 "\n",
+		     rack_channels[k], max / 1000, max % 1000);
+	}
+	emit(&off, "# TYPE spbm_rack_nodes gauge\nspbm_rack_nodes %d\n", fresh);
+	return off < BODY_LEN ? off : BODY_LEN - 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-l [addr:]port]\n"
+		"       %s -p host:port [-i ms] [-w s] [-n node]\n"
+		"       %s -c [addr:]port [-l [addr:]port]\n"
+		"  -l addr  listen address (default :" DEFAULT_PORT ")\n"
+		"  -p addr  push batches to a collector over UDP\n"
+		"  -i ms    push: sample period (default 100)\n"
+		"  -w s     push: window per batch (default 10)\n"
+		"  -n node  push: node name (default: hostname)\n"
+		"  -c addr  collect batches on this UDP address, serve them on -l\n",
+		prog, prog, prog);
+}
+
+/* Serve one scrape; -1 if the listening socket is broken */
+static int http_accept(int lfd, int snap_fd)
+{
+	struct timeval tmo = { .tv_sec = 5 };
+	int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+	if (fd < 0) {
+		if (errno == EINTR || errno == ECONNABORTED)
+			return 0;
+		perror("accept");
+		return -1;
+	}
+	/* A stalled client must not block the next scrape forever */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof(tmo));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
+	serve(fd, snap_fd);
+	close(fd);
+	return 0;
+}
+
+static int collect(int lfd, const char *spec)
+{
+	static uint8_t batch[BATCH_LEN];
+	struct pollfd pfd[2];
+	int ufd;
+
+	ufd = listen_on(spec, SOCK_DGRAM);
+	if (ufd < 0)
+		return 1;
+
+	pfd[0].fd = lfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ufd;
+	pfd[1].events = POLLIN;
+	while (!stop) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			ssize_t n = recv(ufd, batch, sizeof(batch), MSG_DONTWAIT);
+
+			if (n > 0)
+				decode_batch(batch, n);
+		}
+		if ((pfd[0].revents & POLLIN) && http_accept(lfd, -1))
+			break;
+	}
+
+	close(ufd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *listen_spec = ":" DEFAULT_PORT;
+	const char *push_spec = NULL, *collect_spec = NULL;
+	long interval = 100, window_s = 10;
+	struct sigaction sa = { 0 };
+	struct spbm_snapshot snap;
+	char hwmon[256], node[NODE_LEN] = "";
+	int opt, snap_fd, lfd, i, ret = 0;
+
+	while ((opt = getopt(argc, argv, "l:p:i:w:n:c:h")) != -1) {
+		switch (opt) {
+		case 'l':
+			listen_spec = optarg;
+			break;
+		case 'p':
+			push_spec = optarg;
+			break;
+		case 'i':
+			interval = strtol(optarg, NULL, 0);
+			break;
+		case 'w':
+			window_s = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			snprintf(node, sizeof(node), "%s", optarg);
+			break;
+		case 'c':
+			collect_spec = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if ((push_spec && collect_spec) || interval < 10 || window_s < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* No SA_RESTART, so accept(), poll() and sleeps return on SIGTERM */
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* The collector needs no local device */
+	if (collect_spec) {
+		collector = true;
+		lfd = listen_on(listen_spec, SOCK_STREAM);
+		if (lfd < 0)
+			return 1;
+		ret = collect(lfd, collect_spec);
+		close(lfd);
+		return ret;
+	}
+
+	if (spbm_find_hwmon(hwmon, sizeof(hwmon))) {
+		fprintf(stderr, "Error: spbm driver not found in /sys/class/hwmon/\n");
+		return 1;
+	}
+	snap_fd = spbm_snapshot_open(hwmon);
+	if (snap_fd < 0 || spbm_snapshot_read(snap_fd, &snap, 2)) {
+		fprintf(stderr, "Error: spbm snapshot unavailable\n");
+		return 1;
+	}
+	for (i = 0; i < SPBM_NR_POWER; i++)
+		spbm_channel_label(hwmon, "power", i, power_label[i], LABEL_LEN);
+	for (i = 0; i < SPBM_NR_ENERGY; i++)
+		spbm_channel_label(hwmon, "energy", i, energy_label[i], LABEL_LEN);
+
+	if (push_spec) {
+		if (!node[0] && gethostname(node, sizeof(node) - 1))
+			snprintf(node, sizeof(node), "spark");
+		ret = push(snap_fd, push_spec, node, interval, window_s);
+		close(snap_fd);
+		return ret;
+	}
+
+	lfd = listen_on(listen_spec, SOCK_STREAM);
+	if (lfd < 0)
+		return 1;
+
+	while (!stop && !http_accept(lfd, snap_fd))
+		;
+
+	close(lfd);
+	close(snap_fd);
+	return 0;
+}
@@ -0,0 +1,611 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spbm-gpu - GPU energy per CUDA kernel
+ *
+ * Records the /dev/spbm stream while a CUDA program runs, then splits
+ * the GPU energy between the kernels it launched:
+ *
+ *   spbm-gpu capture [-l libspbmcupti.so] [-o prefix] -- program [args...]
+ *   spbm-gpu attribute [-n top] records.bin kernels.csv
+ *
+ * capture writes prefix.records (default spbm-gpu.records), the raw
+ * stream, and has libspbmcupti.so (CUDA_INJECTION64_PATH) write
+ * prefix.kernels: one "start_ns,end_ns,name" line per kernel, mapped
+ * from the GPU clock to CLOCK_MONOTONIC, the clock of every SPBM record.
+ * Any other tracer that produces the same CSV with CLOCK_MONOTONIC times
+ * works too.
+ *
+ * The attribution sweeps both timelines. In every interval where k
+ * kernels run, each one gets 1/k of the interval's time. It also gets
+ * 1/k of the energy consumed meanwhile:
+ *
+ *   gpc, gpm     EN_GPC/EN_GPM: a counter step is spread evenly over
+ *                the time since the previous step
+ *   gpc_in/out   the latest sample of the power channel, held until the
+ *                next record
+ *
+ * Time with no kernel running goes to "(idle)". The firmware updates
+ * every channel about every 100 ms, so a single short kernel gets a
+ * share of an average rather than its own reading. A kernel that runs
+ * many times still ranks correctly, because its shares add up over all
+ * its launches.
+ *
+ * Build: make -C tools
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open	434
+#endif
+
+#define SPBM_DEV	"/dev/spbm"
+#define REC_MAGIC	"SPBMGPU1"
+#define READ_BATCH	64
+
+/* Quantities attributed to kernels */
+enum {
+	Q_GPC,		/* EN_GPC, uJ */
+	Q_GPM,		/* EN_GPM, uJ */
+	Q_GPC_IN,	/* gpc_in integral, uJ */
+	Q_GPC_OUT,	/* gpc_out integral, uJ */
+	NR_Q,
+};
+
+static const struct {
+	const char *type;
+	const char *label;
+} chans[NR_Q] = {
+	[Q_GPC]		= { "energy", "gpc" },
+	[Q_GPM]		= { "energy", "gpm" },
+	[Q_GPC_IN]	= { "power", "gpc_in" },
+	[Q_GPC_OUT]	= { "power", "gpc_out" },
+};
+
+/* File header of a capture; idx[] is the record val[] index per quantity */
+struct rec_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t idx[NR_Q];
+};
+
+struct kernel {
+	uint64_t start, end;
+	char *name;
+	double share_ns;		/* time, split with concurrent kernels */
+	double q[NR_Q];
+};
+
+struct agg {
+	const char *name;
+	unsigned long launches;
+	double ns;
+	double q[NR_Q];
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/* Attribution */
+
+static struct spbm_record *load_records(const char *path,
+					struct rec_header *h, size_t *n)
+{
+	struct spbm_record *r = NULL;
+	size_t cap = 0;
+	FILE *f;
+
+	*n = 0;
+	f = fopen(path, "r");
+	if (!f || fread(h, sizeof(*h), 1, f) != 1 ||
+	    memcmp(h->magic, REC_MAGIC, sizeof(h->magic)) ||
+	    h->record_size != sizeof(*r)) {
+		fprintf(stderr, "%s: not a spbm-gpu capture\n", path);
+		if (f)
+			fclose(f);
+		return NULL;
+	}
+	for (;;) {
+		if (*n == cap) {
+			struct spbm_record *nr;
+
+			cap = cap ? 2 * cap : 4096;
+			nr = realloc(r, cap * sizeof(*r));
+			if (!nr)
+				break;
+			r = nr;
+		}
+		if (fread(&r[*n], sizeof(*r), 1, f) != 1)
+			break;
+		(*n)++;
+	}
+	fclose(f);
+	return r;
+}
+
+static int by_start(const void *a, const void *b)
+{
+	const struct kernel *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static struct kernel *load_kernels(const char *path, size_t *n)
+{
+	struct kernel *k = NULL;
+	size_t cap = 0, len = 0;
+	char *line = NULL;
+	FILE *f;
+
+	*n = 0;
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	while (getline(&line, &len, f) > 0) {
+		unsigned long long s, e;
+		int off;
+
+		/* the name is last, it may contain commas */
+		if (sscanf(line, "%llu,%llu,%n", &s, &e, &off) != 2 || e < s)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		if (*n == cap) {
+			struct kernel *nk;
+
+			cap = cap ? 2 * cap : 4096;
+			nk = realloc(k, cap * sizeof(*k));
+			if (!nk)
+				break;
+			k = nk;
+		}
+		memset(&k[*n], 0, sizeof(*k));
+		k[*n].start = s;
+		k[*n].end = e;
+		k[*n].name = strdup(line + off);
+		(*n)++;
+	}
+	free(line);
+	fclose(f);
+	if (k)
+		qsort(k, *n, sizeof(*k), by_start);
+	return k;
+}
+
+/* Energy rate of a counter, per record interval, in uJ/ns */
+static double *energy_rates(const struct spbm_record *r, size_t n, int ch)
+{
+	double *rate = calloc(n, sizeof(*rate));
+	size_t i, from = 0, j;
+
+	if (!rate)
+		return NULL;
+	for (i = 1; i < n; i++) {
+		uint32_t d = r[i].val[ch] - r[from].val[ch];
+
+		if (!d)
+			continue;
+		/* the step covers everything since the previous one */
+		for (j = from; j < i; j++)
+			rate[j] = d * 1000.0 / (r[i].timestamp_ns -
+						r[from].timestamp_ns);
+		from = i;
+	}
+	return rate;
+}
+
+static int by_energy(const void *a, const void *b)
+{
+	const struct agg *x = a, *y = b;
+	double ex = x->q[Q_GPC] + x->q[Q_GPM], ey = y->q[Q_GPC] + y->q[Q_GPM];
+
+	return ex > ey ? -1 : ex < ey;
+}
+
+static int by_name(const void *a, const void *b)
+{
+	const struct kernel *x = *(const struct kernel * const *)a;
+	const struct kernel *y = *(const struct kernel * const *)b;
+
+	return strcmp(x->name, y->name);
+}
+
+static void print_row(int rank, const struct agg *a)
+{
+	double ms = a->ns / 1e6;
+
+	if (rank)
+		printf("%4d ", rank);
+	else
+		printf("%4s ", "");
+	printf("%9lu %11.3f %10.3f %10.3f %12.1f %10.3f %10.3f  %s\n",
+	       a->launches, ms, a->q[Q_GPC] / 1e6, a->q[Q_GPM] / 1e6,
+	       a->launches ? (a->q[Q_GPC] + a->q[Q_GPM]) / a->launches : 0,
+	       a->ns ? a->q[Q_GPC_IN] / a->ns * 1e3 : 0,
+	       a->ns ? a->q[Q_GPC_OUT] / a->ns * 1e3 : 0, a->name);
+}
+
+static int cmd_attribute(int argc, char **argv)
+{
+	struct kernel *k, **active, **sorted;
+	double *rate[2], q_total[NR_Q] = { 0 };
+	struct agg idle = { .name = "(idle)" }, *agg;
+	size_t nr, nk, na = 0, nagg = 0, ri, ki = 0, i;
+	struct spbm_record *r;
+	struct rec_header h;
+	long top = 20;
+	uint64_t t;
+	int opt, q;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			top = strtol(optarg, NULL, 0);
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (optind != argc - 2)
+		return 2;
+
+	r = load_records(argv[optind], &h, &nr);
+	k = load_kernels(argv[optind + 1], &nk);
+	if (!r || !k || nr < 2 || !nk) {
+		fprintf(stderr, "need at least 2 records and 1 kernel\n");
+		return 1;
+	}
+	for (q = 0; q < NR_Q; q++) {
+		if (h.idx[q] >= SPBM_NR_CHANNELS) {
+			fprintf(stderr, "%s: bad channel index\n", argv[optind]);
+			return 1;
+		}
+	}
+	rate[Q_GPC] = energy_rates(r, nr, h.idx[Q_GPC]);
+	rate[Q_GPM] = energy_rates(r, nr, h.idx[Q_GPM]);
+	active = calloc(nk, sizeof(*active));
+	if (!rate[Q_GPC] || !rate[Q_GPM] || !active)
+		return 1;
+
+	/*
+	 * Sweep the record intervals, cut further at every kernel start and
+	 * end. Within a piece the active set and all rates are constant.
+	 */
+	t = r[0].timestamp_ns;
+	for (ri = 0; ri + 1 < nr; ri++) {
+		uint64_t rec_end = r[ri + 1].timestamp_ns;
+		double qr[NR_Q];
+
+		qr[Q_GPC] = rate[Q_GPC][ri];
+		qr[Q_GPM] = rate[Q_GPM][ri];
+		/* 1 mW is 1e-6 uJ/ns */
+		qr[Q_GPC_IN] = r[ri].val[h.idx[Q_GPC_IN]] * 1e-6;
+		qr[Q_GPC_OUT] = r[ri].val[h.idx[Q_GPC_OUT]] * 1e-6;
+
+		while (t < rec_end) {
+			uint64_t next = rec_end, dt;
+
+			/* retire kernels that ended, admit those started */
+			for (i = 0; i < na;) {
+				if (active[i]->end <= t)
+					active[i] = active[--na];
+				else
+					i++;
+			}
+			for (; ki < nk && k[ki].start <= t; ki++)
+				if (k[ki].end > t)
+					active[na++] = &k[ki];
+
+			if (ki < nk && k[ki].start < next)
+				next = k[ki].start;
+			for (i = 0; i < na; i++)
+				if (active[i]->end < next)
+					next = active[i]->end;
+
+			dt = next - t;
+			for (q = 0; q < NR_Q; q++)
+				q_total[q] += qr[q] * dt;
+			if (na) {
+				for (i = 0; i < na; i++) {
+					active[i]->share_ns += (double)dt / na;
+					for (q = 0; q < NR_Q; q++)
+						active[i]->q[q] += qr[q] * dt / na;
+				}
+			} else {
+				idle.ns += dt;
+				for (q = 0; q < NR_Q; q++)
+					idle.q[q] += qr[q] * dt;
+			}
+			t = next;
+		}
+	}
+
+	/* per kernel name */
+	sorted = malloc(nk * sizeof(*sorted));
+	agg = calloc(nk, sizeof(*agg));
+	if (!sorted || !agg)
+		return 1;
+	for (i = 0; i < nk; i++)
+		sorted[i] = &k[i];
+	qsort(sorted, nk, sizeof(*sorted), by_name);
+	for (i = 0; i < nk; i++) {
+		struct agg *a;
+
+		if (!nagg || strcmp(agg[nagg - 1].name, sorted[i]->name))
+			agg[nagg++].name = sorted[i]->name;
+		a = &agg[nagg - 1];
+		a->launches++;
+		a->ns += sorted[i]->share_ns;
+		for (q = 0; q < NR_Q; q++)
+			a->q[q] += sorted[i]->q[q];
+	}
+	qsort(agg, nagg, sizeof(*agg), by_energy);
+
+	printf("%4s %9s %11s %10s %10s %12s %10s %10s  %s\n", "rank", "launches",
+	       "time(ms)", "gpc(J)", "gpm(J)", "uJ/launch", "gpc_in(W)",
+	       "gpc_out(W)", "kernel");
+	for (i = 0; i < nagg && (top <= 0 || (long)i < top); i++)
+		print_row(i + 1, &agg[i]);
+	idle.launches = 0;
+	print_row(0, &idle);
+	printf("\n%zu records over %.3f s, %zu kernels (%zu names), gpc %.3f J, gpm %.3f J\n",
+	       nr, (r[nr - 1].timestamp_ns - r[0].timestamp_ns) / 1e9, nk, nagg,
+	       q_total[Q_GPC] / 1e6, q_total[Q_GPM] / 1e6);
+	return 0;
+}
+
+/* Capture */
+
+/* sample_channels as found, when stream_open() had to widen it */
+static char chan_path[512];
+static uint32_t chan_saved;
+static bool chan_widened;
+
+static void stream_restore(void)
+{
+	FILE *f;
+
+	if (!chan_widened)
+		return;
+	chan_widened = false;
+	f = fopen(chan_path, "w");
+	if (f && fprintf(f, "0x%x\n", chan_saved) < 0) {
+		fclose(f);
+		f = NULL;
+	}
+	/* the sysfs write itself happens at fclose() */
+	if (!f || fclose(f))
+		fprintf(stderr, "Warning: cannot restore %s to 0x%x: %s\n",
+			chan_path, chan_saved, strerror(errno));
+}
+
+static int stream_open(const char *hwmon, const uint32_t *idx)
+{
+	char *path = chan_path, buf[32];
+	uint32_t mask, need = 0, wm = READ_BATCH;
+	FILE *f;
+	int fd, i;
+
+	for (i = 0; i < NR_Q; i++)
+		need |= 1u << idx[i];
+
+	snprintf(path, sizeof(chan_path), "%s/sample_channels", hwmon);
+	f = fopen(path, "r+");
+	if (!f)
+		f = fopen(path, "r");
+	if (!f || !fgets(buf, sizeof(buf), f)) {
+		perror(path);
+		return -1;
+	}
+	mask = strtoul(buf, NULL, 0);
+	if ((mask & need) != need) {
+		rewind(f);
+		if (fprintf(f, "0x%x\n", mask | need) < 0 || fflush(f)) {
+			fprintf(stderr, "%s: needs 0x%x, cannot set it: %s\n",
+				path, need, strerror(errno));
+			fclose(f);
+			return -1;
+		}
+		chan_saved = mask;
+		chan_widened = true;
+	}
+	fclose(f);
+
+	fd = open(SPBM_DEV, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(SPBM_DEV);
+		stream_restore();
+		return -1;
+	}
+	/* batches cost less; the program's exit drains the rest */
+	ioctl(fd, SPBM_IOC_SET_WATERMARK, &wm);
+	return fd;
+}
+
+static int cmd_capture(int argc, char **argv)
+{
+	static struct spbm_record rec[READ_BATCH];
+	const char *lib = NULL, *prefix = "spbm-gpu";
+	char hwmon[256], rpath[512], kpath[512];
+	struct rec_header h = { .record_size = sizeof(struct spbm_record) };
+	struct sigaction sa = { 0 };
+	struct pollfd pfd[2];
+	int opt, fd, pidfd, i, status = 0;
+	char * const *args;
+	FILE *out;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "+l:o:")) != -1) {
+		switch (opt) {
+		case 'l':
+			lib = optarg;
+			break;
+		case 'o':
+			prefix = optarg;
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (optind >= argc)
+		return 2;
+	args = argv + optind;
+
+	if (spbm_find_hwmon(hwmon, sizeof(hwmon))) {
+		fprintf(stderr, "Error: spbm driver not found in /sys/class/hwmon/\n");
+		return 1;
+	}
+	memcpy(h.magic, REC_MAGIC, sizeof(h.magic));
+	for (i = 0; i < NR_Q; i++) {
+		int ch = spbm_channel_index(hwmon, chans[i].type, chans[i].label);
+
+		if (ch < 0) {
+			fprintf(stderr, "Error: no %s %s channel\n",
+				chans[i].label, chans[i].type);
+			return 1;
+		}
+		h.idx[i] = strcmp(chans[i].type, "energy") ? ch :
+			   SPBM_NR_POWER + ch;
+	}
+	/* a signal ends the capture through the path that restores the mask */
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	fd = stream_open(hwmon, h.idx);
+	if (fd < 0)
+		return 1;
+
+	snprintf(rpath, sizeof(rpath), "%s.records", prefix);
+	snprintf(kpath, sizeof(kpath), "%s.kernels", prefix);
+	out = fopen(rpath, "w");
+	if (!out || fwrite(&h, sizeof(h), 1, out) != 1) {
+		perror(rpath);
+		stream_restore();
+		return 1;
+	}
+
+	/* the first read() attaches; records before it would be lost */
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	poll(pfd, 1, 0);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		stream_restore();
+		return 1;
+	}
+	if (!pid) {
+		setenv("SPBM_CUPTI_TRACE", kpath, 1);
+		if (lib)
+			setenv("CUDA_INJECTION64_PATH", lib, 1);
+		execvp(args[0], args);
+		perror(args[0]);
+		_exit(127);
+	}
+	pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd < 0) {
+		perror("pidfd_open");
+		kill(pid, SIGKILL);
+		stream_restore();
+		return 1;
+	}
+
+	pfd[1].fd = pidfd;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		bool done;
+		ssize_t n;
+
+		if (stop)
+			kill(pid, SIGTERM);
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+			break;
+		done = pfd[1].revents & POLLIN;
+		if (done)
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+		if ((pfd[0].revents & POLLIN) || done) {
+			while ((n = read(fd, rec, sizeof(rec))) > 0) {
+				fwrite(rec, sizeof(rec[0]), n / sizeof(rec[0]),
+				       out);
+				if (!done)
+					break;
+			}
+		}
+		if (done)
+			break;
+	}
+	waitpid(pid, &status, 0);
+	close(pidfd);
+	close(fd);
+	stream_restore();
+	if (fclose(out)) {
+		perror(rpath);
+		return 1;
+	}
+
+	fprintf(stderr, "wrote %s and %s\n", rpath, kpath);
+	if (WIFSIGNALED(status) || WEXITSTATUS(status))
+		fprintf(stderr, "%s exited with status %d\n", args[0],
+			WIFSIGNALED(status) ? 128 + WTERMSIG(status) :
+			WEXITSTATUS(status));
+	if (access(kpath, R_OK)) {
+		fprintf(stderr, "no kernel trace; was it a CUDA program, and -l set?\n");
+		return 1;
+	}
+
+	{
+		char *av[] = { "attribute", rpath, kpath, NULL };
+
+		optind = 1;
+		return cmd_attribute(3, av);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s capture [-l libspbmcupti.so] [-o prefix] -- program [args...]\n"
+		"       %s attribute [-n top] records kernels.csv\n"
+		"\n"
+		"  -l lib     CUPTI injection library that writes the kernel trace\n"
+		"  -o prefix  output files prefix.records, prefix.kernels (default spbm-gpu)\n"
+		"  -n top     kernels to list, 0 = all (default 20)\n",
+		prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 2;
+
+	if (argc >= 2) {
+		const char *cmd = argv[1];
+
+		if (!strcmp(cmd, "capture"))
+			ret = cmd_capture(argc - 1, argv + 1);
+		else if (!strcmp(cmd, "attribute"))
+			ret = cmd_attribute(argc - 1, argv + 1);
+	}
+	if (ret == 2)
+		usage(argv[0]);
+	return ret;
+}
@@ -0,0 +1,351 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spbm-mon - low-overhead power monitor
+ *
+ * Native replacement for the sampling loop of gb10_cpu_power_monitor.sh
+ * with the same command line and output. Each sample is one pread() of
+ * the bulk snapshot on a preopened fd, paced by a timerfd so the period
+ * does not drift, and the monitored program is tracked with a pidfd
+ * instead of polling it. Nothing is forked or allocated per sample, so
+ * the monitor itself barely shows up in the cpu_e/cpu_p readings. It can
+ * additionally pin itself to one core to keep the noise in one place.
+ *
+ * --summary prints energy per accumulator, mean and peak power over the
+ * run, from snapshots taken when the program starts and exits. With
+ * -i 0 nothing is sampled in between, so the run is not perturbed at
+ * all; peak power then is not available.
+ *
+ * Build: make -C tools
+ * Usage: spbm-mon [--csv] [--summary] [-i ms] [-c cpu] [program [args...]]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open	434
+#endif
+
+/* Columns, in the order gb10_cpu_power_monitor.sh prints them */
+static const char * const columns[] = {
+	"soc_pkg", "sys_total", "cpu_p", "cpu_e", "vcore", "dc_input",
+};
+#define N_COLS	(sizeof(columns) / sizeof(columns[0]))
+
+/* Energy accumulators reported by --summary */
+static const char * const accumulators[] = {
+	"pkg", "cpu_p", "cpu_e", "gpc", "gpm",
+};
+#define N_ACC	(sizeof(accumulators) / sizeof(accumulators[0]))
+
+struct mon {
+	bool csv;
+	bool summary;
+	long interval;		/* ms, 0 = no sampling */
+	int snap_fd;
+	int col[N_COLS];	/* power[] index of each column */
+	int acc[N_ACC];		/* energy_uj[] index of each accumulator */
+	uint32_t peak[N_COLS];	/* mW */
+	uint64_t nsamples;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void print_header(const struct mon *m)
+{
+	unsigned int i;
+
+	if (m->csv) {
+		printf("sec");
+		for (i = 0; i < N_COLS; i++)
+			printf(",%s", columns[i]);
+		printf("\n");
+		return;
+	}
+
+	printf("%-8s", "sec");
+	for (i = 0; i < N_COLS; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "%s(W)", columns[i]);
+		printf(" | %12s", name);
+	}
+	printf("\n%s\n", "-------------------------------------------------------------------------------------------------------------");
+}
+
+static void print_row(struct mon *m, uint64_t n,
+		      const struct spbm_snapshot *s)
+{
+	int prec = m->interval % 1000 ? 3 : 0;
+	double sec = (double)n * m->interval / 1000;
+	unsigned int i;
+
+	if (m->csv)
+		printf("%.*f", prec, sec);
+	else
+		printf("%-8.*f", prec, sec);
+	for (i = 0; i < N_COLS; i++) {
+		double w = s ? s->power[m->col[i]] / 1000.0 : 0;
+
+		if (s && s->power[m->col[i]] > m->peak[i])
+			m->peak[i] = s->power[m->col[i]];
+
+		printf(m->csv ? ",%.3f" : " | %12.3f", w);
+	}
+	printf("\n");
+	fflush(stdout);
+	if (s)
+		m->nsamples++;
+}
+
+/*
+ * Energy is the difference of the 64-bit accumulators, so counter wraps
+ * during the run do not matter. Mean power uses the interval between
+ * the two snapshots, which is what the energy delta covers.
+ */
+static void print_summary(const struct mon *m, FILE *f,
+			  const struct spbm_snapshot *a,
+			  const struct spbm_snapshot *b, uint64_t wall_ns)
+{
+	double dt = (b->timestamp_ns - a->timestamp_ns) / 1e9;
+	unsigned int i;
+
+	fprintf(f, "\nrun time: %.3f s\n", wall_ns / 1e9);
+	fprintf(f, "%-10s %14s %12s\n", "energy", "total(J)", "mean(W)");
+	for (i = 0; i < N_ACC; i++) {
+		double j = (b->energy_uj[m->acc[i]] - a->energy_uj[m->acc[i]]) / 1e6;
+
+		if (dt > 0)
+			fprintf(f, "%-10s %14.3f %12.3f\n", accumulators[i], j, j / dt);
+		else
+			fprintf(f, "%-10s %14.3f %12s\n", accumulators[i], j, "-");
+	}
+
+	if (!m->nsamples)
+		return;
+	fprintf(f, "%-10s %12s\n", "power", "peak(W)");
+	for (i = 0; i < N_COLS; i++)
+		fprintf(f, "%-10s %12.3f\n", columns[i], m->peak[i] / 1000.0);
+}
+
+static pid_t spawn(char **argv)
+{
+	pid_t pid = fork();
+	int null;
+
+	if (pid)
+		return pid;
+
+	/* Keep the program's output out of the table/CSV */
+	null = open("/dev/null", O_WRONLY);
+	if (null >= 0) {
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		close(null);
+	}
+	execvp(argv[0], argv);
+	_exit(127);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--csv] [--summary] [-i ms] [-c cpu] [program [args...]]\n"
+		"  --csv        output CSV instead of a table\n"
+		"  -s, --summary\n"
+		"               print energy, mean and peak power at the end\n"
+		"               (to stderr while sampling, to stdout with -i 0)\n"
+		"  -i, --interval ms\n"
+		"               sample period (default 1000, minimum 10, 0 = off)\n"
+		"  -c, --cpu n  pin the monitor (not the program) to CPU n\n"
+		"\n"
+		"With a program, it is run with its output discarded and sampled\n"
+		"until it exits; the exit status is passed through. Without one,\n"
+		"sampling continues until interrupted.\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "csv", no_argument, NULL, 'C' },
+		{ "summary", no_argument, NULL, 's' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "cpu", required_argument, NULL, 'c' },
+		{ "help", no_argument, NULL, 'h' },
+		{ }
+	};
+	struct mon m = { .interval = 1000 };
+	struct itimerspec its = { 0 };
+	struct sigaction sa = { 0 };
+	struct pollfd pfd[2];
+	struct spbm_snapshot s, start;
+	uint64_t start_ns;
+	int opt, tfd, pidfd = -1, status = 0, cpu = -1;
+	char hwmon[256];
+	uint64_t n = 0;
+	unsigned int i;
+	pid_t pid = 0;
+
+	while ((opt = getopt_long(argc, argv, "+si:c:h", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'C':
+			m.csv = true;
+			break;
+		case 's':
+			m.summary = true;
+			break;
+		case 'i':
+			m.interval = strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			cpu = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (m.interval < 0 || (m.interval && m.interval < 10)) {
+		fprintf(stderr, "interval must be 0 or at least 10 ms\n");
+		return 1;
+	}
+	if (!m.interval && !m.summary) {
+		fprintf(stderr, "-i 0 needs --summary\n");
+		return 1;
+	}
+
+	if (spbm_find_hwmon(hwmon, sizeof(hwmon))) {
+		fprintf(stderr, "Error: spbm driver not found in /sys/class/hwmon/\n");
+		return 1;
+	}
+	for (i = 0; i < N_COLS; i++) {
+		m.col[i] = spbm_channel_index(hwmon, "power", columns[i]);
+		if (m.col[i] < 0) {
+			fprintf(stderr, "Error: no %s power channel\n", columns[i]);
+			return 1;
+		}
+	}
+	for (i = 0; m.summary && i < N_ACC; i++) {
+		m.acc[i] = spbm_channel_index(hwmon, "energy", accumulators[i]);
+		if (m.acc[i] < 0) {
+			fprintf(stderr, "Error: no %s energy channel\n",
+				accumulators[i]);
+			return 1;
+		}
+	}
+	m.snap_fd = spbm_snapshot_open(hwmon);
+	if (m.snap_fd < 0 || spbm_snapshot_read(m.snap_fd, &s, 2)) {
+		fprintf(stderr, "Error: spbm snapshot unavailable\n");
+		return 1;
+	}
+
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("timerfd_create");
+		return 1;
+	}
+	its.it_interval.tv_sec = m.interval / 1000;
+	its.it_interval.tv_nsec = (m.interval % 1000) * 1000000;
+	its.it_value = its.it_interval;
+
+	if (m.interval)
+		print_header(&m);
+
+	start = s;
+	start_ns = spbm_now_ns();
+	if (optind < argc) {
+		pid = spawn(argv + optind);
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		pidfd = syscall(SYS_pidfd_open, pid, 0);
+		if (pidfd < 0) {
+			perror("pidfd_open");
+			kill(pid, SIGKILL);
+			return 1;
+		}
+	}
+
+	/* Pin after forking so the program keeps its own affinity */
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set))
+			perror("sched_setaffinity");
+	}
+
+	if (m.interval) {
+		timerfd_settime(tfd, 0, &its, NULL);
+		print_row(&m, n++, &s);
+	}
+
+	pfd[0].fd = tfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = pidfd;
+	pfd[1].events = POLLIN;
+
+	while (!stop) {
+		uint64_t expirations;
+
+		if (poll(pfd, pidfd >= 0 ? 2 : 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (pidfd >= 0 && (pfd[1].revents & POLLIN))
+			break;
+		if (!(pfd[0].revents & POLLIN) ||
+		    read(tfd, &expirations, sizeof(expirations)) < 0)
+			continue;
+
+		/* A late wakeup skips rows rather than shifting the time base */
+		n += expirations - 1;
+		print_row(&m, n++, spbm_snapshot_read(m.snap_fd, &s, 2) ? NULL : &s);
+	}
+
+	if (m.summary && !spbm_snapshot_read(m.snap_fd, &s, 2))
+		print_summary(&m, m.interval ? stderr : stdout, &start, &s,
+			      spbm_now_ns() - start_ns);
+
+	if (pid > 0) {
+		if (stop)
+			kill(pid, SIGTERM);
+		waitpid(pid, &status, 0);
+		close(pidfd);
+	}
+	close(tfd);
+	close(m.snap_fd);
+
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
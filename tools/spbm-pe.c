@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spbm-pe - P-core vs E-core energy model from live load
+ *
+ * Fits, per CPU cluster, the cluster power as a linear function of how
+ * many of its cores are busy:
+ *
+ *   P_cluster = a * busy_cores + b
+ *
+ * a is the marginal cost of one busy core-second in joules (the watts
+ * one more busy core adds) and b the cluster's power with every core
+ * idle. Both come from EN_CPU_P/EN_CPU_E deltas paired with the busy
+ * time of the cluster's CPUs from /proc/stat over the same interval.
+ * The fit is a least-squares regression with exponential forgetting, so
+ * it tracks changes in frequency or workload mix.
+ *
+ * The firmware updates the counters every ~100 ms. At each tick the tool
+ * waits for the next counter update and reads /proc/stat right after it,
+ * so the two measurements cover the same interval. With sample_mode set
+ * to locked, the update comes from the /dev/spbm stream, which records
+ * each one as it happens. Otherwise the tool polls the snapshot, which
+ * only tracks the firmware with cache_ms at 0: a cached snapshot changes
+ * when the cache is refreshed, up to cache_ms after the update.
+ *
+ * Every -r seconds it prints the model and the marginal cost of moving
+ * one busy core-second from the P-cores to the E-cores. On exit it also
+ * prints the measured curve: mean cluster power over ticks binned by
+ * busy cores. A core-second on an A725 does less work than one on an
+ * X925, so this is energy per core-second, not per unit of work; divide
+ * by the relative throughput of the workload to compare efficiency.
+ *
+ * Build: make -C tools
+ * Usage: spbm-pe [-i ms] [-r s] [-f forget] [-d s]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+
+#define SPBM_DEV	"/dev/spbm"
+#define POLL_MS		5		/* snapshot poll while waiting for an update */
+#define UPDATE_WAIT_MS	150		/* give up waiting after this */
+#define READ_BATCH	16
+#define MAX_BINS	(SPBM_MAX_CPUS + 1)
+
+static const char * const cluster_name[SPBM_NR_CLUSTERS] = { "P", "E" };
+static const char * const cluster_nrg[SPBM_NR_CLUSTERS] = { "cpu_p", "cpu_e" };
+
+/* Exponentially weighted sums for y = a x + b */
+struct fit {
+	double w, x, y, xx, xy, yy;
+	unsigned long n;
+};
+
+struct bin {
+	double watts;
+	unsigned long n;
+};
+
+struct cluster {
+	int nrg;			/* energy_uj[] index */
+	int ncpus;
+	struct fit fit;
+	struct bin bin[MAX_BINS];	/* by busy cores, rounded */
+	double busy_last;		/* cores, last tick */
+	double watts_last;
+};
+
+/* Counters right after one firmware update */
+struct sample {
+	uint64_t t_ns;
+	uint64_t uj[SPBM_NR_ENERGY];
+};
+
+/* Where updates come from: stream records, or snapshot polls */
+struct source {
+	int fd;
+	bool stream;
+	bool primed;
+	uint32_t raw[SPBM_NR_ENERGY];	/* stream: last mJ reading */
+	struct sample cur;		/* stream: wrap-extended */
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void fit_add(struct fit *f, double x, double y, double forget)
+{
+	f->w = f->w * forget + 1;
+	f->x = f->x * forget + x;
+	f->y = f->y * forget + y;
+	f->xx = f->xx * forget + x * x;
+	f->xy = f->xy * forget + x * y;
+	f->yy = f->yy * forget + y * y;
+	f->n++;
+}
+
+/* 0, or -1 while the load has not varied enough to separate a from b */
+static int fit_solve(const struct fit *f, double *a, double *b, double *r2)
+{
+	double sxx = f->xx - f->x * f->x / f->w;
+	double sxy = f->xy - f->x * f->y / f->w;
+	double syy = f->yy - f->y * f->y / f->w;
+
+	if (f->n < 3 || sxx < 1e-6 * f->w)
+		return -1;
+	*a = sxy / sxx;
+	*b = (f->y - *a * f->x) / f->w;
+	*r2 = syy > 0 ? sxy * sxy / (sxx * syy) : 1;
+	return 0;
+}
+
+static void msleep(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+	while (nanosleep(&ts, &ts) && errno == EINTR && !stop)
+		;
+}
+
+static void stream_fold(struct source *src, const struct spbm_record *r)
+{
+	int i;
+
+	for (i = 0; i < SPBM_NR_ENERGY; i++) {
+		uint32_t v = r->val[SPBM_NR_POWER + i];
+
+		if (src->primed)
+			src->cur.uj[i] += (uint32_t)(v - src->raw[i]) * 1000ull;
+		src->raw[i] = v;
+	}
+	src->cur.t_ns = r->timestamp_ns;
+	src->primed = true;
+}
+
+/* Fold all pending records; -1 on error */
+static int stream_drain(struct source *src)
+{
+	struct spbm_record rec[READ_BATCH];
+	ssize_t n;
+	int i;
+
+	while ((n = read(src->fd, rec, sizeof(rec))) > 0)
+		for (i = 0; i < n / (ssize_t)sizeof(rec[0]); i++)
+			stream_fold(src, &rec[i]);
+	return n < 0 && errno != EAGAIN ? -1 : 0;
+}
+
+/*
+ * In locked mode the sampler takes one record right after each update.
+ * Records still pending are updates already past, the next one is the
+ * update to wait for.
+ */
+static int stream_wait(struct source *src, struct sample *s)
+{
+	struct pollfd pfd = { .fd = src->fd, .events = POLLIN };
+	int ret;
+
+	if (stream_drain(src))
+		return -1;
+	do
+		ret = poll(&pfd, 1, UPDATE_WAIT_MS * 2);
+	while (ret < 0 && errno == EINTR && !stop);
+	if (ret < 0 && errno != EINTR)
+		return -1;
+	if (stream_drain(src))
+		return -1;
+	*s = src->cur;
+	return 0;
+}
+
+/* Wait for the next firmware update of either cluster counter */
+static int wait_update(struct source *src, const struct cluster *cl,
+		       const struct sample *prev, struct sample *s)
+{
+	struct spbm_snapshot snap;
+	int waited, c;
+
+	if (src->stream)
+		return stream_wait(src, s);
+
+	for (waited = 0; waited <= UPDATE_WAIT_MS && !stop; waited += POLL_MS) {
+		if (spbm_snapshot_read(src->fd, &snap, 2))
+			return -1;
+		s->t_ns = snap.timestamp_ns;
+		memcpy(s->uj, snap.energy_uj, sizeof(s->uj));
+		for (c = 0; c < SPBM_NR_CLUSTERS; c++)
+			if (s->uj[cl[c].nrg] != prev->uj[cl[c].nrg])
+				return 0;
+		msleep(POLL_MS);
+	}
+	/* both clusters idle enough that nothing was counted */
+	return 0;
+}
+
+/* The stream if it is locked and samples both counters, else the snapshot */
+static int source_open(const char *hwmon, const struct cluster *cl,
+		       struct source *src)
+{
+	char mode[32], buf[32];
+	uint32_t mask = 0;
+	int c;
+
+	if (!spbm_attr_read(hwmon, "sample_mode", mode, sizeof(mode)) &&
+	    !strcmp(mode, "locked") &&
+	    !spbm_attr_read(hwmon, "sample_channels", buf, sizeof(buf))) {
+		mask = strtoul(buf, NULL, 0);
+		for (c = 0; c < SPBM_NR_CLUSTERS; c++)
+			if (!(mask & (1u << (SPBM_NR_POWER + cl[c].nrg))))
+				mask = 0;
+	}
+	if (mask) {
+		src->fd = open(SPBM_DEV, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (src->fd >= 0) {
+			src->stream = true;
+			return 0;
+		}
+		perror(SPBM_DEV);
+	}
+
+	if (!spbm_attr_read(hwmon, "cache_ms", buf, sizeof(buf)) &&
+	    strtoul(buf, NULL, 10))
+		fprintf(stderr,
+			"Warning: cache_ms is %s, updates are seen up to %s ms late;\n"
+			"         set sample_mode to locked or cache_ms to 0\n",
+			buf, buf);
+	src->fd = spbm_snapshot_open(hwmon);
+	return src->fd < 0 ? -1 : 0;
+}
+
+static void print_model(struct cluster *cl)
+{
+	double a[SPBM_NR_CLUSTERS], b, r2;
+	bool ok = true;
+	int c;
+
+	printf("%-7s %8s %9s %14s %9s %6s %7s\n", "cluster", "busy", "power(W)",
+	       "J/busy-core-s", "idle(W)", "r2", "ticks");
+	for (c = 0; c < SPBM_NR_CLUSTERS; c++) {
+		printf("%-7s %8.2f %9.3f ", cluster_name[c], cl[c].busy_last,
+		       cl[c].watts_last);
+		if (fit_solve(&cl[c].fit, &a[c], &b, &r2)) {
+			printf("%14s %9s %6s %7lu\n", "-", "-", "-",
+			       cl[c].fit.n);
+			ok = false;
+			continue;
+		}
+		printf("%14.3f %9.3f %6.3f %7lu\n", a[c], b, r2, cl[c].fit.n);
+	}
+	if (ok)
+		printf("moving 1 busy core-second P -> E: %+.3f J\n",
+		       a[SPBM_CLUSTER_E] - a[SPBM_CLUSTER_P]);
+	else
+		printf("moving 1 busy core-second P -> E: - (load has not varied yet)\n");
+	printf("\n");
+	fflush(stdout);
+}
+
+static void print_curves(const struct cluster *cl)
+{
+	int c, i;
+
+	printf("%-7s %6s %9s %7s\n", "cluster", "busy", "power(W)", "ticks");
+	for (c = 0; c < SPBM_NR_CLUSTERS; c++)
+		for (i = 0; i <= cl[c].ncpus && i < MAX_BINS; i++)
+			if (cl[c].bin[i].n)
+				printf("%-7s %6d %9.3f %7lu\n", cluster_name[c], i,
+				       cl[c].bin[i].watts / cl[c].bin[i].n,
+				       cl[c].bin[i].n);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-i ms] [-r s] [-f forget] [-d s]\n"
+		"  -i ms      tick (default 1000, minimum 200)\n"
+		"  -r s       print the model every s seconds (default 10)\n"
+		"  -f forget  per-tick weight of the past, 0..1 (default 0.995)\n"
+		"  -d s       stop after s seconds (default: on signal)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct cluster cl[SPBM_NR_CLUSTERS] = { 0 };
+	uint64_t busy_prev[SPBM_MAX_CPUS] = { 0 };
+	long interval = 1000, report = 10, duration = 0;
+	struct sample prev = { 0 }, s = { 0 };
+	struct sigaction sa = { 0 };
+	struct spbm_topology topo;
+	struct source src = { 0 };
+	uint64_t start_ns, last_report;
+	double forget = 0.995;
+	char hwmon[256];
+	long clk_tck;
+	int opt, c, cpu;
+
+	while ((opt = getopt(argc, argv, "i:r:f:d:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			report = strtol(optarg, NULL, 0);
+			break;
+		case 'f':
+			forget = strtod(optarg, NULL);
+			break;
+		case 'd':
+			duration = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (interval < 200 || report < 1 || forget <= 0 || forget > 1 ||
+	    duration < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (spbm_find_hwmon(hwmon, sizeof(hwmon))) {
+		fprintf(stderr, "Error: spbm driver not found in /sys/class/hwmon/\n");
+		return 1;
+	}
+	for (c = 0; c < SPBM_NR_CLUSTERS; c++) {
+		cl[c].nrg = spbm_channel_index(hwmon, "energy", cluster_nrg[c]);
+		if (cl[c].nrg < 0) {
+			fprintf(stderr, "Error: no %s energy channel\n",
+				cluster_nrg[c]);
+			return 1;
+		}
+	}
+	if (source_open(hwmon, cl, &src)) {
+		fprintf(stderr, "Error: spbm snapshot unavailable\n");
+		return 1;
+	}
+	if (spbm_topology_read(&topo)) {
+		fprintf(stderr, "Error: cannot read CPU topology\n");
+		return 1;
+	}
+	for (c = 0; c < SPBM_NR_CLUSTERS; c++)
+		cl[c].ncpus = topo.count[c];
+	clk_tck = sysconf(_SC_CLK_TCK);
+
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* start on an update edge too; polling needs a reading to compare */
+	if ((!src.stream && wait_update(&src, cl, &s, &prev)) ||
+	    wait_update(&src, cl, &prev, &s) ||
+	    spbm_cpu_busy(busy_prev, topo.ncpus)) {
+		fprintf(stderr, "Error: initial sample failed\n");
+		return 1;
+	}
+	prev = s;
+	start_ns = last_report = spbm_now_ns();
+
+	while (!stop && (!duration ||
+			 spbm_now_ns() - start_ns < duration * 1000000000ull)) {
+		uint64_t busy[SPBM_MAX_CPUS] = { 0 };
+		double busy_s[SPBM_NR_CLUSTERS] = { 0 }, dt;
+
+		msleep(interval - UPDATE_WAIT_MS / 2);
+		if (stop || wait_update(&src, cl, &prev, &s) ||
+		    spbm_cpu_busy(busy, topo.ncpus))
+			break;
+		dt = (s.t_ns - prev.t_ns) / 1e9;
+		if (dt <= 0)
+			continue;
+
+		for (cpu = 0; cpu < topo.ncpus; cpu++) {
+			if (busy[cpu] >= busy_prev[cpu])
+				busy_s[topo.cluster[cpu]] +=
+					(double)(busy[cpu] - busy_prev[cpu]) /
+					clk_tck;
+			busy_prev[cpu] = busy[cpu];
+		}
+
+		for (c = 0; c < SPBM_NR_CLUSTERS; c++) {
+			struct cluster *k = &cl[c];
+			double watts = (s.uj[k->nrg] - prev.uj[k->nrg]) /
+				       1e6 / dt;
+			double cores = busy_s[c] / dt;
+			int b = (int)(cores + 0.5);
+
+			fit_add(&k->fit, cores, watts, forget);
+			if (b >= 0 && b < MAX_BINS) {
+				k->bin[b].watts += watts;
+				k->bin[b].n++;
+			}
+			k->busy_last = cores;
+			k->watts_last = watts;
+		}
+		prev = s;
+
+		if (spbm_now_ns() - last_report >= report * 1000000000ull) {
+			last_report = spbm_now_ns();
+			print_model(cl);
+		}
+	}
+
+	print_model(cl);
+	print_curves(cl);
+	close(src.fd);
+	return 0;
+}
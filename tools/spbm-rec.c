@@ -0,0 +1,795 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spbm-rec - compact long-term recorder for SPBM telemetry
+ *
+ * Records every power and energy channel into a binary log that costs a
+ * few bytes per channel and sample, and reads it back:
+ *
+ *   spbm-rec record [-i ms] [-b samples] [-d seconds] FILE
+ *   spbm-rec info FILE
+ *   spbm-rec dump [-f sec] [-t sec] FILE           CSV on stdout
+ *   spbm-rec replay [-x speed] [-f sec] [-t sec] FILE DIR
+ *
+ * replay fills DIR with the name, label and snapshot files of an spbm
+ * hwmon directory and rewrites the snapshot at the recorded pace. Tools
+ * pointed at it with SPBM_HWMON=DIR (spbm-exporter, spbm-mon, spark_pm)
+ * then show the recording as if it were live.
+ *
+ * File format, little-endian, every structure 8-byte aligned so a reader
+ * can mmap() the file and use it in place:
+ *
+ *   struct log_header     magic, channel count and labels
+ *   struct log_block...   one per block_samples samples
+ *   struct log_index[]    one per block, at header.index_off
+ *
+ * A block holds its samples column by column: first the timestamps as
+ * zigzag varints of the delta of deltas, so a regular period costs one
+ * byte, then one column per channel: the first value as a varint, a mode
+ * byte, and for mode 1 the zigzag varint deltas of the rest. Mode 0 means
+ * the value is constant over the block, which is what limits, budgets
+ * and dead channels nearly always are. Deltas are taken modulo 2^32, so
+ * the free-running energy counters wrap cleanly.
+ *
+ * The index is written when recording stops. Its time ranges allow a
+ * binary search to any point in the log. A log whose recorder was
+ * killed has index_off 0; readers then rebuild the index by walking the
+ * block headers, and lose at most the block that was being filled.
+ *
+ * Build: make -C tools
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+
+#define LOG_MAGIC	"SPBMLOG1"
+#define LOG_VERSION	1
+#define BLOCK_MAGIC	0x4b4c4253	/* "SBLK" */
+#define LABEL_LEN	24
+#define MAX_BLOCK	65536		/* samples per block */
+#define NCHAN		SPBM_NR_CHANNELS
+
+struct log_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nchan;			/* SPBM_NR_CHANNELS */
+	uint32_t npower;		/* the first npower are power, mW */
+	uint32_t block_samples;
+	uint64_t index_off;		/* 0 until recording stops */
+	uint64_t nblocks;
+	uint64_t nsamples;
+	char label[NCHAN][LABEL_LEN];	/* "" = channel not present */
+};
+
+struct log_block {
+	uint32_t magic;
+	uint32_t size;			/* bytes with header, multiple of 8 */
+	uint32_t nsamples;
+	uint32_t reserved;
+	uint64_t t_first;		/* CLOCK_MONOTONIC ns */
+	uint64_t t_last;
+};
+
+struct log_index {
+	uint64_t t_first;
+	uint64_t t_last;
+	uint64_t off;			/* of the struct log_block */
+	uint32_t nsamples;
+	uint32_t size;
+};
+
+/* Samples of one block, row by row */
+struct block_buf {
+	uint32_t n;
+	uint64_t ts[MAX_BLOCK];
+	uint32_t val[MAX_BLOCK][NCHAN];
+};
+
+static struct block_buf blk;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t u)
+{
+	return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+/* Worst case encoded size of a block of @n samples */
+static size_t block_max(uint32_t n)
+{
+	return sizeof(struct log_block) + 10 * n + NCHAN * (6 + 5 * n) + 8;
+}
+
+static size_t encode_block(const struct block_buf *b, uint8_t *out)
+{
+	struct log_block *h = (struct log_block *)out;
+	uint8_t *p = out + sizeof(*h);
+	int64_t prev_d = 0;
+	uint32_t i;
+	size_t size;
+	int c;
+
+	for (i = 1; i < b->n; i++) {
+		int64_t d = b->ts[i] - b->ts[i - 1];
+
+		p = spbm_put_varint(p, zigzag(d - prev_d));
+		prev_d = d;
+	}
+	for (c = 0; c < NCHAN; c++) {
+		bool constant = true;
+
+		for (i = 1; i < b->n && constant; i++)
+			constant = b->val[i][c] == b->val[0][c];
+		p = spbm_put_varint(p, b->val[0][c]);
+		*p++ = !constant;
+		for (i = 1; !constant && i < b->n; i++)
+			p = spbm_put_varint(p, zigzag((int32_t)(b->val[i][c] -
+								b->val[i - 1][c])));
+	}
+
+	size = p - out;
+	while (size % 8)
+		out[size++] = 0;
+
+	h->magic = BLOCK_MAGIC;
+	h->size = size;
+	h->nsamples = b->n;
+	h->reserved = 0;
+	h->t_first = b->ts[0];
+	h->t_last = b->ts[b->n - 1];
+	return size;
+}
+
+static int decode_block(const struct log_block *h, struct block_buf *b)
+{
+	const uint8_t *p = (const uint8_t *)(h + 1);
+	const uint8_t *end = (const uint8_t *)h + h->size;
+	int64_t d = 0;
+	uint64_t v;
+	uint32_t i;
+	int c;
+
+	if (!h->nsamples || h->nsamples > MAX_BLOCK)
+		return -1;
+	b->n = h->nsamples;
+	b->ts[0] = h->t_first;
+	for (i = 1; i < b->n; i++) {
+		p = spbm_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		d += unzigzag(v);
+		b->ts[i] = b->ts[i - 1] + d;
+	}
+	for (c = 0; c < NCHAN; c++) {
+		uint8_t mode;
+
+		p = spbm_get_varint(p, end, &v);
+		if (!p || p >= end)
+			return -1;
+		b->val[0][c] = v;
+		mode = *p++;
+		for (i = 1; i < b->n; i++) {
+			if (mode) {
+				p = spbm_get_varint(p, end, &v);
+				if (!p)
+					return -1;
+				b->val[i][c] = b->val[i - 1][c] +
+					       (uint32_t)unzigzag(v);
+			} else {
+				b->val[i][c] = b->val[0][c];
+			}
+		}
+	}
+	return 0;
+}
+
+/* Recording */
+
+struct recorder {
+	int fd;
+	uint64_t off;			/* where the next block goes */
+	struct log_header h;
+	struct log_index *idx;
+	size_t idx_cap;
+	uint8_t *out;
+};
+
+static int write_all(int fd, const void *buf, size_t len, uint64_t off)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = pwrite(fd, p, len, off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int flush_block(struct recorder *r)
+{
+	struct log_index *e;
+	size_t size;
+
+	if (!blk.n)
+		return 0;
+	size = encode_block(&blk, r->out);
+	if (write_all(r->fd, r->out, size, r->off))
+		return -1;
+
+	if (r->h.nblocks == r->idx_cap) {
+		size_t cap = r->idx_cap ? 2 * r->idx_cap : 64;
+		struct log_index *n = realloc(r->idx, cap * sizeof(*n));
+
+		if (!n)
+			return -1;
+		r->idx = n;
+		r->idx_cap = cap;
+	}
+	e = &r->idx[r->h.nblocks++];
+	e->t_first = blk.ts[0];
+	e->t_last = blk.ts[blk.n - 1];
+	e->off = r->off;
+	e->nsamples = blk.n;
+	e->size = size;
+
+	r->off += size;
+	r->h.nsamples += blk.n;
+	blk.n = 0;
+	return 0;
+}
+
+static int finish(struct recorder *r)
+{
+	if (flush_block(r))
+		return -1;
+	r->h.index_off = r->off;
+	if (write_all(r->fd, r->idx, r->h.nblocks * sizeof(*r->idx), r->off) ||
+	    write_all(r->fd, &r->h, sizeof(r->h), 0))
+		return -1;
+	return 0;
+}
+
+static int cmd_record(int argc, char **argv)
+{
+	struct recorder r = { .fd = -1 };
+	long interval = 100, block = 600, duration = 0;
+	uint64_t last_ts = 0, end_ns = 0;
+	struct sigaction sa = { 0 };
+	struct spbm_snapshot s;
+	struct timespec next;
+	char hwmon[256];
+	int opt, snap_fd, i;
+
+	while ((opt = getopt(argc, argv, "i:b:d:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtol(optarg, NULL, 0);
+			break;
+		case 'b':
+			block = strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			duration = strtol(optarg, NULL, 0);
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (optind != argc - 1)
+		return 2;
+	if (interval < 10 || block < 2 || block > MAX_BLOCK || duration < 0) {
+		fprintf(stderr, "need -i >= 10, 2 <= -b <= %d, -d >= 0\n",
+			MAX_BLOCK);
+		return 1;
+	}
+
+	if (spbm_find_hwmon(hwmon, sizeof(hwmon))) {
+		fprintf(stderr, "Error: spbm driver not found in /sys/class/hwmon/\n");
+		return 1;
+	}
+	snap_fd = spbm_snapshot_open(hwmon);
+	if (snap_fd < 0 || spbm_snapshot_read(snap_fd, &s, 2)) {
+		fprintf(stderr, "Error: spbm snapshot unavailable\n");
+		return 1;
+	}
+
+	memcpy(r.h.magic, LOG_MAGIC, sizeof(r.h.magic));
+	r.h.version = LOG_VERSION;
+	r.h.nchan = NCHAN;
+	r.h.npower = SPBM_NR_POWER;
+	r.h.block_samples = block;
+	for (i = 0; i < NCHAN; i++) {
+		if (i < SPBM_NR_POWER)
+			spbm_channel_label(hwmon, "power", i, r.h.label[i],
+					   LABEL_LEN);
+		else
+			spbm_channel_label(hwmon, "energy", i - SPBM_NR_POWER,
+					   r.h.label[i], LABEL_LEN);
+	}
+
+	r.out = malloc(block_max(block));
+	r.fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0644);
+	if (!r.out || r.fd < 0 || write_all(r.fd, &r.h, sizeof(r.h), 0)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	r.off = sizeof(r.h);
+
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (duration)
+		end_ns = spbm_now_ns() + duration * 1000000000ull;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!stop && (!end_ns || spbm_now_ns() < end_ns)) {
+		/* cached snapshots repeat; keep each firmware sample once */
+		if (!spbm_snapshot_read(snap_fd, &s, 2) &&
+		    s.timestamp_ns != last_ts) {
+			last_ts = s.timestamp_ns;
+			blk.ts[blk.n] = s.timestamp_ns;
+			memcpy(blk.val[blk.n], s.power, sizeof(s.power));
+			memcpy(blk.val[blk.n] + SPBM_NR_POWER, s.energy,
+			       sizeof(s.energy));
+			if (++blk.n == (uint32_t)block && flush_block(&r)) {
+				perror(argv[optind]);
+				return 1;
+			}
+		}
+
+		next.tv_nsec += (interval % 1000) * 1000000;
+		next.tv_sec += interval / 1000 + next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+				       NULL) == EINTR && !stop)
+			;
+	}
+
+	if (finish(&r)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	close(r.fd);
+	close(snap_fd);
+	fprintf(stderr, "%llu samples in %llu blocks, %llu bytes\n",
+		(unsigned long long)r.h.nsamples,
+		(unsigned long long)r.h.nblocks,
+		(unsigned long long)(r.off + r.h.nblocks * sizeof(*r.idx)));
+	free(r.idx);
+	free(r.out);
+	return 0;
+}
+
+/* Reading */
+
+struct log {
+	const uint8_t *map;
+	size_t len;
+	const struct log_header *h;
+	const struct log_index *idx;
+	size_t nidx;
+	struct log_index *scanned;	/* rebuilt index, if not indexed */
+};
+
+static int scan_blocks(struct log *l)
+{
+	uint64_t off = sizeof(*l->h);
+	size_t cap = 0;
+
+	while (off + sizeof(struct log_block) <= l->len) {
+		const struct log_block *b = (const void *)(l->map + off);
+		struct log_index *e;
+
+		if (b->magic != BLOCK_MAGIC || b->size < sizeof(*b) ||
+		    b->size % 8 || off + b->size > l->len)
+			break;
+		if (l->nidx == cap) {
+			cap = cap ? 2 * cap : 64;
+			e = realloc(l->scanned, cap * sizeof(*e));
+			if (!e)
+				return -1;
+			l->scanned = e;
+		}
+		e = &l->scanned[l->nidx++];
+		e->t_first = b->t_first;
+		e->t_last = b->t_last;
+		e->off = off;
+		e->nsamples = b->nsamples;
+		e->size = b->size;
+		off += b->size;
+	}
+	l->idx = l->scanned;
+	return 0;
+}
+
+static int log_open(struct log *l, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	memset(l, 0, sizeof(*l));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		return -1;
+	}
+	l->len = st.st_size;
+	if (l->len < sizeof(*l->h)) {
+		fprintf(stderr, "%s: too short\n", path);
+		close(fd);
+		return -1;
+	}
+	l->map = mmap(NULL, l->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (l->map == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+	l->h = (const void *)l->map;
+	if (memcmp(l->h->magic, LOG_MAGIC, sizeof(l->h->magic)) ||
+	    l->h->version != LOG_VERSION || l->h->nchan != NCHAN) {
+		fprintf(stderr, "%s: not an spbm-rec v%d log\n", path,
+			LOG_VERSION);
+		return -1;
+	}
+
+	if (l->h->index_off && l->h->index_off % 8 == 0 &&
+	    l->h->index_off + l->h->nblocks * sizeof(struct log_index) <= l->len) {
+		l->idx = (const void *)(l->map + l->h->index_off);
+		l->nidx = l->h->nblocks;
+		return 0;
+	}
+	/* unfinished recording */
+	return scan_blocks(l);
+}
+
+/* First time in the log, 0 if empty */
+static uint64_t log_start(const struct log *l)
+{
+	return l->nidx ? l->idx[0].t_first : 0;
+}
+
+/* Call @fn for each sample in [from_ns, to_ns]; stops early on non-zero */
+static int log_for_each(const struct log *l, uint64_t from_ns, uint64_t to_ns,
+			int (*fn)(void *ctx, uint64_t ts, const uint32_t *val),
+			void *ctx)
+{
+	size_t lo = 0, hi = l->nidx;
+	uint32_t i;
+
+	/* first block that ends at or after from_ns */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (l->idx[mid].t_last < from_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < l->nidx && l->idx[lo].t_first <= to_ns; lo++) {
+		const struct log_block *b = (const void *)(l->map +
+							  l->idx[lo].off);
+		int ret;
+
+		if (l->idx[lo].off + sizeof(*b) > l->len ||
+		    l->idx[lo].off + b->size > l->len || decode_block(b, &blk)) {
+			fprintf(stderr, "corrupt block at %llu\n",
+				(unsigned long long)l->idx[lo].off);
+			return -1;
+		}
+		for (i = 0; i < blk.n; i++) {
+			if (blk.ts[i] < from_ns || blk.ts[i] > to_ns)
+				continue;
+			ret = fn(ctx, blk.ts[i], blk.val[i]);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/* -f/-t are seconds from the start of the log */
+static void parse_range(const struct log *l, const char *from, const char *to,
+			uint64_t *from_ns, uint64_t *to_ns)
+{
+	uint64_t t0 = log_start(l);
+
+	*from_ns = from ? t0 + strtod(from, NULL) * 1e9 : 0;
+	*to_ns = to ? t0 + strtod(to, NULL) * 1e9 : UINT64_MAX;
+}
+
+static int cmd_info(int argc, char **argv)
+{
+	uint64_t samples = 0, dur;
+	struct log l;
+	size_t i;
+
+	if (argc != 2)
+		return 2;
+	if (log_open(&l, argv[1]))
+		return 1;
+
+	for (i = 0; i < l.nidx; i++)
+		samples += l.idx[i].nsamples;
+	dur = l.nidx ? l.idx[l.nidx - 1].t_last - l.idx[0].t_first : 0;
+
+	printf("file:      %s (%s)\n", argv[1],
+	       l.h->index_off ? "indexed" : "unfinished, index rebuilt");
+	printf("blocks:    %zu of up to %u samples\n", l.nidx,
+	       l.h->block_samples);
+	printf("samples:   %llu over %.3f s\n", (unsigned long long)samples,
+	       dur / 1e9);
+	if (samples)
+		printf("size:      %zu bytes, %.1f bytes/sample\n", l.len,
+		       (double)l.len / samples);
+	printf("channels: ");
+	for (i = 0; i < NCHAN; i++)
+		if (l.h->label[i][0])
+			printf(" %s%s", i < l.h->npower ? "" : "energy_",
+			       l.h->label[i]);
+	printf("\n");
+	return 0;
+}
+
+struct dump_ctx {
+	const struct log *l;
+	uint64_t t0;
+};
+
+static int dump_row(void *ctx, uint64_t ts, const uint32_t *val)
+{
+	struct dump_ctx *d = ctx;
+	int c;
+
+	printf("%.6f", (ts - d->t0) / 1e9);
+	for (c = 0; c < NCHAN; c++)
+		if (d->l->h->label[c][0])
+			printf(",%u", val[c]);
+	printf("\n");
+	return 0;
+}
+
+static int cmd_dump(int argc, char **argv)
+{
+	const char *from = NULL, *to = NULL;
+	uint64_t from_ns, to_ns;
+	struct dump_ctx d;
+	struct log l;
+	int opt, c;
+
+	while ((opt = getopt(argc, argv, "f:t:")) != -1) {
+		switch (opt) {
+		case 'f':
+			from = optarg;
+			break;
+		case 't':
+			to = optarg;
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (optind != argc - 1)
+		return 2;
+	if (log_open(&l, argv[optind]))
+		return 1;
+	parse_range(&l, from, to, &from_ns, &to_ns);
+
+	printf("time_s");
+	for (c = 0; c < NCHAN; c++)
+		if (l.h->label[c][0])
+			printf(c < (int)l.h->npower ? ",%s_mw" : ",energy_%s_mj",
+			       l.h->label[c]);
+	printf("\n");
+
+	d.l = &l;
+	d.t0 = log_start(&l);
+	return log_for_each(&l, from_ns, to_ns, dump_row, &d) ? 1 : 0;
+}
+
+struct replay_ctx {
+	int snap_fd;
+	double speed;
+	uint64_t rec_t0;		/* first replayed sample */
+	uint64_t now_t0;		/* when it was replayed */
+	uint32_t last_raw[SPBM_NR_ENERGY];
+	uint64_t energy_mj[SPBM_NR_ENERGY];
+	bool started;
+};
+
+static int replay_sample(void *ctx, uint64_t ts, const uint32_t *val)
+{
+	struct replay_ctx *r = ctx;
+	struct spbm_snapshot s = { 0 };
+	struct timespec at;
+	uint64_t due;
+	int i;
+
+	if (!r->started) {
+		r->rec_t0 = ts;
+		r->now_t0 = spbm_now_ns();
+		for (i = 0; i < SPBM_NR_ENERGY; i++) {
+			r->last_raw[i] = val[SPBM_NR_POWER + i];
+			r->energy_mj[i] = r->last_raw[i];
+		}
+		r->started = true;
+	}
+
+	due = r->now_t0 + (uint64_t)((ts - r->rec_t0) / r->speed);
+	at.tv_sec = due / 1000000000;
+	at.tv_nsec = due % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) ==
+	       EINTR)
+		if (stop)
+			return 1;
+
+	s.version = SPBM_SNAPSHOT_VERSION;
+	s.size = sizeof(s);
+	s.timestamp_ns = due;
+	memcpy(s.power, val, sizeof(s.power));
+	memcpy(s.energy, val + SPBM_NR_POWER, sizeof(s.energy));
+	for (i = 0; i < SPBM_NR_ENERGY; i++) {
+		r->energy_mj[i] += (uint32_t)(s.energy[i] - r->last_raw[i]);
+		r->last_raw[i] = s.energy[i];
+		s.energy_uj[i] = r->energy_mj[i] * 1000;
+	}
+	/* same size every time, so readers holding the fd see each update */
+	if (write_all(r->snap_fd, &s, sizeof(s), 0)) {
+		perror("snapshot");
+		return -1;
+	}
+	return stop;
+}
+
+static int write_file(const char *dir, const char *name, const char *text)
+{
+	char path[512];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	fprintf(f, "%s\n", text);
+	return fclose(f);
+}
+
+static int cmd_replay(int argc, char **argv)
+{
+	struct replay_ctx r = { .speed = 1.0 };
+	const char *from = NULL, *to = NULL;
+	struct sigaction sa = { 0 };
+	uint64_t from_ns, to_ns;
+	const char *dir;
+	char path[512];
+	struct log l;
+	int opt, c, ret;
+
+	while ((opt = getopt(argc, argv, "x:f:t:")) != -1) {
+		switch (opt) {
+		case 'x':
+			r.speed = strtod(optarg, NULL);
+			break;
+		case 'f':
+			from = optarg;
+			break;
+		case 't':
+			to = optarg;
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (optind != argc - 2 || r.speed <= 0)
+		return 2;
+	if (log_open(&l, argv[optind]))
+		return 1;
+	parse_range(&l, from, to, &from_ns, &to_ns);
+	dir = argv[optind + 1];
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		perror(dir);
+		return 1;
+	}
+	if (write_file(dir, "name", "spbm")) {
+		perror(dir);
+		return 1;
+	}
+	for (c = 0; c < NCHAN; c++) {
+		char name[32];
+
+		if (!l.h->label[c][0])
+			continue;
+		if (c < (int)l.h->npower)
+			snprintf(name, sizeof(name), "power%d_label", c + 1);
+		else
+			snprintf(name, sizeof(name), "energy%d_label",
+				 c - (int)l.h->npower + 1);
+		write_file(dir, name, l.h->label[c]);
+	}
+	snprintf(path, sizeof(path), "%s/snapshot", dir);
+	r.snap_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (r.snap_fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fprintf(stderr, "replaying into %s, run consumers with SPBM_HWMON=%s\n",
+		dir, dir);
+	ret = log_for_each(&l, from_ns, to_ns, replay_sample, &r);
+	close(r.snap_fd);
+	return ret < 0 ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s record [-i ms] [-b samples] [-d seconds] FILE\n"
+		"       %s info FILE\n"
+		"       %s dump [-f sec] [-t sec] FILE\n"
+		"       %s replay [-x speed] [-f sec] [-t sec] FILE DIR\n"
+		"\n"
+		"  -i ms       sample period (default 100, the firmware period)\n"
+		"  -b samples  samples per block (default 600)\n"
+		"  -d seconds  stop recording after this long (default: on signal)\n"
+		"  -f/-t sec   range, in seconds from the start of the log\n"
+		"  -x speed    replay speed factor (default 1)\n",
+		prog, prog, prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 2;
+
+	if (argc >= 2) {
+		const char *cmd = argv[1];
+
+		argv++;
+		argc--;
+		if (!strcmp(cmd, "record"))
+			ret = cmd_record(argc, argv);
+		else if (!strcmp(cmd, "info"))
+			ret = cmd_info(argc, argv);
+		else if (!strcmp(cmd, "dump"))
+			ret = cmd_dump(argc, argv);
+		else if (!strcmp(cmd, "replay"))
+			ret = cmd_replay(argc, argv);
+		argv--;
+	}
+	if (ret == 2)
+		usage(argv[0]);
+	return ret;
+}
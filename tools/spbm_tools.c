@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Shared helpers for the SPBM userspace tools
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+
+#define HWMON_CLASS	"/sys/class/hwmon"
+
+static int read_line(const char *path, char *buf, size_t len)
+{
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return -1;
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+int spbm_find_hwmon(char *path, size_t len)
+{
+	struct dirent *de;
+	char buf[64];
+	const char *env;
+	DIR *d;
+	int ret = -1;
+
+	/* e.g. a directory filled by spbm-rec replay */
+	env = getenv("SPBM_HWMON");
+	if (env && *env) {
+		snprintf(path, len, "%s", env);
+		return 0;
+	}
+
+	d = opendir(HWMON_CLASS);
+	if (!d)
+		return -1;
+
+	while ((de = readdir(d))) {
+		char name[512];
+
+		if (strncmp(de->d_name, "hwmon", 5))
+			continue;
+		snprintf(name, sizeof(name), HWMON_CLASS "/%s/name", de->d_name);
+		if (read_line(name, buf, sizeof(buf)) || strcmp(buf, "spbm"))
+			continue;
+		snprintf(path, len, HWMON_CLASS "/%s", de->d_name);
+		ret = 0;
+		break;
+	}
+	closedir(d);
+	return ret;
+}
+
+int spbm_attr_read(const char *hwmon, const char *attr, char *buf,
+		   size_t len)
+{
+	char path[512];
+
+	snprintf(path, sizeof(path), "%s/%s", hwmon, attr);
+	return read_line(path, buf, len);
+}
+
+int spbm_channel_label(const char *hwmon, const char *type, int idx,
+		       char *buf, size_t len)
+{
+	char path[512];
+
+	snprintf(path, sizeof(path), "%s/%s%d_label", hwmon, type, idx + 1);
+	return read_line(path, buf, len);
+}
+
+int spbm_channel_index(const char *hwmon, const char *type,
+		       const char *label)
+{
+	int n = strcmp(type, "energy") ? SPBM_NR_POWER : SPBM_NR_ENERGY;
+	char buf[64];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (spbm_channel_label(hwmon, type, i, buf, sizeof(buf)))
+			continue;
+		if (!strcmp(buf, label))
+			return i;
+	}
+	return -1;
+}
+
+int spbm_snapshot_open(const char *hwmon)
+{
+	char path[512];
+
+	snprintf(path, sizeof(path), "%s/snapshot", hwmon);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+int spbm_snapshot_read(int fd, struct spbm_snapshot *s,
+		       unsigned int min_version)
+{
+	ssize_t n;
+
+	n = pread(fd, s, sizeof(*s), 0);
+	if (n < (ssize_t)offsetof(struct spbm_snapshot, power))
+		return -1;
+	if (s->version < min_version || (size_t)n < s->size) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+uint8_t *spbm_put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+const uint8_t *spbm_get_varint(const uint8_t *p, const uint8_t *end,
+			       uint64_t *v)
+{
+	uint64_t r = 0;
+	int shift;
+
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t b = *p++;
+
+		r |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = r;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+uint64_t spbm_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#define MIDR_PART(midr)		(((midr) >> 4) & 0xfff)
+#define MIDR_CORTEX_X925	0xd85
+#define MIDR_CORTEX_A725	0xd87
+
+int spbm_topology_read(struct spbm_topology *t)
+{
+	unsigned long cap[SPBM_MAX_CPUS] = { 0 };
+	unsigned long max_cap = 0;
+	bool have_midr = true;
+	char path[128], buf[64];
+	int cpu;
+
+	memset(t, 0, sizeof(*t));
+
+	for (cpu = 0; cpu < SPBM_MAX_CPUS; cpu++) {
+		unsigned long midr;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d",
+			 cpu);
+		if (access(path, F_OK))
+			break;
+
+		strncat(path, "/cpu_capacity", sizeof(path) - strlen(path) - 1);
+		cap[cpu] = read_line(path, buf, sizeof(buf)) ? 1024 :
+			   strtoul(buf, NULL, 0);
+		if (cap[cpu] > max_cap)
+			max_cap = cap[cpu];
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/regs/identification/midr_el1",
+			 cpu);
+		if (read_line(path, buf, sizeof(buf))) {
+			have_midr = false;
+			continue;
+		}
+		midr = strtoul(buf, NULL, 0);
+		if (MIDR_PART(midr) == MIDR_CORTEX_X925)
+			t->cluster[cpu] = SPBM_CLUSTER_P;
+		else if (MIDR_PART(midr) == MIDR_CORTEX_A725)
+			t->cluster[cpu] = SPBM_CLUSTER_E;
+		else
+			have_midr = false;
+	}
+	t->ncpus = cpu;
+	if (!t->ncpus)
+		return -1;
+
+	for (cpu = 0; cpu < t->ncpus; cpu++) {
+		if (!have_midr)
+			t->cluster[cpu] = cap[cpu] == max_cap ?
+					  SPBM_CLUSTER_P : SPBM_CLUSTER_E;
+		t->count[t->cluster[cpu]]++;
+	}
+	return 0;
+}
+
+int spbm_cpu_busy(uint64_t *busy, int ncpus)
+{
+	char line[512];
+	FILE *f;
+	int n = 0;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long v[8] = { 0 };
+		int cpu;
+
+		if (strncmp(line, "cpu", 3) || line[3] < '0' || line[3] > '9')
+			continue;
+		/* user nice system idle iowait irq softirq steal */
+		if (sscanf(line + 3, "%d %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &cpu, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+			   &v[6], &v[7]) < 9)
+			continue;
+		if (cpu < 0 || cpu >= ncpus)
+			continue;
+		busy[cpu] = v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+		n++;
+	}
+	fclose(f);
+	return n ? 0 : -1;
+}
+
+int spbm_parse_cpulist(const char *s, uint64_t *mask)
+{
+	char *end;
+
+	*mask = 0;
+	while (*s && *s != '\n') {
+		long a, b;
+
+		a = strtol(s, &end, 10);
+		if (end == s)
+			return -1;
+		b = a;
+		s = end;
+		if (*s == '-') {
+			b = strtol(s + 1, &end, 10);
+			if (end == s + 1)
+				return -1;
+			s = end;
+		}
+		if (a < 0 || b < a || b >= SPBM_MAX_CPUS)
+			return -1;
+		for (; a <= b; a++)
+			*mask |= 1ull << a;
+		if (*s == ',')
+			s++;
+	}
+	return 0;
+}
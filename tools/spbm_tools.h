@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Shared helpers for the SPBM userspace tools: locating the spbm hwmon
+ * device, reading the bulk snapshot, and CPU cluster topology.
+ */
+
+#ifndef _SPBM_TOOLS_H
+#define _SPBM_TOOLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spbm_uapi.h"
+
+#define SPBM_MAX_CPUS	64
+
+/*
+ * Fill @path with /sys/class/hwmon/hwmonN of the spbm driver, or with
+ * $SPBM_HWMON if that is set; 0 or -1
+ */
+int spbm_find_hwmon(char *path, size_t len);
+
+/*
+ * Index of the channel whose <type>N_label (type "power" or "energy")
+ * reads @label, 0-based as in struct spbm_snapshot, or -1.
+ */
+int spbm_channel_index(const char *hwmon, const char *type,
+		       const char *label);
+
+/* Read the first line of the hwmon attribute @attr into @buf; 0 or -1 */
+int spbm_attr_read(const char *hwmon, const char *attr, char *buf,
+		   size_t len);
+
+/* Read <type>N_label into @buf, 0 or -1 if the channel is absent */
+int spbm_channel_label(const char *hwmon, const char *type, int idx,
+		       char *buf, size_t len);
+
+/* Open the snapshot attribute of @hwmon, -1 on error */
+int spbm_snapshot_open(const char *hwmon);
+
+/*
+ * pread() one snapshot. Fails unless the kernel returned at least
+ * @min_version's fields, so callers only touch what they asked for.
+ */
+int spbm_snapshot_read(int fd, struct spbm_snapshot *s,
+		       unsigned int min_version);
+
+/*
+ * LEB128 varints, as used by spbm-rec logs and spbm-exporter batches.
+ * put writes at most 10 bytes and returns the end; get returns the byte
+ * after the varint, or NULL if it runs past @end.
+ */
+uint8_t *spbm_put_varint(uint8_t *p, uint64_t v);
+const uint8_t *spbm_get_varint(const uint8_t *p, const uint8_t *end,
+			       uint64_t *v);
+
+/* CLOCK_MONOTONIC in ns, the clock of all SPBM timestamps */
+uint64_t spbm_now_ns(void);
+
+enum spbm_cluster {
+	SPBM_CLUSTER_P,		/* Cortex-X925 */
+	SPBM_CLUSTER_E,		/* Cortex-A725 */
+	SPBM_NR_CLUSTERS,
+};
+
+struct spbm_topology {
+	int ncpus;
+	enum spbm_cluster cluster[SPBM_MAX_CPUS];
+	int count[SPBM_NR_CLUSTERS];
+};
+
+/*
+ * Classify online CPUs by MIDR part number, falling back to
+ * cpu_capacity (highest capacity = P-core) when MIDR is not exposed.
+ */
+int spbm_topology_read(struct spbm_topology *t);
+
+/* Per-CPU busy time from /proc/stat, in USER_HZ ticks */
+int spbm_cpu_busy(uint64_t *busy, int ncpus);
+
+/* Parse a cpulist ("0-3,8") into a bitmask, -1 on malformed input */
+int spbm_parse_cpulist(const char *s, uint64_t *mask);
+
+#endif /* _SPBM_TOOLS_H */
@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * libspbmcupti - CUDA kernel trace for spbm-gpu
+ *
+ * A CUPTI injection library: with CUDA_INJECTION64_PATH pointing at it,
+ * the CUDA driver loads it into the program and calls
+ * InitializeInjection(), no change or rebuild of the program needed.
+ * It records every kernel with CUPTI's concurrent kernel activity and at
+ * exit writes $SPBM_CUPTI_TRACE as "start_ns,end_ns,name" lines.
+ *
+ * CUPTI timestamps are on the GPU's clock. They are mapped to
+ * CLOCK_MONOTONIC, the clock of SPBM records, by a line through two
+ * (CUPTI, CLOCK_MONOTONIC) pairs taken at init and at exit, which also
+ * absorbs a rate difference between the two clocks. Names are as CUPTI
+ * reports them, mangled; pipe the spbm-gpu report through c++filt.
+ *
+ * Build: make -C tools cupti [CUDA=/usr/local/cuda]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cupti.h>
+
+#define BUF_SIZE	(8 << 20)
+#define BUF_ALIGN	8
+
+struct kernel {
+	uint64_t start, end;	/* CUPTI clock */
+	char *name;
+};
+
+struct clock_pair {
+	uint64_t cupti, mono;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kernel *kernels;
+static size_t nr_kernels, cap_kernels;
+static unsigned long dropped;
+static struct clock_pair cal[2];
+
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Bracket the CUPTI read with two clock reads and keep the midpoint */
+static void calibrate(struct clock_pair *c)
+{
+	uint64_t before = mono_ns(), after;
+
+	cuptiGetTimestamp(&c->cupti);
+	after = mono_ns();
+	c->mono = before + (after - before) / 2;
+}
+
+static uint64_t to_mono(uint64_t t)
+{
+	double span = (double)(cal[1].cupti - cal[0].cupti);
+	double rate = span > 0 ? (cal[1].mono - cal[0].mono) / span : 1;
+
+	return cal[0].mono + (int64_t)(((double)t - cal[0].cupti) * rate);
+}
+
+static void CUPTIAPI buffer_requested(uint8_t **buf, size_t *size,
+				      size_t *max_records)
+{
+	*buf = aligned_alloc(BUF_ALIGN, BUF_SIZE);
+	*size = *buf ? BUF_SIZE : 0;
+	*max_records = 0;
+}
+
+static void CUPTIAPI buffer_completed(CUcontext ctx, uint32_t stream,
+				      uint8_t *buf, size_t size, size_t valid)
+{
+	CUpti_Activity *rec = NULL;
+	size_t lost = 0;
+
+	(void)ctx;
+	(void)size;
+	pthread_mutex_lock(&lock);
+	while (cuptiActivityGetNextRecord(buf, valid, &rec) == CUPTI_SUCCESS) {
+		/* start, end and name sit at the same place in every version */
+		const CUpti_ActivityKernel4 *k = (const void *)rec;
+		struct kernel *e;
+
+		if (rec->kind != CUPTI_ACTIVITY_KIND_KERNEL &&
+		    rec->kind != CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL)
+			continue;
+		if (nr_kernels == cap_kernels) {
+			size_t cap = cap_kernels ? 2 * cap_kernels : 65536;
+			struct kernel *nk = realloc(kernels, cap * sizeof(*nk));
+
+			if (!nk) {
+				dropped++;
+				continue;
+			}
+			kernels = nk;
+			cap_kernels = cap;
+		}
+		e = &kernels[nr_kernels++];
+		e->start = k->start;
+		e->end = k->end;
+		e->name = strdup(k->name ? k->name : "(unknown)");
+	}
+	if (cuptiActivityGetNumDroppedRecords(ctx, stream, &lost) ==
+	    CUPTI_SUCCESS)
+		dropped += lost;
+	pthread_mutex_unlock(&lock);
+	free(buf);
+}
+
+static void write_trace(void)
+{
+	const char *path = getenv("SPBM_CUPTI_TRACE");
+	FILE *f;
+	size_t i;
+
+	cuptiActivityFlushAll(CUPTI_ACTIVITY_FLAG_FLUSH_FORCED);
+	calibrate(&cal[1]);
+	if (!path)
+		return;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < nr_kernels; i++)
+		fprintf(f, "%llu,%llu,%s\n",
+			(unsigned long long)to_mono(kernels[i].start),
+			(unsigned long long)to_mono(kernels[i].end),
+			kernels[i].name);
+	if (dropped)
+		fprintf(stderr, "spbmcupti: %lu kernel records dropped\n",
+			dropped);
+	pthread_mutex_unlock(&lock);
+	if (fclose(f))
+		perror(path);
+}
+
+int InitializeInjection(void)
+{
+	if (cuptiActivityRegisterCallbacks(buffer_requested,
+					   buffer_completed) != CUPTI_SUCCESS ||
+	    cuptiActivityEnable(CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL) !=
+	    CUPTI_SUCCESS) {
+		fprintf(stderr, "spbmcupti: cannot enable kernel activity\n");
+		return 0;
+	}
+	calibrate(&cal[0]);
+	atexit(write_trace);
+	return 1;
+}
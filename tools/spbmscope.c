@@ -0,0 +1,505 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * libspbmscope - energy per code region, see spbmscope.h
+ *
+ * Each thread owns an open-addressed table of labels, keyed by the label
+ * pointer. Only the owner writes it; counters are updated with relaxed
+ * atomic stores so that spbm_scope_report() may read them from another
+ * thread while scopes are running. Tables are linked into a global list
+ * on first use and kept after the thread exits, so short-lived worker
+ * threads still show up in the report.
+ *
+ * The mmap path extends the raw u32 mJ counters to 64 bits in a shared
+ * word per domain. Its low 32 bits always equal the raw value they were
+ * extended from, so a CAS loop can advance it without a lock from any
+ * thread. An advance of more than half a wrap (~6 h at 100 W) looks
+ * like a reader that raced ahead, so after RESYNC_NS without a read the
+ * extension is taken from the driver's 64-bit accumulator instead.
+ *
+ * Build: make -C tools libspbmscope.so
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spbm_tools.h"
+#include "spbmscope.h"
+
+#define SPBM_DEV	"/dev/spbm"
+#define SPBM_PAGE	4096
+#define TABLE_SIZE	256		/* labels per thread, power of 2 */
+#define HIST_BUCKETS	64		/* [2^i, 2^(i+1)), bucket 0 holds 0 too */
+#define RESYNC_NS	(600 * 1000000000ull)	/* half a wrap takes > 1 kW */
+#define IDLE_MARK_NS	1000000000ull	/* ext_ns granularity */
+
+static const char * const domain_label[SPBM_SCOPE_NR_DOMAINS] = {
+	"pkg", "cpu_p", "cpu_e",
+};
+
+enum source {
+	SOURCE_NONE,
+	SOURCE_MMAP,
+	SOURCE_SNAPSHOT,
+};
+
+struct entry {
+	const char *label;		/* NULL = free */
+	uint64_t count;
+	uint64_t ns;
+	uint64_t uj[SPBM_SCOPE_NR_DOMAINS];
+	uint64_t ns_hist[HIST_BUCKETS];
+	uint64_t uj_hist[HIST_BUCKETS];	/* pkg energy */
+};
+
+struct table {
+	struct table *next;
+	uint64_t dropped;		/* scopes that found the table full */
+	struct entry e[TABLE_SIZE];
+};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static enum source source;
+static int init_ret;
+
+/* SOURCE_MMAP */
+static const volatile uint32_t *page;
+static uint32_t reg[SPBM_SCOPE_NR_DOMAINS];	/* word offsets */
+static uint64_t ext[SPBM_SCOPE_NR_DOMAINS];	/* mJ, see above */
+static uint64_t ext_off[SPBM_SCOPE_NR_DOMAINS];	/* ext - driver's, mJ */
+static uint64_t ext_ns;		/* last read, CLOCK_MONOTONIC_COARSE */
+
+/* SOURCE_SNAPSHOT, and SOURCE_MMAP to resync */
+static int snap_fd = -1;
+static int snap_idx[SPBM_SCOPE_NR_DOMAINS];
+
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct table *tables;
+static __thread struct table *my_table;
+
+static void store(uint64_t *p, uint64_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static int bucket(uint64_t v)
+{
+	return v ? 63 - __builtin_clzll(v) : 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t coarse_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* SPBM_SCOPE_REPORT at init; the program may change the environment */
+static char *report_path;
+
+static void report_at_exit(void)
+{
+	FILE *f;
+
+	f = strcmp(report_path, "-") ? fopen(report_path, "w") : stdout;
+	if (!f)
+		return;
+	spbm_scope_report(f);
+	if (f != stdout)
+		fclose(f);
+}
+
+static int init_snapshot(void)
+{
+	struct spbm_snapshot s;
+	char hwmon[256];
+	int i;
+
+	if (spbm_find_hwmon(hwmon, sizeof(hwmon)))
+		return -1;
+	for (i = 0; i < SPBM_SCOPE_NR_DOMAINS; i++) {
+		snap_idx[i] = spbm_channel_index(hwmon, "energy",
+						 domain_label[i]);
+		if (snap_idx[i] < 0)
+			return -1;
+	}
+	snap_fd = spbm_snapshot_open(hwmon);
+	if (snap_fd < 0)
+		return -1;
+	if (spbm_snapshot_read(snap_fd, &s, 2)) {
+		close(snap_fd);
+		snap_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* After init_snapshot(), which found the channels */
+static int init_mmap(void)
+{
+	struct spbm_layout_info li;
+	struct spbm_snapshot s;
+	void *map;
+	int fd, i;
+
+	fd = open(SPBM_DEV, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (ioctl(fd, SPBM_IOC_GET_LAYOUT, &li)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, SPBM_PAGE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	if (spbm_snapshot_read(snap_fd, &s, 2))
+		goto fail;
+
+	for (i = 0; i < SPBM_SCOPE_NR_DOMAINS; i++) {
+		int ch = SPBM_NR_POWER + snap_idx[i];
+
+		if (!(li.valid & (1u << ch)))
+			goto fail;
+		reg[i] = li.offset[ch] / 4;
+		/*
+		 * The driver folds raw deltas into its accumulator, so the
+		 * two differ by a constant; a sample racing the snapshot
+		 * is off by a few mJ, which the next extend() absorbs.
+		 */
+		ext[i] = ((const volatile uint32_t *)map)[reg[i]];
+		ext_off[i] = s.energy[snap_idx[i]] -
+			     s.energy_uj[snap_idx[i]] / 1000;
+	}
+	ext_ns = coarse_ns();
+	page = map;
+	return 0;
+
+fail:
+	munmap(map, SPBM_PAGE);
+	return -1;
+}
+
+static void do_init(void)
+{
+	const char *report = getenv("SPBM_SCOPE_REPORT");
+
+	if (init_snapshot())
+		init_ret = -1;
+	else if (!init_mmap())
+		source = SOURCE_MMAP;
+	else
+		source = SOURCE_SNAPSHOT;
+
+	if (report) {
+		report_path = strdup(report);
+		if (report_path)
+			atexit(report_at_exit);
+	}
+}
+
+int spbm_scope_init(void)
+{
+	pthread_once(&init_once, do_init);
+	return init_ret;
+}
+
+const char *spbm_scope_source(void)
+{
+	spbm_scope_init();
+	switch (source) {
+	case SOURCE_MMAP:
+		return "mmap";
+	case SOURCE_SNAPSHOT:
+		return "snapshot";
+	default:
+		return "none";
+	}
+}
+
+static uint64_t extend(int i)
+{
+	uint32_t raw = page[reg[i]];
+	uint64_t old = __atomic_load_n(&ext[i], __ATOMIC_RELAXED);
+
+	for (;;) {
+		uint32_t d = raw - (uint32_t)old;
+
+		/* equal, or a reader that raced ahead of us */
+		if ((int32_t)d <= 0)
+			return old;
+		if (__atomic_compare_exchange_n(&ext[i], &old, old + d, false,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			return old + d;
+	}
+}
+
+/* Move ext[] up to the driver's accumulator, for after a long gap */
+static void resync(void)
+{
+	struct spbm_snapshot s;
+	int i;
+
+	if (spbm_snapshot_read(snap_fd, &s, 2))
+		return;
+	for (i = 0; i < SPBM_SCOPE_NR_DOMAINS; i++) {
+		uint64_t v = s.energy_uj[snap_idx[i]] / 1000 + ext_off[i];
+		uint64_t old = __atomic_load_n(&ext[i], __ATOMIC_RELAXED);
+
+		while (v > old &&
+		       !__atomic_compare_exchange_n(&ext[i], &old, v, false,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED))
+			;
+	}
+}
+
+static void read_energy(uint64_t *uj)
+{
+	struct spbm_snapshot s;
+	uint64_t t, last;
+	int i;
+
+	switch (source) {
+	case SOURCE_MMAP:
+		/* a shared write at most once per IDLE_MARK_NS */
+		t = coarse_ns();
+		last = load(&ext_ns);
+		if (t - last >= RESYNC_NS)
+			resync();
+		if (t - last >= IDLE_MARK_NS)
+			store(&ext_ns, t);
+		for (i = 0; i < SPBM_SCOPE_NR_DOMAINS; i++)
+			uj[i] = extend(i) * 1000;
+		break;
+	case SOURCE_SNAPSHOT:
+		if (!spbm_snapshot_read(snap_fd, &s, 2)) {
+			for (i = 0; i < SPBM_SCOPE_NR_DOMAINS; i++)
+				uj[i] = s.energy_uj[snap_idx[i]];
+			break;
+		}
+		/* fall through */
+	default:
+		memset(uj, 0, SPBM_SCOPE_NR_DOMAINS * sizeof(*uj));
+	}
+}
+
+void spbm_scope_begin(struct spbm_scope *s)
+{
+	spbm_scope_init();
+	read_energy(s->uj);
+	/* after the counters, so the duration does not include reading them */
+	s->t_ns = now_ns();
+}
+
+static struct table *table_get(void)
+{
+	struct table *t = my_table;
+
+	if (t)
+		return t;
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	pthread_mutex_lock(&tables_lock);
+	t->next = tables;
+	__atomic_store_n(&tables, t, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&tables_lock);
+	my_table = t;
+	return t;
+}
+
+static struct entry *entry_get(struct table *t, const char *label)
+{
+	unsigned int h = ((uintptr_t)label >> 3) * 2654435761u;
+	unsigned int n;
+
+	for (n = 0; n < TABLE_SIZE; n++) {
+		struct entry *e = &t->e[(h + n) % TABLE_SIZE];
+		const char *l = __atomic_load_n(&e->label, __ATOMIC_RELAXED);
+
+		if (l == label)
+			return e;
+		/* free entries are zeroed by calloc() or reset */
+		if (!l) {
+			__atomic_store_n(&e->label, label, __ATOMIC_RELEASE);
+			return e;
+		}
+	}
+	return NULL;
+}
+
+void spbm_scope_end(struct spbm_scope *s, const char *label)
+{
+	uint64_t t = now_ns(), uj[SPBM_SCOPE_NR_DOMAINS], ns;
+	struct table *tb = table_get();
+	struct entry *e;
+	int i;
+
+	read_energy(uj);
+	if (!tb)
+		return;
+	e = entry_get(tb, label);
+	if (!e) {
+		store(&tb->dropped, tb->dropped + 1);
+		return;
+	}
+
+	ns = t - s->t_ns;
+	store(&e->count, e->count + 1);
+	store(&e->ns, e->ns + ns);
+	store(&e->ns_hist[bucket(ns)], e->ns_hist[bucket(ns)] + 1);
+	for (i = 0; i < SPBM_SCOPE_NR_DOMAINS; i++)
+		store(&e->uj[i], e->uj[i] + (uj[i] - s->uj[i]));
+	i = bucket(uj[SPBM_SCOPE_PKG] - s->uj[SPBM_SCOPE_PKG]);
+	store(&e->uj_hist[i], e->uj_hist[i] + 1);
+}
+
+/* Merged view of one label over all threads */
+struct merged {
+	const char *label;
+	uint64_t count;
+	uint64_t ns;
+	uint64_t uj[SPBM_SCOPE_NR_DOMAINS];
+	uint64_t ns_hist[HIST_BUCKETS];
+	uint64_t uj_hist[HIST_BUCKETS];
+};
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < ' ')
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* Non-empty buckets as [lower bound, count] pairs */
+static void json_hist(FILE *f, const uint64_t *h)
+{
+	bool first = true;
+	int i;
+
+	fputc('[', f);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!h[i])
+			continue;
+		fprintf(f, "%s[%llu,%llu]", first ? "" : ",",
+			i ? 1ull << i : 0ull, (unsigned long long)h[i]);
+		first = false;
+	}
+	fputc(']', f);
+}
+
+int spbm_scope_report(FILE *f)
+{
+	struct merged *m = NULL;
+	uint64_t dropped = 0;
+	size_t nm = 0, cap = 0, j;
+	struct table *t;
+	int i, k;
+
+	spbm_scope_init();
+	for (t = __atomic_load_n(&tables, __ATOMIC_ACQUIRE); t; t = t->next) {
+		dropped += load(&t->dropped);
+		for (i = 0; i < TABLE_SIZE; i++) {
+			const struct entry *e = &t->e[i];
+			const char *l = __atomic_load_n(&e->label,
+							__ATOMIC_ACQUIRE);
+			struct merged *x = NULL;
+
+			if (!l)
+				continue;
+			/* threads may use different copies of a label */
+			for (j = 0; j < nm && !x; j++)
+				if (m[j].label == l || !strcmp(m[j].label, l))
+					x = &m[j];
+			if (!x) {
+				if (nm == cap) {
+					struct merged *n;
+
+					cap = cap ? 2 * cap : 64;
+					n = realloc(m, cap * sizeof(*m));
+					if (!n) {
+						free(m);
+						return -1;
+					}
+					m = n;
+				}
+				x = &m[nm++];
+				memset(x, 0, sizeof(*x));
+				x->label = l;
+			}
+			x->count += load(&e->count);
+			x->ns += load(&e->ns);
+			for (k = 0; k < SPBM_SCOPE_NR_DOMAINS; k++)
+				x->uj[k] += load(&e->uj[k]);
+			for (k = 0; k < HIST_BUCKETS; k++) {
+				x->ns_hist[k] += load(&e->ns_hist[k]);
+				x->uj_hist[k] += load(&e->uj_hist[k]);
+			}
+		}
+	}
+
+	fprintf(f, "{\"source\":\"%s\",\"dropped\":%llu,\"labels\":[",
+		spbm_scope_source(), (unsigned long long)dropped);
+	for (j = 0; j < nm; j++) {
+		const struct merged *x = &m[j];
+
+		fprintf(f, "%s\n{\"label\":", j ? "," : "");
+		json_string(f, x->label);
+		fprintf(f, ",\"count\":%llu,\"duration_ns\":%llu,\"energy_uj\":{",
+			(unsigned long long)x->count, (unsigned long long)x->ns);
+		for (k = 0; k < SPBM_SCOPE_NR_DOMAINS; k++)
+			fprintf(f, "%s\"%s\":%llu", k ? "," : "", domain_label[k],
+				(unsigned long long)x->uj[k]);
+		fprintf(f, "},\"uj_per_call\":%.3f,\"duration_hist_ns\":",
+			x->count ? (double)x->uj[SPBM_SCOPE_PKG] / x->count : 0);
+		json_hist(f, x->ns_hist);
+		fprintf(f, ",\"energy_hist_uj\":");
+		json_hist(f, x->uj_hist);
+		fputc('}', f);
+	}
+	fprintf(f, "\n]}\n");
+	free(m);
+	return ferror(f) ? -1 : 0;
+}
+
+void spbm_scope_reset(void)
+{
+	struct table *t;
+
+	pthread_mutex_lock(&tables_lock);
+	for (t = tables; t; t = t->next) {
+		memset(t->e, 0, sizeof(t->e));
+		t->dropped = 0;
+	}
+	pthread_mutex_unlock(&tables_lock);
+}
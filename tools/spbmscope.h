@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * libspbmscope - energy per code region
+ *
+ * Bracket a region with spbm_scope_begin()/spbm_scope_end() to account
+ * its duration and the EN_PKG, EN_CPU_P and EN_CPU_E energy consumed
+ * meanwhile under a label:
+ *
+ *	struct spbm_scope s;
+ *
+ *	spbm_scope_begin(&s);
+ *	handle_request();
+ *	spbm_scope_end(&s, "handle_request");
+ *
+ * Counters are read from the mmap'ed SPBM page when the process may map
+ * it (CAP_PERFMON), a few loads per boundary, and from the bulk snapshot
+ * otherwise. Aggregates are kept per thread with no locking on the hot
+ * path. spbm_scope_report() merges all threads into a JSON document;
+ * with SPBM_SCOPE_REPORT=file in the environment that also happens at
+ * exit.
+ *
+ * The firmware updates the counters every ~100 ms. A single short scope
+ * therefore sees energy in steps, but the sums over many scopes converge
+ * on the true totals. Labels are compared by pointer first and must
+ * outlive the report, string literals are the intended use.
+ */
+
+#ifndef _SPBMSCOPE_H
+#define _SPBMSCOPE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum spbm_scope_domain {
+	SPBM_SCOPE_PKG,
+	SPBM_SCOPE_CPU_P,
+	SPBM_SCOPE_CPU_E,
+	SPBM_SCOPE_NR_DOMAINS,
+};
+
+struct spbm_scope {
+	uint64_t t_ns;				/* CLOCK_MONOTONIC */
+	uint64_t uj[SPBM_SCOPE_NR_DOMAINS];	/* wrap-extended */
+};
+
+/*
+ * Find the device and pick the read path. Called by the first begin if
+ * not before; returns 0, or -1 if no SPBM is available, in which case
+ * scopes only account duration.
+ */
+int spbm_scope_init(void);
+
+/* "mmap", "snapshot" or "none" */
+const char *spbm_scope_source(void);
+
+void spbm_scope_begin(struct spbm_scope *s);
+void spbm_scope_end(struct spbm_scope *s, const char *label);
+
+/* Write all labels of all threads as JSON; 0 or -1 */
+int spbm_scope_report(FILE *f);
+
+/* Zero all aggregates; not concurrently with begin/end */
+void spbm_scope_reset(void);
+
+#ifdef __cplusplus
+}
+
+namespace spbm {
+
+/* RAII scope: accounted under @label when it leaves scope */
+class scope {
+public:
+	explicit scope(const char *label) : label_(label)
+	{
+		spbm_scope_begin(&s_);
+	}
+	~scope() { spbm_scope_end(&s_, label_); }
+	scope(const scope &) = delete;
+	scope &operator=(const scope &) = delete;
+
+private:
+	struct spbm_scope s_;
+	const char *label_;
+};
+
+} /* namespace spbm */
+#endif
+
+#endif /* _SPBMSCOPE_H */